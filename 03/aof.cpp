@@ -0,0 +1,403 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <string>
+// proj
+#include "aof.h"
+
+static uint64_t monotonic_usec()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+// false if fdatasync() failed
+static bool sync_one(Aof *aof, int fd, uint64_t upto)
+{
+    uint64_t start = monotonic_usec();
+    int rv = fdatasync(fd);
+    int err = errno;
+    uint64_t us = monotonic_usec() - start;
+    if (us > aof->fsync_us_max.load(std::memory_order_relaxed))
+    {
+        aof->fsync_us_max.store(us, std::memory_order_relaxed);
+    }
+    if (rv == 0)
+    {
+        aof->fsyncs.fetch_add(1, std::memory_order_relaxed);
+        aof->fsync_error.store(false, std::memory_order_relaxed);
+        aof->synced.store(upto, std::memory_order_release);
+    }
+    else
+    {
+        aof->fsync_errno.store(err, std::memory_order_relaxed);
+        aof->fsync_errors.fetch_add(1, std::memory_order_relaxed);
+        aof->fsync_error.store(true, std::memory_order_release);
+    }
+    uint64_t one = 1;
+    ssize_t n = write(aof->done_fd, &one, sizeof(one));
+    (void)n;
+    return rv == 0;
+}
+
+static uint64_t realtime_usec()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+// syncs on request, and under AOF_FSYNC_EVERYSEC a second after the first
+// unsynced write. the fd is only closed by the loop thread while this one
+// does not hold it.
+static void *sync_thread(void *arg)
+{
+    Aof *aof = (Aof *)arg;
+    uint64_t deadline = 0; // for everysec, in realtime for the condvar
+    uint64_t retry = 0; // after a failed sync, not before this time
+    pthread_mutex_lock(&aof->mu);
+    while (!aof->stop)
+    {
+        if (!aof->retired.empty())
+        {
+            std::vector<int> fds;
+            fds.swap(aof->retired);
+            pthread_mutex_unlock(&aof->mu);
+            for (int fd : fds)
+            {
+                close(fd);
+            }
+            pthread_mutex_lock(&aof->mu);
+            continue;
+        }
+        uint64_t synced = aof->synced.load(std::memory_order_relaxed);
+        uint32_t policy = aof->policy.load(std::memory_order_relaxed);
+        bool due = aof->sync_fd >= 0 && aof->sync_req > synced;
+        if (!due && aof->sync_fd >= 0 && aof->sync_avail > synced && policy == AOF_FSYNC_EVERYSEC)
+        {
+            uint64_t now = realtime_usec();
+            if (deadline == 0)
+            {
+                deadline = now + 1000000;
+            }
+            due = now >= deadline;
+            if (!due)
+            {
+                struct timespec ts = {(time_t)(deadline / 1000000), (long)(deadline % 1000000) * 1000};
+                pthread_cond_timedwait(&aof->cond, &aof->mu, &ts);
+                continue;
+            }
+        }
+        if (!due)
+        {
+            pthread_cond_wait(&aof->cond, &aof->mu);
+            continue;
+        }
+        if (retry > realtime_usec())
+        {
+            struct timespec ts = {(time_t)(retry / 1000000), (long)(retry % 1000000) * 1000};
+            pthread_cond_timedwait(&aof->cond, &aof->mu, &ts);
+            continue;
+        }
+        deadline = 0;
+        int fd = aof->sync_fd;
+        uint64_t upto = aof->sync_avail;
+        aof->sync_fd = -1; // borrowed until the sync is done
+        pthread_mutex_unlock(&aof->mu);
+        // don't spin on a failing disk
+        retry = sync_one(aof, fd, upto) ? 0 : realtime_usec() + 1000000;
+        pthread_mutex_lock(&aof->mu);
+        aof->sync_fd = fd;
+        pthread_cond_broadcast(&aof->cond);
+    }
+    pthread_mutex_unlock(&aof->mu);
+    return NULL;
+}
+
+void aof_init(Aof *aof)
+{
+    aof->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (aof->done_fd < 0 || pthread_create(&aof->thread, NULL, &sync_thread, aof) != 0)
+    {
+        abort();
+    }
+}
+
+// wait until the sync thread does not hold the fd
+static void take_fd(Aof *aof)
+{
+    while (aof->sync_fd < 0 && aof->fd >= 0)
+    {
+        pthread_cond_wait(&aof->cond, &aof->mu);
+    }
+}
+
+bool aof_open(Aof *aof, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st = {};
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+    pthread_mutex_lock(&aof->mu);
+    aof->fd = aof->sync_fd = fd;
+    aof->file_size = (uint64_t)st.st_size;
+    aof->write_error = false;
+    aof->fsync_error.store(false, std::memory_order_relaxed);
+    pthread_mutex_unlock(&aof->mu);
+    return true;
+}
+
+bool aof_flush(Aof *aof)
+{
+    if (aof->fd < 0 || aof->buf.empty())
+    {
+        return !aof->write_error;
+    }
+    ssize_t rv = 0;
+    do
+    {
+        rv = write(aof->fd, aof->buf.data(), aof->buf.size());
+    } while (rv < 0 && errno == EINTR);
+    aof->write_error = rv < 0 || (size_t)rv < aof->buf.size();
+    if (rv > 0)
+    {
+        aof->buf.erase(aof->buf.begin(), aof->buf.begin() + rv);
+        aof->written += (uint64_t)rv;
+        aof->file_size += (uint64_t)rv;
+    }
+    pthread_mutex_lock(&aof->mu);
+    aof->sync_avail = aof->written;
+    if (aof->policy.load(std::memory_order_relaxed) == AOF_FSYNC_ALWAYS)
+    {
+        aof->sync_req = aof->written;
+    }
+    pthread_cond_broadcast(&aof->cond);
+    pthread_mutex_unlock(&aof->mu);
+    return !aof->write_error;
+}
+
+void aof_poll_done(Aof *aof)
+{
+    uint64_t cnt = 0;
+    ssize_t rv = read(aof->done_fd, &cnt, sizeof(cnt));
+    (void)rv;
+}
+
+// sync and close the current file; under `mu`
+static void close_fd(Aof *aof)
+{
+    take_fd(aof);
+    if (aof->fd < 0)
+    {
+        return;
+    }
+    if (fdatasync(aof->fd) != 0)
+    {
+        // nothing is left to retry it on; it is only counted
+        aof->fsync_errno.store(errno, std::memory_order_relaxed);
+        aof->fsync_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    close(aof->fd);
+    aof->fd = aof->sync_fd = -1;
+    aof->fsync_error.store(false, std::memory_order_relaxed);
+    aof->synced.store(aof->written, std::memory_order_release);
+}
+
+// let the loop see that `synced` moved
+static void wake_loop(Aof *aof)
+{
+    uint64_t one = 1;
+    ssize_t rv = write(aof->done_fd, &one, sizeof(one));
+    (void)rv;
+}
+
+void aof_close(Aof *aof)
+{
+    aof_flush(aof);
+    aof->written = aof_pos(aof);
+    aof->buf.clear(); // what could not be written is lost
+    pthread_mutex_lock(&aof->mu);
+    close_fd(aof);
+    aof->sync_req = aof->sync_avail = aof->written;
+    pthread_mutex_unlock(&aof->mu);
+    wake_loop(aof); // release the waiters
+}
+
+static std::string tmp_path(const char *path)
+{
+    return std::string(path) + ".tmp";
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t rv = write(fd, data, len);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return false;
+        }
+        data += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
+
+// make a rename in the directory of `path` durable
+static void sync_dir(const char *path)
+{
+    std::string dir(path);
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "." : dir.substr(0, slash + 1);
+    int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0)
+    {
+        fsync(dfd);
+        close(dfd);
+    }
+}
+
+bool aofw_create(AofWriter *w, const char *path)
+{
+    w->fd = open(tmp_path(path).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return w->fd >= 0;
+}
+
+static void w_flush(AofWriter *w)
+{
+    if (!w->failed && !write_all(w->fd, w->buf.data(), w->buf.size()))
+    {
+        w->failed = true;
+    }
+    w->bytes += w->buf.size();
+    w->buf.clear();
+}
+
+static void w_u32(AofWriter *w, uint32_t v)
+{
+    w->buf.insert(w->buf.end(), (const uint8_t *)&v, (const uint8_t *)&v + 4);
+}
+
+void aofw_put(AofWriter *w, const std::string_view *args, size_t n)
+{
+    uint32_t len = 4;
+    for (size_t i = 0; i < n; i++)
+    {
+        len += 4 + (uint32_t)args[i].size();
+    }
+    w_u32(w, len);
+    w_u32(w, (uint32_t)n);
+    for (size_t i = 0; i < n; i++)
+    {
+        w_u32(w, (uint32_t)args[i].size());
+        w->buf.insert(w->buf.end(), args[i].begin(), args[i].end());
+    }
+    if (w->buf.size() >= (1 << 16))
+    {
+        w_flush(w);
+    }
+}
+
+bool aofw_finish(AofWriter *w, const char *path)
+{
+    w_flush(w);
+    bool ok = !w->failed && fdatasync(w->fd) == 0;
+    ok = close(w->fd) == 0 && ok;
+    w->fd = -1;
+    if (!ok)
+    {
+        unlink(tmp_path(path).c_str());
+    }
+    return ok;
+}
+
+void aof_rewrite_begin(Aof *aof)
+{
+    aof->rewriting = true;
+    aof->rewrite_buf.clear();
+}
+
+bool aof_rewrite_end(Aof *aof, const char *path)
+{
+    // the old file gets everything logged so far, in case this fails
+    aof_flush(aof);
+    std::string tmp = tmp_path(path);
+    int fd = open(tmp.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    struct stat st = {};
+    bool ok = fd >= 0 &&
+              write_all(fd, aof->rewrite_buf.data(), aof->rewrite_buf.size()) &&
+              fdatasync(fd) == 0 && fstat(fd, &st) == 0 && rename(tmp.c_str(), path) == 0;
+    int err = errno;
+    aof->rewriting = false;
+    std::vector<uint8_t>().swap(aof->rewrite_buf);
+    if (!ok)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        unlink(tmp.c_str());
+        errno = err;
+        return false;
+    }
+    sync_dir(path);
+    // the new file is synced and holds every record, even those the old
+    // one failed to take
+    aof->written = aof_pos(aof);
+    aof->buf.clear();
+    aof->write_error = false;
+    pthread_mutex_lock(&aof->mu);
+    take_fd(aof);
+    aof->fsync_error.store(false, std::memory_order_relaxed);
+    if (aof->fd >= 0)
+    {
+        aof->retired.push_back(aof->fd);
+    }
+    aof->fd = aof->sync_fd = fd;
+    aof->file_size = (uint64_t)st.st_size;
+    aof->synced.store(aof->written, std::memory_order_release);
+    aof->sync_req = aof->sync_avail = aof->written;
+    pthread_cond_broadcast(&aof->cond);
+    pthread_mutex_unlock(&aof->mu);
+    wake_loop(aof);
+    return true;
+}
+
+void aof_rewrite_abort(Aof *aof, const char *path)
+{
+    aof->rewriting = false;
+    std::vector<uint8_t>().swap(aof->rewrite_buf);
+    unlink(tmp_path(path).c_str());
+}
+
+void aof_destroy(Aof *aof)
+{
+    aof_close(aof);
+    pthread_mutex_lock(&aof->mu);
+    aof->stop = true;
+    pthread_cond_broadcast(&aof->cond);
+    pthread_mutex_unlock(&aof->mu);
+    pthread_join(aof->thread, NULL);
+    for (int fd : aof->retired)
+    {
+        close(fd);
+    }
+    aof->retired.clear();
+    close(aof->done_fd);
+    aof->done_fd = -1;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <string_view>
+#include <vector>
+
+// when the append-only file is synced to disk
+enum
+{
+    AOF_FSYNC_NO = 0,       // by the OS, whenever it writes back
+    AOF_FSYNC_EVERYSEC = 1, // once a second
+    AOF_FSYNC_ALWAYS = 2,   // before the replies of the logged writes go out
+};
+
+// An append-only log with group commit: records are buffered, and written
+// with one write() per event loop iteration by aof_flush(). fdatasync() runs
+// on a background thread so the loop never waits on the disk. Positions are
+// byte counts since aof_init(), increasing across reopened files, so
+// "synced >= pos" says whether a record is durable. A failed fdatasync()
+// leaves `synced` behind, since the data may not be on disk.
+struct Aof
+{
+    int fd = -1;
+    std::vector<uint8_t> buf; // appended since the last aof_flush()
+    uint64_t written = 0; // bytes handed to write()
+    uint64_t file_size = 0; // of the current file
+    bool write_error = false; // the last write() failed; buf is kept
+    std::atomic<uint32_t> policy{AOF_FSYNC_EVERYSEC};
+    // the sync thread, and what it has made durable
+    std::atomic<uint64_t> synced{0};
+    pthread_t thread;
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    uint64_t sync_req = 0; // sync up to here, now; under `mu`
+    uint64_t sync_avail = 0; // `written`, as the thread sees it; under `mu`
+    int sync_fd = -1; // `fd`, as the thread sees it; under `mu`
+    // replaced files for the thread to close: the last close of a big
+    // unlinked file frees its blocks, which takes a while; under `mu`
+    std::vector<int> retired;
+    bool stop = false;
+    int done_fd = -1; // an eventfd, readable after each sync
+    std::atomic<size_t> fsyncs{0};
+    std::atomic<uint64_t> fsync_us_max{0};
+    // the last fdatasync() failed, with this errno; `synced` stays where it
+    // was, and the thread retries a second later
+    std::atomic<bool> fsync_error{false};
+    std::atomic<int> fsync_errno{0};
+    std::atomic<size_t> fsync_errors{0};
+    // during a rewrite, records are also kept here for the new file
+    bool rewriting = false;
+    std::vector<uint8_t> rewrite_buf;
+};
+
+// start and stop the sync thread
+void aof_init(Aof *aof);
+void aof_destroy(Aof *aof);
+// open `path` for appending; false with errno on failure
+bool aof_open(Aof *aof, const char *path);
+// write out and sync what is buffered, then close the file
+void aof_close(Aof *aof);
+// whether records are kept: the file is open, or a rewrite will create it
+inline bool aof_logging(Aof *aof)
+{
+    return aof->fd >= 0 || aof->rewriting;
+}
+// records are appended to the buffer, and are durable once
+// aof->synced >= aof_pos(aof)
+inline void aof_append(Aof *aof, const uint8_t *data, size_t len)
+{
+    if (aof->fd >= 0)
+    {
+        aof->buf.insert(aof->buf.end(), data, data + len);
+    }
+    if (aof->rewriting)
+    {
+        aof->rewrite_buf.insert(aof->rewrite_buf.end(), data, data + len);
+    }
+}
+inline uint64_t aof_pos(Aof *aof)
+{
+    return aof->written + aof->buf.size();
+}
+// write the buffer with one write(); under AOF_FSYNC_ALWAYS, also ask for a
+// sync. false if the write failed, leaving the rest buffered.
+bool aof_flush(Aof *aof);
+// clear the eventfd after it became readable
+void aof_poll_done(Aof *aof);
+
+// A rewrite replaces the log with the shortest one that builds the same
+// keyspace. A forked child writes it to `<path>.tmp` with an AofWriter,
+// from its copy of the keyspace as of the fork; the records the parent logs
+// meanwhile go to `rewrite_buf` as well, between aof_rewrite_begin() and
+// aof_rewrite_end(), which appends them to the new file and renames it over
+// `path`. If the file is not open yet, the rewrite creates it.
+struct AofWriter
+{
+    int fd = -1;
+    std::vector<uint8_t> buf;
+    size_t bytes = 0; // written so far
+    bool failed = false;
+};
+
+bool aofw_create(AofWriter *w, const char *path);
+// one command, in the request encoding
+void aofw_put(AofWriter *w, const std::string_view *args, size_t n);
+// flush and fsync; false on any error, which removes the file
+bool aofw_finish(AofWriter *w, const char *path);
+
+void aof_rewrite_begin(Aof *aof);
+// switch to the new file, leaving the old one to the sync thread to close;
+// false with errno if it could not be completed, which keeps the old one
+bool aof_rewrite_end(Aof *aof, const char *path);
+// the child failed or was killed
+void aof_rewrite_abort(Aof *aof, const char *path);
@@ -0,0 +1,135 @@
+#include <assert.h>
+#include <stdlib.h>
+// proj
+#include "arena.h"
+
+struct ArenaChunk
+{
+    ArenaChunk *next;
+};
+
+// the header of a large block
+struct alignas(16) ArenaBig
+{
+    ArenaBig *prev;
+    ArenaBig *next;
+};
+
+const size_t k_chunk_min = 256;
+const size_t k_chunk_max = 64 * 1024;
+
+static size_t round_up(size_t size)
+{
+    return (size + k_arena_align - 1) & ~(k_arena_align - 1);
+}
+
+static void push_free(Arena *arena, void *ptr, size_t size)
+{
+    void **slot = &arena->free[size / k_arena_align - 1];
+    *(void **)ptr = *slot;
+    *slot = ptr;
+}
+
+// start a new chunk; the tail of the old one goes to the free lists
+static void add_chunk(Arena *arena, size_t size)
+{
+    size_t left = arena->end - arena->cur;
+    if (left >= k_arena_align)
+    {
+        push_free(arena, arena->cur, left);
+    }
+    // small containers stay small; big ones amortize the malloc calls
+    arena->chunk_size = arena->chunk_size ? arena->chunk_size * 2 : k_chunk_min;
+    if (arena->chunk_size > k_chunk_max)
+    {
+        arena->chunk_size = k_chunk_max;
+    }
+    while (arena->chunk_size < size)
+    {
+        arena->chunk_size *= 2;
+    }
+    ArenaChunk *chunk = (ArenaChunk *)malloc(sizeof(ArenaChunk) + arena->chunk_size);
+    assert(chunk);
+    arena->mem += sizeof(ArenaChunk) + arena->chunk_size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->cur = (char *)(chunk + 1);
+    arena->end = arena->cur + arena->chunk_size;
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = round_up(size);
+    arena->used += size;
+    if (size > k_arena_small)
+    {
+        ArenaBig *big = (ArenaBig *)malloc(sizeof(ArenaBig) + size);
+        assert(big);
+        arena->mem += sizeof(ArenaBig) + size;
+        big->prev = NULL;
+        big->next = arena->big;
+        if (arena->big)
+        {
+            arena->big->prev = big;
+        }
+        arena->big = big;
+        return big + 1;
+    }
+    void **slot = &arena->free[size / k_arena_align - 1];
+    if (*slot)
+    {
+        void *ptr = *slot;
+        *slot = *(void **)ptr;
+        return ptr;
+    }
+    if ((size_t)(arena->end - arena->cur) < size)
+    {
+        add_chunk(arena, size);
+    }
+    void *ptr = arena->cur;
+    arena->cur += size;
+    return ptr;
+}
+
+void arena_free(Arena *arena, void *ptr, size_t size)
+{
+    size = round_up(size);
+    assert(arena->used >= size);
+    arena->used -= size;
+    if (size <= k_arena_small)
+    {
+        return push_free(arena, ptr, size);
+    }
+    ArenaBig *big = (ArenaBig *)ptr - 1;
+    arena->mem -= sizeof(ArenaBig) + size;
+    if (big->prev)
+    {
+        big->prev->next = big->next;
+    }
+    else
+    {
+        arena->big = big->next;
+    }
+    if (big->next)
+    {
+        big->next->prev = big->prev;
+    }
+    free(big);
+}
+
+void arena_clear(Arena *arena)
+{
+    while (arena->chunks)
+    {
+        ArenaChunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    while (arena->big)
+    {
+        ArenaBig *next = arena->big->next;
+        free(arena->big);
+        arena->big = next;
+    }
+    *arena = Arena{};
+}
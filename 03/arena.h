@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// blocks up to this size are carved from chunks; larger ones are malloc'ed
+const size_t k_arena_small = 256;
+const size_t k_arena_align = 8;
+const size_t k_arena_classes = k_arena_small / k_arena_align;
+
+struct ArenaChunk;
+struct ArenaBig;
+
+// a bump allocator for the nodes of one container. freed blocks are reused
+// through per-size free lists, and arena_clear() releases everything without
+// visiting each block. not thread-safe; the owner serializes access.
+struct Arena
+{
+    ArenaChunk *chunks = NULL;
+    char *cur = NULL; // the unused tail of the newest chunk
+    char *end = NULL;
+    size_t chunk_size = 0;           // grows geometrically
+    void *free[k_arena_classes] = {}; // singly linked through the first word
+    ArenaBig *big = NULL;            // doubly linked list of large blocks
+    size_t used = 0;                 // bytes handed out
+    size_t mem = 0;                  // bytes obtained from malloc
+};
+
+void *arena_alloc(Arena *arena, size_t size);
+// `size` must be the size passed to arena_alloc()
+void arena_free(Arena *arena, void *ptr, size_t size);
+void arena_clear(Arena *arena);
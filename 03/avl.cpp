@@ -152,10 +152,8 @@ AVLNode *avl_del(AVLNode *node)
     }
     // detach the successor
     AVLNode *root = avl_del_easy(victim);
-    // swap with the successor
-    victim->left = node->left;
-    victim->right = node->right;
-    victim->parent = node->parent;
+    // swap with the successor, including the height and cnt
+    *victim = *node;
     if (victim->left)
     {
         victim->left->parent = victim;
@@ -213,4 +211,178 @@ AVLNode *avl_offset(AVLNode *node, int64_t offset)
         }
     }
     return node;
-}
\ No newline at end of file
+}
+
+// the number of nodes before this one, by walking up the parents
+uint64_t avl_rank(AVLNode *node)
+{
+    uint64_t rank = avl_cnt(node->left);
+    for (AVLNode *parent = node->parent; parent; node = parent, parent = node->parent)
+    {
+        if (parent->right == node)
+        {
+            rank += avl_cnt(parent->left) + 1;
+        }
+    }
+    return rank;
+}
+
+static AVLNode *avl_build_range(AVLNode **nodes, size_t lo, size_t hi, AVLNode *parent)
+{
+    if (lo >= hi)
+    {
+        return NULL;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    AVLNode *node = nodes[mid];
+    node->parent = parent;
+    node->left = avl_build_range(nodes, lo, mid, node);
+    node->right = avl_build_range(nodes, mid + 1, hi, node);
+    avl_update(node);
+    return node;
+}
+
+// splitting at the middle keeps the subtree heights within 1
+AVLNode *avl_build(AVLNode **nodes, size_t n)
+{
+    return avl_build_range(nodes, 0, n, NULL);
+}
+
+// the leftmost node of the right subtree, or the first ancestor on the right
+AVLNode *avl_next(AVLNode *node)
+{
+    if (node->right)
+    {
+        node = node->right;
+        while (node->left)
+        {
+            node = node->left;
+        }
+        return node;
+    }
+    while (node->parent && node->parent->right == node)
+    {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+AVLNode *avl_prev(AVLNode *node)
+{
+    if (node->left)
+    {
+        node = node->left;
+        while (node->right)
+        {
+            node = node->right;
+        }
+        return node;
+    }
+    while (node->parent && node->parent->left == node)
+    {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+static void avl_attach(AVLNode *node, AVLNode *left, AVLNode *right)
+{
+    node->left = left;
+    node->right = right;
+    if (left)
+    {
+        left->parent = node;
+    }
+    if (right)
+    {
+        right->parent = node;
+    }
+    avl_update(node);
+}
+
+// descend the spine of the taller tree to a subtree at most 1 taller than the
+// other tree, put `mid` there, then rebalance upwards as for an insertion
+AVLNode *avl_join(AVLNode *left, AVLNode *mid, AVLNode *right)
+{
+    uint32_t hl = avl_height(left);
+    uint32_t hr = avl_height(right);
+    if (hl > hr + 1)
+    {
+        AVLNode *parent = NULL;
+        AVLNode *node = left;
+        while (avl_height(node) > hr + 1)
+        {
+            parent = node;
+            node = node->right;
+        }
+        avl_attach(mid, node, right);
+        mid->parent = parent;
+        parent->right = mid;
+        return avl_fix(mid);
+    }
+    if (hr > hl + 1)
+    {
+        AVLNode *parent = NULL;
+        AVLNode *node = right;
+        while (avl_height(node) > hl + 1)
+        {
+            parent = node;
+            node = node->left;
+        }
+        avl_attach(mid, left, node);
+        mid->parent = parent;
+        parent->left = mid;
+        return avl_fix(mid);
+    }
+    avl_attach(mid, left, right);
+    mid->parent = NULL;
+    return mid;
+}
+
+AVLNode *avl_join2(AVLNode *left, AVLNode *right)
+{
+    if (!left || !right)
+    {
+        return left ? left : right;
+    }
+    // the first node of the right tree goes in the middle
+    AVLNode *mid = right;
+    while (mid->left)
+    {
+        mid = mid->left;
+    }
+    right = avl_del(mid);
+    return avl_join(left, mid, right);
+}
+
+// split the children recursively and join the pieces back around the root;
+// the join costs telescope to O(log n) in total
+void avl_split(AVLNode *root, uint64_t rank, AVLNode **left, AVLNode **right)
+{
+    if (!root)
+    {
+        *left = *right = NULL;
+        return;
+    }
+    AVLNode *l = root->left;
+    AVLNode *r = root->right;
+    if (l)
+    {
+        l->parent = NULL;
+    }
+    if (r)
+    {
+        r->parent = NULL;
+    }
+    AVLNode *inner = NULL;
+    if (rank <= avl_cnt(l))
+    {
+        avl_split(l, rank, left, &inner);
+        *right = avl_join(inner, root, r);
+    }
+    else
+    {
+        avl_split(r, rank - avl_cnt(l) - 1, &inner, right);
+        *left = avl_join(l, root, inner);
+    }
+}
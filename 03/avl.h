@@ -32,4 +32,17 @@ inline uint32_t avl_cnt(AVLNode *node)
 // API
 AVLNode *avl_fix(AVLNode *node);
 AVLNode *avl_del(AVLNode *node);
-AVLNode *avl_offset(AVLNode *node, int64_t offset);
\ No newline at end of file
+AVLNode *avl_offset(AVLNode *node, int64_t offset);
+uint64_t avl_rank(AVLNode *node);
+// build a balanced tree from nodes in order, O(n)
+AVLNode *avl_build(AVLNode **nodes, size_t n);
+// in-order neighbors, amortized O(1) over a walk
+AVLNode *avl_next(AVLNode *node);
+AVLNode *avl_prev(AVLNode *node);
+// join two trees with `mid` in between: every node of `left` < mid < every
+// node of `right`. O(|height difference|)
+AVLNode *avl_join(AVLNode *left, AVLNode *mid, AVLNode *right);
+// join two trees where every node of `left` < every node of `right`
+AVLNode *avl_join2(AVLNode *left, AVLNode *right);
+// split into the first `rank` nodes and the rest, O(log n)
+void avl_split(AVLNode *root, uint64_t rank, AVLNode **left, AVLNode **right);
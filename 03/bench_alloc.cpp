@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <vector>
+#include "slab.h"
+
+static uint64_t now_ns()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static size_t rss_bytes()
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    size_t pages = 0, rss = 0;
+    if (f)
+    {
+        if (fscanf(f, "%zu %zu", &pages, &rss) != 2)
+        {
+            rss = 0;
+        }
+        fclose(f);
+    }
+    return rss * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+struct Obj
+{
+    void *ptr = NULL;
+    size_t size = 0;
+};
+
+static void *obj_alloc(bool slab, size_t size)
+{
+    void *p = slab ? slab_alloc(size) : malloc(size);
+    memset(p, 1, size < 64 ? size : 64); // touch it like a constructor
+    return p;
+}
+
+static void obj_free(bool slab, Obj &o)
+{
+    slab ? slab_free(o.ptr, o.size) : free(o.ptr);
+    o.ptr = NULL;
+}
+
+static void report(const char *kind, size_t n, const char *op, uint64_t t0, size_t nops, size_t live)
+{
+    printf("%-7s n=%-9zu %-10s %8.1f ns/op  rss %7.1f MB  live %7.1f MB\n", kind, n, op,
+           double(now_ns() - t0) / nops, rss_bytes() / 1e6, live / 1e6);
+}
+
+// sizes like the server's objects: keys' entries, connections, small nodes
+static const size_t k_sizes[] = {48, 96, 200, 520};
+
+static void bench(bool slab, size_t n)
+{
+    const char *name = slab ? "slab" : "malloc";
+    srand(1);
+    std::vector<Obj> objs(n);
+    size_t live = 0;
+    uint64_t t0 = now_ns();
+    for (Obj &o : objs)
+    {
+        o.size = k_sizes[rand() % 4];
+        o.ptr = obj_alloc(slab, o.size);
+        live += o.size;
+    }
+    report(name, n, "fill", t0, n, live);
+
+    // replace random objects with ones of random sizes
+    const size_t nops = 4 * n;
+    t0 = now_ns();
+    for (size_t i = 0; i < nops; i++)
+    {
+        Obj &o = objs[rand() % n];
+        live -= o.size;
+        obj_free(slab, o);
+        o.size = k_sizes[rand() % 4];
+        o.ptr = obj_alloc(slab, o.size);
+        live += o.size;
+    }
+    report(name, n, "churn", t0, nops, live);
+
+    // drop 3/4 of the objects at random, then grow back with one size
+    t0 = now_ns();
+    size_t nfree = 0;
+    for (Obj &o : objs)
+    {
+        if (rand() % 4)
+        {
+            live -= o.size;
+            obj_free(slab, o);
+            nfree++;
+        }
+    }
+    for (Obj &o : objs)
+    {
+        if (!o.ptr)
+        {
+            o.size = k_sizes[1];
+            o.ptr = obj_alloc(slab, o.size);
+            live += o.size;
+        }
+    }
+    report(name, n, "regrow", t0, 2 * nfree, live);
+
+    for (Obj &o : objs)
+    {
+        obj_free(slab, o);
+    }
+}
+
+// usage: bench_alloc [n ...]; each run is a fresh process, for its RSS
+int main(int argc, char **argv)
+{
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; i++)
+    {
+        sizes.push_back(strtoull(argv[i], NULL, 10));
+    }
+    if (sizes.empty())
+    {
+        sizes = {1000000, 5000000};
+    }
+    for (size_t n : sizes)
+    {
+        for (bool slab : {false, true})
+        {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                bench(slab, n);
+                fflush(stdout);
+                _exit(0);
+            }
+            waitpid(pid, NULL, 0);
+        }
+    }
+    return 0;
+}
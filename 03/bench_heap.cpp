@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "heap.h"
+
+static uint64_t now_ns()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static void report(const char *kind, size_t n, const char *op, uint64_t t0, size_t nops)
+{
+    printf("%-7s n=%-9zu %-10s %8.1f ns/op\n", kind, n, op, double(now_ns() - t0) / nops);
+}
+
+// the binary heap as the server used it for TTLs
+static void heap_delete(std::vector<HeapItem> &a, size_t pos)
+{
+    a[pos] = a.back();
+    a.pop_back();
+    if (pos < a.size())
+    {
+        heap_update(a.data(), pos, a.size());
+    }
+}
+
+static void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t)
+{
+    if (pos < a.size())
+    {
+        a[pos] = t;
+    }
+    else
+    {
+        pos = a.size();
+        a.push_back(t);
+    }
+    heap_update(a.data(), pos, a.size());
+}
+
+// timers due at random times in [0, n) ms
+static void bench(bool dary, size_t n)
+{
+    const char *name = dary ? "4-ary" : "binary";
+    srand(1);
+    std::vector<uint64_t> due(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        due[i] = rand() % n;
+    }
+    std::vector<size_t> refs(n, (size_t)-1);
+    std::vector<HeapItem> bin;
+    DHeap dh;
+
+    uint64_t t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+        HeapItem item = {due[i], &refs[i]};
+        dary ? dheap_upsert(&dh, refs[i], item) : heap_upsert(bin, refs[i], item);
+    }
+    report(name, n, "insert", t0, n);
+
+    // PEXPIRE on keys that have a TTL
+    const size_t nprobe = 1000000;
+    t0 = now_ns();
+    for (size_t i = 0; i < nprobe; i++)
+    {
+        size_t j = rand() % n;
+        HeapItem item = {(uint64_t)(rand() % n), &refs[j]};
+        dary ? dheap_upsert(&dh, refs[j], item) : heap_upsert(bin, refs[j], item);
+    }
+    report(name, n, "update", t0, nprobe);
+
+    // the clock advances; 1% of the timers expire per tick
+    std::vector<HeapItem> out;
+    size_t popped = 0;
+    t0 = now_ns();
+    for (uint64_t now = n / 100; now <= n / 2; now += n / 100)
+    {
+        if (dary)
+        {
+            out.clear();
+            dheap_pop_expired(&dh, now, (size_t)-1, out);
+            popped += out.size();
+        }
+        else
+        {
+            for (; !bin.empty() && bin[0].val < now; popped++)
+            {
+                *bin[0].ref = -1;
+                heap_delete(bin, 0);
+            }
+        }
+    }
+    report(name, n, "expire1%", t0, popped);
+
+    // then the rest expires at once
+    popped = 0;
+    t0 = now_ns();
+    if (dary)
+    {
+        out.clear();
+        dheap_pop_expired(&dh, (uint64_t)-1, (size_t)-1, out);
+        popped = out.size();
+    }
+    else
+    {
+        for (; !bin.empty(); popped++)
+        {
+            *bin[0].ref = -1;
+            heap_delete(bin, 0);
+        }
+    }
+    report(name, n, "expireall", t0, popped);
+    dheap_free(&dh);
+}
+
+// usage: bench_heap [n ...]
+int main(int argc, char **argv)
+{
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; i++)
+    {
+        sizes.push_back(strtoull(argv[i], NULL, 10));
+    }
+    if (sizes.empty())
+    {
+        sizes = {1000000, 10000000};
+    }
+    for (size_t n : sizes)
+    {
+        bench(false, n);
+        bench(true, n);
+    }
+    return 0;
+}
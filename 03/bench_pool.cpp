@@ -0,0 +1,175 @@
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include "thread_pool.h"
+
+static uint64_t now_ns()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static void report(const char *kind, size_t nt, const char *op, uint64_t t0, size_t nops)
+{
+    printf("%-7s threads=%-3zu %-12s %8.1f ns/op\n", kind, nt, op, double(now_ns() - t0) / nops);
+}
+
+// the previous pool: one deque behind one mutex
+struct LockedPool
+{
+    std::vector<pthread_t> threads;
+    std::deque<Task> queue;
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+    bool stop = false;
+};
+
+static void *locked_worker(void *arg)
+{
+    LockedPool *lp = (LockedPool *)arg;
+    while (true)
+    {
+        pthread_mutex_lock(&lp->mu);
+        while (lp->queue.empty() && !lp->stop)
+        {
+            pthread_cond_wait(&lp->not_empty, &lp->mu);
+        }
+        if (lp->queue.empty())
+        {
+            pthread_mutex_unlock(&lp->mu);
+            return NULL;
+        }
+        Task t = lp->queue.front();
+        lp->queue.pop_front();
+        pthread_mutex_unlock(&lp->mu);
+        t.f(t.arg);
+    }
+}
+
+static void locked_queue(LockedPool *lp, void (*f)(void *), void *arg)
+{
+    pthread_mutex_lock(&lp->mu);
+    lp->queue.push_back(Task{f, arg, NULL, NULL});
+    pthread_cond_signal(&lp->not_empty);
+    pthread_mutex_unlock(&lp->mu);
+}
+
+static std::atomic<size_t> g_ran{0};
+static size_t g_done = 0;
+
+static void work(void *)
+{
+    g_ran.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void done(void *)
+{
+    g_done++;
+}
+
+// a binary tree of tasks, each spawning its children from a worker
+static void spawn(void *arg)
+{
+    size_t depth = (size_t)arg;
+    g_ran.fetch_add(1, std::memory_order_relaxed);
+    if (depth > 0)
+    {
+        // the pool is reachable from the task through a global
+        extern TheadPool g_tp;
+        thread_pool_queue(&g_tp, &spawn, (void *)(depth - 1));
+        thread_pool_queue(&g_tp, &spawn, (void *)(depth - 1));
+    }
+}
+
+TheadPool g_tp;
+
+static void wait_ran(size_t n)
+{
+    while (g_ran.load() < n)
+    {
+        sched_yield();
+    }
+}
+
+// usage: bench_pool [threads ...]
+int main(int argc, char **argv)
+{
+    std::vector<size_t> nthreads;
+    for (int i = 1; i < argc; i++)
+    {
+        nthreads.push_back(strtoull(argv[i], NULL, 10));
+    }
+    if (nthreads.empty())
+    {
+        nthreads = {1, 4};
+    }
+    const size_t n = 1000000;
+    for (size_t nt : nthreads)
+    {
+        // fire and forget from the loop thread
+        LockedPool lp;
+        lp.threads.resize(nt);
+        for (pthread_t &t : lp.threads)
+        {
+            pthread_create(&t, NULL, &locked_worker, &lp);
+        }
+        g_ran = 0;
+        uint64_t t0 = now_ns();
+        for (size_t i = 0; i < n; i++)
+        {
+            locked_queue(&lp, &work, NULL);
+        }
+        wait_ran(n);
+        report("locked", nt, "queue", t0, n);
+        pthread_mutex_lock(&lp.mu);
+        lp.stop = true;
+        pthread_cond_broadcast(&lp.not_empty);
+        pthread_mutex_unlock(&lp.mu);
+        for (pthread_t &t : lp.threads)
+        {
+            pthread_join(t, NULL);
+        }
+
+        thread_pool_init(&g_tp, nt);
+        g_ran = 0;
+        t0 = now_ns();
+        for (size_t i = 0; i < n; i++)
+        {
+            thread_pool_queue(&g_tp, &work, NULL);
+        }
+        wait_ran(n);
+        report("steal", nt, "queue", t0, n);
+
+        // submit, then collect the callbacks through the eventfd
+        g_ran = 0;
+        g_done = 0;
+        t0 = now_ns();
+        for (size_t i = 0; i < n; i++)
+        {
+            thread_pool_submit(&g_tp, &work, NULL, &done);
+        }
+        while (g_done < n)
+        {
+            struct pollfd pfd = {thread_pool_done_fd(&g_tp), POLLIN, 0};
+            poll(&pfd, 1, -1);
+            thread_pool_poll_done(&g_tp);
+        }
+        report("steal", nt, "submit+done", t0, n);
+
+        // tasks spawned by tasks go to the worker's deque and get stolen
+        const size_t depth = 19; // 2^20 - 1 tasks
+        g_ran = 0;
+        t0 = now_ns();
+        thread_pool_queue(&g_tp, &spawn, (void *)depth);
+        wait_ran((1u << (depth + 1)) - 1);
+        report("steal", nt, "spawn", t0, (1u << (depth + 1)) - 1);
+
+        thread_pool_destroy(&g_tp);
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "snapshot.h"
+
+static uint64_t now_ns()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static void report(const char *op, size_t n, size_t bytes, uint64_t t0)
+{
+    double sec = double(now_ns() - t0) / 1e9;
+    printf("%-8s n=%-9zu %8.0f ms  %6.2f Mkeys/s  %7.1f MB/s\n", op, n, sec * 1e3,
+           n / sec / 1e6, bytes / sec / 1e6);
+}
+
+// a keyspace like the server's: mostly short strings, a tenth of them with
+// TTLs, and one key in a hundred a zset of 20 members
+static void bench(size_t n, const char *path)
+{
+    std::string key, val(100, 'v');
+    uint64_t t0 = now_ns();
+    SnapWriter w;
+    if (!snap_create(&w, path))
+    {
+        perror("snap_create");
+        exit(1);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        key = "key:" + std::to_string(i);
+        int64_t expire = i % 10 == 0 ? (int64_t)(1700000000000 + i) : -1;
+        if (i % 100 == 0)
+        {
+            snap_put_zset(&w, key, expire, 20);
+            for (int k = 0; k < 20; k++)
+            {
+                snap_put_member(&w, key + ":" + std::to_string(k), k * 1.5);
+            }
+            continue;
+        }
+        snap_put_str(&w, key, expire, std::string_view(val.data(), 16 + i % 64), 0);
+    }
+    if (!snap_finish(&w, path))
+    {
+        perror("snap_finish");
+        exit(1);
+    }
+    report("write", n, w.bytes, t0);
+
+    // the checksum pass, then the records copied out as the loader does
+    t0 = now_ns();
+    SnapReader r;
+    if (snap_open(&r, path) != SNAP_OK)
+    {
+        fprintf(stderr, "snap_open failed\n");
+        exit(1);
+    }
+    report("verify", n, r.size, t0);
+    uint64_t t1 = now_ns();
+    std::vector<std::string> keys;
+    keys.reserve(n);
+    SnapRecord rec;
+    int err = 0;
+    size_t vals = 0;
+    while (snap_next(&r, &rec, &err))
+    {
+        keys.emplace_back(rec.key);
+        std::string_view name;
+        double score = 0;
+        for (size_t k = 0; k < rec.n && snap_next_member(&r, &name, &score); k++)
+        {
+            vals += name.size();
+        }
+        vals += std::string(rec.val).size();
+    }
+    if (err != SNAP_OK || keys.size() != n)
+    {
+        fprintf(stderr, "bad snapshot\n");
+        exit(1);
+    }
+    size_t bytes = r.size;
+    snap_close(&r);
+    report("parse", n, bytes, t1);
+    report("load", n, bytes, t0);
+    unlink(path);
+    (void)vals;
+}
+
+// usage: bench_snapshot [n ...]
+int main(int argc, char **argv)
+{
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; i++)
+    {
+        sizes.push_back(strtoull(argv[i], NULL, 10));
+    }
+    if (sizes.empty())
+    {
+        sizes = {1000000, 10000000};
+    }
+    for (size_t n : sizes)
+    {
+        bench(n, "bench_snapshot.kvs");
+    }
+    return 0;
+}
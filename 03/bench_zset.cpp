@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "zset.h"
+
+static uint64_t now_ns()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static void report(const char *kind, size_t n, const char *op, uint64_t t0, size_t nops)
+{
+    printf("%-7s n=%-9zu %-10s %8.1f ns/op\n", kind, n, op, double(now_ns() - t0) / nops);
+}
+
+// `ties`: a leaderboard where most members share one of a few scores
+static void bench(uint32_t kind, size_t n, bool ties)
+{
+    const char *name = kind == ZSET_BTREE
+        ? (ties ? "btree/t" : "btree") : (ties ? "avl/t" : "avl");
+    srand(1);
+    std::vector<std::string> names(n);
+    std::vector<double> scores(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (ties)
+        {
+            names[i] = "user" + std::to_string(rand() % 100000000) + ":" + std::to_string(i);
+            scores[i] = rand() % 16;
+        }
+        else
+        {
+            names[i] = "member:" + std::to_string(i);
+            scores[i] = rand() % (n / 4 + 1); // plenty of score ties
+        }
+    }
+
+    // one ZADD with every member, built bottom-up
+    std::vector<ZAddItem> items(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        items[i] = ZAddItem{scores[i], names[i].data(), names[i].size()};
+    }
+    ZSet bulk;
+    zset_init(&bulk, kind);
+    uint64_t t0 = now_ns();
+    zset_add_bulk(&bulk, items.data(), n);
+    report(name, n, "bulk_add", t0, n);
+    zset_clear(&bulk);
+
+    ZSet zset;
+    zset_init(&zset, kind);
+    t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+        zset_insert(&zset, names[i].data(), names[i].size(), scores[i]);
+    }
+    report(name, n, "insert", t0, n);
+
+    const size_t nprobe = 1000000;
+    std::vector<ZNode *> found(nprobe);
+    t0 = now_ns();
+    for (size_t i = 0; i < nprobe; i++)
+    {
+        size_t j = rand() % n;
+        found[i] = zset_seekge(&zset, scores[j], names[j].data(), names[j].size());
+    }
+    report(name, n, "seekge", t0, nprobe);
+
+    // random rank jumps from a found node
+    t0 = now_ns();
+    size_t hits = 0;
+    for (size_t i = 0; i < nprobe; i++)
+    {
+        hits += znode_offset(&zset, found[i], (int64_t)(rand() % 2001) - 1000) != NULL;
+    }
+    report(name, n, "offset", t0, nprobe);
+
+    // ordered iteration from random start points: rank jumps vs the cursor
+    const size_t nsteps = 100;
+    t0 = now_ns();
+    for (size_t i = 0; i < nprobe / nsteps; i++)
+    {
+        ZNode *node = found[i];
+        for (size_t k = 0; node && k < nsteps; k++)
+        {
+            node = znode_offset(&zset, node, +1);
+        }
+        hits += node != NULL;
+    }
+    report(name, n, "offset+1", t0, nprobe / nsteps * nsteps);
+
+    t0 = now_ns();
+    for (size_t i = 0; i < nprobe / nsteps; i++)
+    {
+        ZIter iter;
+        ziter_init(&iter, &zset, found[i]);
+        for (size_t k = 0; iter.node && k < nsteps; k++)
+        {
+            ziter_next(&iter);
+        }
+        hits += iter.node != NULL;
+    }
+    report(name, n, "iter_next", t0, nprobe / nsteps * nsteps);
+
+    // 100k-member ranges by rank, as ZRANGE does
+    const size_t nrange = 100000, nranges = 20;
+    t0 = now_ns();
+    for (size_t i = 0; i < nranges; i++)
+    {
+        ZIter iter;
+        ziter_init(&iter, &zset, zset_at(&zset, rand() % n));
+        for (size_t k = 0; iter.node && k < nrange; k++)
+        {
+            hits += iter.node->len;
+            ziter_next(&iter);
+        }
+    }
+    report(name, n, "range100k", t0, nranges * nrange);
+
+    t0 = now_ns();
+    zset_clear(&zset);
+    report(name, n, "clear", t0, n);
+    if (hits == 0)
+    {
+        printf("(no hits)\n");
+    }
+}
+
+// usage: bench_zset [--ties] [n ...]
+int main(int argc, char **argv)
+{
+    std::vector<size_t> sizes;
+    bool ties = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--ties") == 0)
+        {
+            ties = true;
+            continue;
+        }
+        sizes.push_back(strtoull(argv[i], NULL, 10));
+    }
+    if (sizes.empty())
+    {
+        sizes = {1000000, 10000000};
+    }
+    for (size_t n : sizes)
+    {
+        bench(ZSET_AVL, n, ties);
+        bench(ZSET_BTREE, n, ties);
+    }
+    return 0;
+}
@@ -0,0 +1,514 @@
+#include <assert.h>
+#include <string.h>
+#include <vector>
+#include "btree.h"
+
+static int bt_cmp(const BTree *tree, const BTKey &key, const BTTarget &t)
+{
+    if (key.score != t.score)
+    {
+        return key.score < t.score ? -1 : 1;
+    }
+    if (key.tag != t.tag)
+    {
+        return key.tag < t.tag ? -1 : 1;
+    }
+    return tree->tie(key.ref, t.name, t.len);
+}
+
+// the first key in the leaf that is >= target
+static uint32_t leaf_lower(const BTree *tree, const BTLeaf *leaf, const BTTarget &t)
+{
+    uint32_t lo = 0, hi = leaf->n;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (bt_cmp(tree, leaf->keys[mid], t) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the child covering the target: child[i] holds [keys[i - 1], keys[i])
+static uint32_t inner_route(const BTree *tree, const BTInner *in, const BTTarget &t)
+{
+    uint32_t lo = 0, hi = in->n - 1;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (bt_cmp(tree, in->keys[mid], t) <= 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static uint32_t node_size(const BTNode *node)
+{
+    if (node->leaf)
+    {
+        return node->n;
+    }
+    const BTInner *in = (const BTInner *)node;
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < in->n; i++)
+    {
+        total += in->cnt[i];
+    }
+    return total;
+}
+
+// move the upper half into a new right sibling
+static BTNode *leaf_split(BTLeaf *leaf, BTKey *sep)
+{
+    BTLeaf *right = new BTLeaf();
+    uint32_t h = leaf->n / 2;
+    right->n = leaf->n - h;
+    memcpy(right->keys, &leaf->keys[h], right->n * sizeof(BTKey));
+    leaf->n = h;
+    // link the leaves
+    right->next = leaf->next;
+    right->prev = leaf;
+    if (leaf->next)
+    {
+        leaf->next->prev = right;
+    }
+    leaf->next = right;
+    *sep = right->keys[0];
+    return right;
+}
+
+static BTNode *inner_split(BTInner *in, BTKey *sep)
+{
+    BTInner *right = new BTInner();
+    right->leaf = false;
+    uint32_t h = in->n / 2;
+    right->n = in->n - h;
+    memcpy(right->child, &in->child[h], right->n * sizeof(BTNode *));
+    memcpy(right->cnt, &in->cnt[h], right->n * sizeof(uint32_t));
+    memcpy(right->keys, &in->keys[h], (right->n - 1) * sizeof(BTKey));
+    *sep = in->keys[h - 1]; // moves up
+    in->n = h;
+    return right;
+}
+
+// returns the new right sibling if the node is split
+static BTNode *insert_rec(
+    BTree *tree, BTNode *node, const BTKey &key, const BTTarget &t, BTKey *sep)
+{
+    if (node->leaf)
+    {
+        BTLeaf *leaf = (BTLeaf *)node;
+        uint32_t pos = leaf_lower(tree, leaf, t);
+        memmove(&leaf->keys[pos + 1], &leaf->keys[pos], (leaf->n - pos) * sizeof(BTKey));
+        leaf->keys[pos] = key;
+        leaf->n++;
+        return leaf->n > k_bt_max ? leaf_split(leaf, sep) : NULL;
+    }
+
+    BTInner *in = (BTInner *)node;
+    uint32_t i = inner_route(tree, in, t);
+    BTKey rsep;
+    BTNode *right = insert_rec(tree, in->child[i], key, t, &rsep);
+    in->cnt[i]++;
+    if (!right)
+    {
+        return NULL;
+    }
+    // add the new child after child[i]
+    uint32_t n = in->n;
+    memmove(&in->child[i + 2], &in->child[i + 1], (n - i - 1) * sizeof(BTNode *));
+    memmove(&in->cnt[i + 2], &in->cnt[i + 1], (n - i - 1) * sizeof(uint32_t));
+    memmove(&in->keys[i + 1], &in->keys[i], (n - i - 1) * sizeof(BTKey));
+    in->child[i + 1] = right;
+    in->keys[i] = rsep;
+    in->cnt[i + 1] = node_size(right);
+    in->cnt[i] -= in->cnt[i + 1];
+    in->n++;
+    return in->n > k_bt_max ? inner_split(in, sep) : NULL;
+}
+
+void bt_insert(BTree *tree, const BTKey &key, const BTTarget &target)
+{
+    if (!tree->root)
+    {
+        tree->root = new BTLeaf();
+    }
+    BTKey sep;
+    BTNode *right = insert_rec(tree, tree->root, key, target, &sep);
+    if (right)
+    {
+        // grow a new root
+        BTInner *root = new BTInner();
+        root->leaf = false;
+        root->n = 2;
+        root->child[0] = tree->root;
+        root->child[1] = right;
+        root->keys[0] = sep;
+        root->cnt[0] = node_size(tree->root);
+        root->cnt[1] = node_size(right);
+        tree->root = root;
+    }
+    tree->size++;
+}
+
+// fix the underflowed child[i] by borrowing from or merging with a sibling
+static void rebalance(BTInner *in, uint32_t i)
+{
+    uint32_t l = i > 0 ? i - 1 : i; // the pair (l, l + 1)
+    BTNode *left = in->child[l];
+    BTNode *right = in->child[l + 1];
+
+    if (left->n + right->n <= k_bt_max)
+    {
+        // merge the right node into the left one
+        uint32_t rn = right->n;
+        if (left->leaf)
+        {
+            BTLeaf *ll = (BTLeaf *)left, *rl = (BTLeaf *)right;
+            memcpy(&ll->keys[ll->n], rl->keys, rl->n * sizeof(BTKey));
+            ll->next = rl->next;
+            if (rl->next)
+            {
+                rl->next->prev = ll;
+            }
+            delete rl;
+        }
+        else
+        {
+            BTInner *li = (BTInner *)left, *ri = (BTInner *)right;
+            li->keys[li->n - 1] = in->keys[l]; // the separator moves down
+            memcpy(&li->keys[li->n], ri->keys, (ri->n - 1) * sizeof(BTKey));
+            memcpy(&li->child[li->n], ri->child, ri->n * sizeof(BTNode *));
+            memcpy(&li->cnt[li->n], ri->cnt, ri->n * sizeof(uint32_t));
+            delete ri;
+        }
+        left->n += rn;
+        in->cnt[l] += in->cnt[l + 1];
+        // remove child[l + 1] and keys[l]
+        uint32_t n = in->n;
+        memmove(&in->child[l + 1], &in->child[l + 2], (n - l - 2) * sizeof(BTNode *));
+        memmove(&in->cnt[l + 1], &in->cnt[l + 2], (n - l - 2) * sizeof(uint32_t));
+        memmove(&in->keys[l], &in->keys[l + 1], (n - l - 2) * sizeof(BTKey));
+        in->n--;
+        return;
+    }
+
+    // move one entry from the bigger sibling to the smaller one
+    if (left->leaf)
+    {
+        BTLeaf *ll = (BTLeaf *)left, *rl = (BTLeaf *)right;
+        if (ll->n < rl->n)
+        {
+            ll->keys[ll->n++] = rl->keys[0];
+            memmove(&rl->keys[0], &rl->keys[1], (--rl->n) * sizeof(BTKey));
+            in->cnt[l]++;
+            in->cnt[l + 1]--;
+        }
+        else
+        {
+            memmove(&rl->keys[1], &rl->keys[0], (rl->n++) * sizeof(BTKey));
+            rl->keys[0] = ll->keys[--ll->n];
+            in->cnt[l]--;
+            in->cnt[l + 1]++;
+        }
+        in->keys[l] = rl->keys[0];
+        return;
+    }
+
+    BTInner *li = (BTInner *)left, *ri = (BTInner *)right;
+    if (li->n < ri->n)
+    {
+        // the separator moves down, the right's first key moves up
+        uint32_t moved = ri->cnt[0];
+        li->keys[li->n - 1] = in->keys[l];
+        li->child[li->n] = ri->child[0];
+        li->cnt[li->n] = moved;
+        li->n++;
+        in->keys[l] = ri->keys[0];
+        memmove(&ri->keys[0], &ri->keys[1], (ri->n - 2) * sizeof(BTKey));
+        memmove(&ri->child[0], &ri->child[1], (ri->n - 1) * sizeof(BTNode *));
+        memmove(&ri->cnt[0], &ri->cnt[1], (ri->n - 1) * sizeof(uint32_t));
+        ri->n--;
+        in->cnt[l] += moved;
+        in->cnt[l + 1] -= moved;
+    }
+    else
+    {
+        uint32_t moved = li->cnt[li->n - 1];
+        memmove(&ri->keys[1], &ri->keys[0], (ri->n - 1) * sizeof(BTKey));
+        memmove(&ri->child[1], &ri->child[0], ri->n * sizeof(BTNode *));
+        memmove(&ri->cnt[1], &ri->cnt[0], ri->n * sizeof(uint32_t));
+        ri->keys[0] = in->keys[l];
+        ri->child[0] = li->child[li->n - 1];
+        ri->cnt[0] = moved;
+        ri->n++;
+        in->keys[l] = li->keys[li->n - 2];
+        li->n--;
+        in->cnt[l] -= moved;
+        in->cnt[l + 1] += moved;
+    }
+}
+
+static const BTKey &leftmost(const BTNode *node)
+{
+    while (!node->leaf)
+    {
+        node = ((const BTInner *)node)->child[0];
+    }
+    return ((const BTLeaf *)node)->keys[0];
+}
+
+// returns the payload of the removed key, or NULL if not found
+static void *delete_rec(BTree *tree, BTNode *node, const BTTarget &t)
+{
+    if (node->leaf)
+    {
+        BTLeaf *leaf = (BTLeaf *)node;
+        uint32_t pos = leaf_lower(tree, leaf, t);
+        if (pos == leaf->n || bt_cmp(tree, leaf->keys[pos], t) != 0)
+        {
+            return NULL;
+        }
+        void *ref = leaf->keys[pos].ref;
+        leaf->n--;
+        memmove(&leaf->keys[pos], &leaf->keys[pos + 1], (leaf->n - pos) * sizeof(BTKey));
+        return ref;
+    }
+
+    BTInner *in = (BTInner *)node;
+    uint32_t i = inner_route(tree, in, t);
+    void *ref = delete_rec(tree, in->child[i], t);
+    if (!ref)
+    {
+        return NULL;
+    }
+    in->cnt[i]--;
+    // separators are compared by name, so they must not outlive the payload
+    if (i > 0 && in->keys[i - 1].ref == ref)
+    {
+        in->keys[i - 1] = leftmost(in->child[i]);
+    }
+    if (in->child[i]->n < k_bt_min)
+    {
+        rebalance(in, i);
+    }
+    return ref;
+}
+
+bool bt_delete(BTree *tree, const BTTarget &target)
+{
+    if (!tree->root || !delete_rec(tree, tree->root, target))
+    {
+        return false;
+    }
+    tree->size--;
+    // shrink the root
+    BTNode *root = tree->root;
+    if (!root->leaf && root->n == 1)
+    {
+        tree->root = ((BTInner *)root)->child[0];
+        delete (BTInner *)root;
+    }
+    else if (root->leaf && root->n == 0)
+    {
+        tree->root = NULL;
+        delete (BTLeaf *)root;
+    }
+    return true;
+}
+
+size_t bt_seekge(BTree *tree, const BTTarget &target, BTPos *pos)
+{
+    BTNode *node = tree->root;
+    if (!node)
+    {
+        *pos = BTPos{};
+        return 0;
+    }
+    size_t rank = 0;
+    while (!node->leaf)
+    {
+        BTInner *in = (BTInner *)node;
+        uint32_t i = inner_route(tree, in, target);
+        for (uint32_t j = 0; j < i; j++)
+        {
+            rank += in->cnt[j];
+        }
+        node = in->child[i];
+    }
+    BTLeaf *leaf = (BTLeaf *)node;
+    uint32_t idx = leaf_lower(tree, leaf, target);
+    rank += idx;
+    if (idx == leaf->n)
+    {
+        // all keys here are smaller; the answer starts the next leaf
+        leaf = leaf->next;
+        idx = 0;
+    }
+    pos->leaf = leaf;
+    pos->idx = idx;
+    return rank;
+}
+
+bool bt_at(BTree *tree, size_t rank, BTPos *pos)
+{
+    if (rank >= tree->size)
+    {
+        return false;
+    }
+    BTNode *node = tree->root;
+    while (!node->leaf)
+    {
+        BTInner *in = (BTInner *)node;
+        uint32_t i = 0;
+        while (rank >= in->cnt[i])
+        {
+            rank -= in->cnt[i++];
+        }
+        node = in->child[i];
+    }
+    pos->leaf = (BTLeaf *)node;
+    pos->idx = (uint32_t)rank;
+    return true;
+}
+
+bool bt_next(BTPos *pos)
+{
+    if (pos->idx + 1 < pos->leaf->n)
+    {
+        pos->idx++;
+        return true;
+    }
+    pos->leaf = pos->leaf->next;
+    pos->idx = 0;
+    return pos->leaf != NULL;
+}
+
+bool bt_prev(BTPos *pos)
+{
+    if (pos->idx > 0)
+    {
+        pos->idx--;
+        return true;
+    }
+    pos->leaf = pos->leaf->prev;
+    pos->idx = pos->leaf ? pos->leaf->n - 1 : 0;
+    return pos->leaf != NULL;
+}
+
+// split `n` items into groups of at most k_bt_max; with more than one group
+// the even split keeps each at or above k_bt_min
+static size_t group_size(size_t n, size_t ngroups, size_t i)
+{
+    return n / ngroups + (i < n % ngroups ? 1 : 0);
+}
+
+void bt_build(BTree *tree, const BTKey *keys, size_t n)
+{
+    assert(!tree->root);
+    tree->size = n;
+    if (n == 0)
+    {
+        return;
+    }
+
+    // the leaves
+    std::vector<BTNode *> level;
+    std::vector<uint32_t> counts;
+    std::vector<BTKey> mins; // the smallest key of each subtree
+    size_t nleaves = (n + k_bt_max - 1) / k_bt_max;
+    BTLeaf *prev = NULL;
+    for (size_t i = 0, off = 0; i < nleaves; i++)
+    {
+        BTLeaf *leaf = new BTLeaf();
+        leaf->n = (uint32_t)group_size(n, nleaves, i);
+        memcpy(leaf->keys, &keys[off], leaf->n * sizeof(BTKey));
+        off += leaf->n;
+        leaf->prev = prev;
+        if (prev)
+        {
+            prev->next = leaf;
+        }
+        prev = leaf;
+        level.push_back(leaf);
+        counts.push_back(leaf->n);
+        mins.push_back(leaf->keys[0]);
+    }
+
+    // the inner levels
+    while (level.size() > 1)
+    {
+        std::vector<BTNode *> up;
+        std::vector<uint32_t> up_counts;
+        std::vector<BTKey> up_mins;
+        size_t m = level.size();
+        size_t ninner = (m + k_bt_max - 1) / k_bt_max;
+        for (size_t i = 0, off = 0; i < ninner; i++)
+        {
+            BTInner *in = new BTInner();
+            in->leaf = false;
+            in->n = (uint32_t)group_size(m, ninner, i);
+            uint32_t total = 0;
+            for (uint32_t j = 0; j < in->n; j++)
+            {
+                in->child[j] = level[off + j];
+                in->cnt[j] = counts[off + j];
+                total += in->cnt[j];
+                if (j > 0)
+                {
+                    in->keys[j - 1] = mins[off + j];
+                }
+            }
+            up.push_back(in);
+            up_counts.push_back(total);
+            up_mins.push_back(mins[off]);
+            off += in->n;
+        }
+        level.swap(up);
+        counts.swap(up_counts);
+        mins.swap(up_mins);
+    }
+    tree->root = level[0];
+}
+
+static void node_dispose(BTNode *node, void (*del)(void *ref))
+{
+    if (node->leaf)
+    {
+        BTLeaf *leaf = (BTLeaf *)node;
+        for (uint32_t i = 0; del && i < leaf->n; i++)
+        {
+            del(leaf->keys[i].ref);
+        }
+        delete leaf;
+        return;
+    }
+    BTInner *in = (BTInner *)node;
+    for (uint32_t i = 0; i < in->n; i++)
+    {
+        node_dispose(in->child[i], del);
+    }
+    delete in;
+}
+
+void bt_clear(BTree *tree, void (*del)(void *ref))
+{
+    if (tree->root)
+    {
+        node_dispose(tree->root, del);
+    }
+    tree->root = NULL;
+    tree->size = 0;
+}
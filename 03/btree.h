@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// a B+tree key: the score plus a reference to the payload.
+// score ties are broken by `tag`, then by the payload's name via `BTree::tie`;
+// the tag must order like the name, e.g. a prefix of it.
+struct BTKey
+{
+    double score = 0;
+    void *ref = NULL;
+    uint64_t tag = 0;
+};
+
+// the (score, name) tuple to search for
+struct BTTarget
+{
+    double score = 0;
+    const char *name = NULL;
+    size_t len = 0;
+    uint64_t tag = 0;
+};
+
+const uint32_t k_bt_max = 32;           // keys per leaf, children per inner node
+const uint32_t k_bt_min = k_bt_max / 2; // except for the root
+
+struct BTNode
+{
+    uint32_t n = 0; // keys in a leaf, children in an inner node
+    bool leaf = true;
+};
+
+// keys are stored contiguously in the leaves, which are linked in order
+struct BTLeaf : BTNode
+{
+    BTKey keys[k_bt_max + 1]; // +1 for the overflow before a split
+    BTLeaf *prev = NULL;
+    BTLeaf *next = NULL;
+};
+
+struct BTInner : BTNode
+{
+    BTKey keys[k_bt_max];         // keys[i] separates child[i] and child[i + 1]
+    uint32_t cnt[k_bt_max + 1];   // subtree sizes, for rank queries
+    BTNode *child[k_bt_max + 1];
+};
+
+struct BTree
+{
+    BTNode *root = NULL;
+    size_t size = 0;
+    // compare the payload's name with the target name: <0, 0, >0
+    int (*tie)(void *ref, const char *name, size_t len) = NULL;
+};
+
+// a position in the leaves
+struct BTPos
+{
+    BTLeaf *leaf = NULL;
+    uint32_t idx = 0;
+};
+
+inline void *bt_ref(const BTPos &pos)
+{
+    return pos.leaf->keys[pos.idx].ref;
+}
+
+// `target` describes the key; it must not be in the tree yet
+void bt_insert(BTree *tree, const BTKey &key, const BTTarget &target);
+// remove the key equal to `target`; returns false if not found
+bool bt_delete(BTree *tree, const BTTarget &target);
+// find the first key >= target; returns its rank, or `size` if none
+size_t bt_seekge(BTree *tree, const BTTarget &target, BTPos *pos);
+// find the key by its rank; returns false if out of range
+bool bt_at(BTree *tree, size_t rank, BTPos *pos);
+// step to the neighbor; returns false past the ends
+bool bt_next(BTPos *pos);
+bool bt_prev(BTPos *pos);
+// load keys in order into an empty tree, O(n)
+void bt_build(BTree *tree, const BTKey *keys, size_t n);
+// free the nodes, invoking `del` on each payload
+void bt_clear(BTree *tree, void (*del)(void *ref));
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <assert.h>
 #include <stdlib.h>
+#include <utility>
 #include "hashtable.h"
 
 using namespace std;
@@ -103,6 +104,16 @@ HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
     return from ? *from : NULL;
 }
 
+HNode *hm_find(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
+{
+    HNode **from = h_lookup(&hmap->newer, key, eq);
+    if (!from)
+    {
+        from = h_lookup(&hmap->older, key, eq);
+    }
+    return from ? *from : NULL;
+}
+
 const size_t k_max_load_factor = 8;
 
 void hm_insert(HMap *hmap, HNode *node)
@@ -150,6 +161,35 @@ void hm_clear(HMap *hmap)
     *hmap = HMap{};
 }
 
+static void h_dispose(HTab *htab, void (*del)(HNode *, void *), void *arg)
+{
+    for (size_t i = 0; htab->tab && i <= htab->mask; i++)
+    {
+        HNode *node = htab->tab[i];
+        while (node)
+        {
+            HNode *next = node->next; // `del` may free the node
+            del(node, arg);
+            node = next;
+        }
+    }
+}
+
+void hm_dispose(HMap *hmap, void (*del)(HNode *, void *), void *arg)
+{
+    h_dispose(&hmap->newer, del, arg);
+    h_dispose(&hmap->older, del, arg);
+    hm_clear(hmap);
+}
+
+size_t hm_mem(HMap *hmap)
+{
+    size_t slots = 0;
+    slots += hmap->newer.tab ? hmap->newer.mask + 1 : 0;
+    slots += hmap->older.tab ? hmap->older.mask + 1 : 0;
+    return slots * sizeof(HNode *);
+}
+
 static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg)
 {
     for (size_t i = 0; htab->mask != 0 && i <= htab->mask; i++)
@@ -168,4 +208,109 @@ static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg)
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg)
 {
     h_foreach(&hmap->newer, f, arg) && h_foreach(&hmap->older, f, arg);
-}
\ No newline at end of file
+}
+
+static void h_scan_slot(HTab *htab, size_t pos, void (*f)(HNode *, void *), void *arg)
+{
+    for (HNode *node = htab->tab[pos]; node != NULL; node = node->next)
+    {
+        f(node, arg);
+    }
+}
+
+static uint64_t rev_bits(uint64_t v)
+{
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return __builtin_bswap64(v);
+}
+
+// increment the high bits of the cursor first (reverse binary counting),
+// ignoring the bits above `mask`.
+static uint64_t cursor_next(uint64_t cursor, size_t mask)
+{
+    cursor |= ~(uint64_t)mask;
+    return rev_bits(rev_bits(cursor) + 1);
+}
+
+// The cursor walks the slots in reverse binary order, so the slots already
+// visited stay visited when the table doubles (a slot `i` splits into `i` and
+// `i + n`, which share the low bits). During progressive rehashing the slot in
+// the smaller table is visited together with all its expansions in the larger
+// one, so a key present for the whole scan is reported at least once no matter
+// when it migrates. Keys may be reported more than once.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg)
+{
+    if (!hmap->newer.tab)
+    {
+        return 0;
+    }
+    if (!hmap->older.tab)
+    {
+        h_scan_slot(&hmap->newer, cursor & hmap->newer.mask, f, arg);
+        return cursor_next(cursor, hmap->newer.mask);
+    }
+
+    HTab *small = &hmap->older;
+    HTab *large = &hmap->newer;
+    if (small->mask > large->mask)
+    {
+        std::swap(small, large);
+    }
+    h_scan_slot(small, cursor & small->mask, f, arg);
+    // the expansions of the small slot in the large table; the increment
+    // carries into the small table's bits once the extra bits wrap around.
+    do
+    {
+        h_scan_slot(large, cursor & large->mask, f, arg);
+        cursor = cursor_next(cursor, large->mask);
+    } while (cursor & (small->mask ^ large->mask));
+    return cursor;
+}
+
+static bool h_relink(HTab *htab, HNode *from, HNode *to)
+{
+    if (!htab->tab)
+    {
+        return false;
+    }
+    HNode **slot = &htab->tab[to->hcode & htab->mask];
+    for (; *slot != NULL; slot = &(*slot)->next)
+    {
+        if (*slot == from)
+        {
+            *slot = to;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool hm_relink(HMap *hmap, HNode *from, HNode *to)
+{
+    return h_relink(&hmap->newer, from, to) || h_relink(&hmap->older, from, to);
+}
+
+// consecutive slots hold unrelated keys, so walking a few slots from a random
+// one is as good as picking each key at random, and much cheaper. Bound the
+// walk, since the table can be sparse after many deletions.
+static size_t h_sample(HTab *htab, uint64_t rnd, HNode **out, size_t n)
+{
+    size_t got = 0;
+    for (size_t i = 0; htab->tab && i <= htab->mask && i < n * 10 && got < n; i++)
+    {
+        HNode *node = htab->tab[(rnd + i) & htab->mask];
+        for (; node != NULL && got < n; node = node->next)
+        {
+            out[got++] = node;
+        }
+    }
+    return got;
+}
+
+size_t hm_sample(HMap *hmap, uint64_t rnd, HNode **out, size_t n)
+{
+    size_t got = h_sample(&hmap->newer, rnd, out, n);
+    return got + h_sample(&hmap->older, rnd, out + got, n - got);
+}
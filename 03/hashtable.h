@@ -29,11 +29,24 @@ struct HMap
 };
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+// lookup without migrating keys, safe for concurrent readers
+HNode *hm_find(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void hm_insert(HMap *hmap, HNode *node);
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void hm_clear(HMap *hmap);
+// hm_clear() that also hands each node to `del`, which may free it
+void hm_dispose(HMap *hmap, void (*del)(HNode *, void *), void *arg);
 size_t hm_size(HMap *hmap);
+// bytes of the slot arrays
+size_t hm_mem(HMap *hmap);
 // invoke callback on each node until it returns false
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+// visit the slots under `cursor` and return the next cursor, 0 when done
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg);
+// make the slot or chain that points to `from` point to `to` instead, after
+// the node was moved; `from` is not dereferenced
+bool hm_relink(HMap *hmap, HNode *from, HNode *to);
+// up to `n` nodes from the slots following a random one picked by `rnd`
+size_t hm_sample(HMap *hmap, uint64_t rnd, HNode **out, size_t n);
 
 #endif // HASHTABLE_H
\ No newline at end of file
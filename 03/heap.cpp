@@ -1,3 +1,6 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 #include "heap.h"
 
 static size_t heap_parent(size_t i)
@@ -60,4 +63,187 @@ void heap_update(HeapItem *a, size_t pos,size_t len){
     }else{
         heap_down(a,pos,len);
     }
-}
\ No newline at end of file
+}
+
+static void dheap_set(HeapItem *a, size_t pos, HeapItem t)
+{
+    a[pos] = t;
+    if (t.ref)
+    {
+        *t.ref = pos;
+    }
+}
+
+static void dheap_up(HeapItem *a, size_t pos)
+{
+    HeapItem t = a[pos];
+    while (pos > 0 && a[(pos - 1) / 4].val > t.val)
+    {
+        dheap_set(a, pos, a[(pos - 1) / 4]);
+        pos = (pos - 1) / 4;
+    }
+    dheap_set(a, pos, t);
+}
+
+static void dheap_down(HeapItem *a, size_t pos, size_t len)
+{
+    HeapItem t = a[pos];
+    while (true)
+    {
+        // the smallest of up to 4 children, all on one cache line
+        size_t first = pos * 4 + 1;
+        size_t end = first + 4 < len ? first + 4 : len;
+        size_t min_pos = pos;
+        uint64_t min_val = t.val;
+        for (size_t c = first; c < end; c++)
+        {
+            if (a[c].val < min_val)
+            {
+                min_pos = c;
+                min_val = a[c].val;
+            }
+        }
+        if (min_pos == pos)
+        {
+            break;
+        }
+        dheap_set(a, pos, a[min_pos]);
+        pos = min_pos;
+    }
+    dheap_set(a, pos, t);
+}
+
+// the buffer holds 3 slots of padding plus `cap` items, in whole cache lines
+static void dheap_grow(DHeap *h)
+{
+    size_t cap = h->cap ? (h->cap + 3) * 2 - 3 : 61;
+    HeapItem *buf = (HeapItem *)aligned_alloc(64, (cap + 3) * sizeof(HeapItem));
+    if (!buf)
+    {
+        abort();
+    }
+    if (h->items)
+    {
+        memcpy(buf + 3, h->items, h->len * sizeof(HeapItem));
+        free(h->items - 3);
+    }
+    h->items = buf + 3;
+    h->cap = cap;
+}
+
+void dheap_upsert(DHeap *h, size_t pos, HeapItem t)
+{
+    if (pos >= h->len)
+    {
+        if (h->len == h->cap)
+        {
+            dheap_grow(h);
+        }
+        pos = h->len++;
+    }
+    h->items[pos] = t;
+    if (pos > 0 && h->items[(pos - 1) / 4].val > t.val)
+    {
+        dheap_up(h->items, pos);
+    }
+    else
+    {
+        dheap_down(h->items, pos, h->len);
+    }
+}
+
+void dheap_delete(DHeap *h, size_t pos)
+{
+    // swap the erased item with the last item
+    HeapItem last = h->items[--h->len];
+    if (pos < h->len)
+    {
+        dheap_upsert(h, pos, last);
+    }
+}
+
+// the expired items form a subtree at the root; count them, up to `max`
+static size_t dheap_count_expired(const DHeap *h, uint64_t now, size_t max)
+{
+    size_t cnt = 0;
+    std::vector<size_t> stack = {0};
+    while (!stack.empty() && cnt < max)
+    {
+        size_t pos = stack.back();
+        stack.pop_back();
+        if (pos >= h->len || h->items[pos].val >= now)
+        {
+            continue;
+        }
+        cnt++;
+        for (size_t c = pos * 4 + 1; c <= pos * 4 + 4 && c < h->len; c++)
+        {
+            stack.push_back(c);
+        }
+    }
+    return cnt;
+}
+
+void dheap_pop_expired(DHeap *h, uint64_t now, size_t max, std::vector<HeapItem> &out)
+{
+    if (h->len == 0 || h->items[0].val >= now)
+    {
+        return;
+    }
+    // the rebuild is O(n) however many it takes, so it may take more than
+    // `max`; otherwise a large heap would never reach it
+    size_t many = h->len / 16;
+    size_t cnt = dheap_count_expired(h, now, std::max(max, many));
+    HeapItem *a = h->items;
+    if (cnt < many)
+    {
+        // a few: pop the root, O(log n) each
+        for (size_t i = 0; i < std::min(cnt, max); i++)
+        {
+            out.push_back(a[0]);
+            if (a[0].ref)
+            {
+                *a[0].ref = -1;
+            }
+            dheap_delete(h, 0);
+        }
+        return;
+    }
+    // many: keep the rest in place, then heapify bottom-up
+    size_t len = 0;
+    for (size_t i = 0; i < h->len; i++)
+    {
+        if (cnt > 0 && a[i].val < now)
+        {
+            cnt--;
+            out.push_back(a[i]);
+            if (a[i].ref)
+            {
+                *a[i].ref = -1;
+            }
+        }
+        else
+        {
+            dheap_set(a, len++, a[i]);
+        }
+    }
+    h->len = len;
+    for (size_t i = len > 1 ? (len - 2) / 4 + 1 : 0; i-- > 0;)
+    {
+        dheap_down(a, i, len);
+    }
+}
+
+void dheap_clear(DHeap *h)
+{
+    h->len = 0;
+}
+
+void dheap_free(DHeap *h)
+{
+    if (h->items)
+    {
+        free(h->items - 3);
+    }
+    *h = DHeap{};
+}
@@ -2,6 +2,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <vector>
 
 struct HeapItem
 {
@@ -10,3 +11,27 @@ struct HeapItem
 };
 
 void heap_update(HeapItem *a, size_t pos, size_t len);
+
+// A 4-ary min-heap for timers. It is half as deep as a binary heap, and the
+// 4 children of a node (4 x 16 bytes) fill exactly one cache line: the items
+// start 3 slots into a 64-byte aligned buffer, so the children of item i,
+// 4i+1 .. 4i+4, begin on a line boundary. `*ref` tracks the position of each
+// item, as with heap_update().
+struct DHeap
+{
+    HeapItem *items = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+};
+
+// add an item (pos >= len) or change the item at `pos`
+void dheap_upsert(DHeap *h, size_t pos, HeapItem t);
+void dheap_delete(DHeap *h, size_t pos);
+// remove up to `max` items with val < now, in no particular order, and set
+// their refs to -1. when they are a large part of the heap, up to 1/16 of it
+// is taken even if that is more than `max`, and the rest is compacted and
+// rebuilt once in O(n) instead of popping them one by one.
+void dheap_pop_expired(DHeap *h, uint64_t now, size_t max, std::vector<HeapItem> &out);
+// drop every item; the refs are left as they are
+void dheap_clear(DHeap *h);
+void dheap_free(DHeap *h);
@@ -0,0 +1,198 @@
+#include <string.h>
+// proj
+#include "lz.h"
+
+const size_t k_min_match = 4;
+const size_t k_max_offset = 65535;
+// the format wants the last match to start 12 bytes before the end, and
+// the last 5 bytes to be literals
+const size_t k_mf_limit = 12;
+const size_t k_last_literals = 5;
+const uint32_t k_hash_bits = 13;
+
+static uint32_t load32(const uint8_t *p)
+{
+    uint32_t v = 0;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t seq)
+{
+    return (seq * 2654435761u) >> (32 - k_hash_bits);
+}
+
+// room for a length of `len` past the 4 bits of the token
+static size_t len_bytes(size_t len)
+{
+    return len >= 15 ? (len - 15) / 255 + 1 : 0;
+}
+
+static uint8_t *put_len(uint8_t *op, size_t len)
+{
+    for (len -= 15; len >= 255; len -= 255)
+    {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// append a sequence; NULL if it does not fit. no match for the last one.
+static uint8_t *put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nlit,
+                        size_t offset, size_t mlen)
+{
+    size_t need = 1 + len_bytes(nlit) + nlit;
+    if (mlen)
+    {
+        need += 2 + len_bytes(mlen - k_min_match);
+    }
+    if (need > (size_t)(oend - op))
+    {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit >= 15 ? 15 : nlit) << 4);
+    if (nlit >= 15)
+    {
+        op = put_len(op, nlit);
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen)
+    {
+        return op;
+    }
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    mlen -= k_min_match;
+    *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15)
+    {
+        op = put_len(op, mlen);
+    }
+    return op;
+}
+
+// greedy matching against the last position of each hashed 4-byte sequence
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+    const uint8_t *anchor = src;
+    if (n > k_mf_limit)
+    {
+        uint32_t table[1 << k_hash_bits] = {};
+        const uint8_t *ip = src + 1;
+        const uint8_t *mf_limit = src + n - k_mf_limit;
+        const uint8_t *match_limit = src + n - k_last_literals;
+        while (ip < mf_limit)
+        {
+            uint32_t seq = load32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || (size_t)(ip - ref) > k_max_offset || load32(ref) != seq)
+            {
+                // step faster through data that does not compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+            const uint8_t *end = ip + k_min_match;
+            for (const uint8_t *r = ref + k_min_match; end < match_limit && *end == *r; r++)
+            {
+                end++;
+            }
+            op = put_seq(op, oend, anchor, ip - anchor, ip - ref, end - ip);
+            if (!op)
+            {
+                return 0;
+            }
+            // a position inside the match helps the next search
+            table[lz_hash(load32(end - 2))] = (uint32_t)(end - 2 - src);
+            ip = anchor = end;
+        }
+    }
+    op = put_seq(op, oend, anchor, src + n - anchor, 0, 0);
+    return op ? op - dst : 0;
+}
+
+// a length continued past the token; false if the input ends first
+static bool get_len(const uint8_t *&ip, const uint8_t *iend, size_t &len)
+{
+    uint8_t b = 255;
+    while (b == 255)
+    {
+        if (ip >= iend)
+        {
+            return false;
+        }
+        b = *ip++;
+        len += b;
+    }
+    return true;
+}
+
+bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t len)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + n;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + len;
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !get_len(ip, iend, nlit))
+        {
+            return false;
+        }
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+        {
+            return false;
+        }
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend)
+        {
+            break; // the last sequence
+        }
+        if (iend - ip < 2)
+        {
+            return false;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !get_len(ip, iend, mlen))
+        {
+            return false;
+        }
+        mlen += k_min_match;
+        if (offset == 0 || offset > (size_t)(op - dst) || mlen > (size_t)(oend - op))
+        {
+            return false;
+        }
+        const uint8_t *ref = op - offset;
+        if (offset >= mlen)
+        {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        }
+        else
+        {
+            // overlapping: a run repeating the last `offset` bytes
+            for (uint8_t *end = op + mlen; op < end;)
+            {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op == oend;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// An LZ77 codec that writes the LZ4 block format: each sequence is a token
+// byte (literal length << 4 | match length - 4, 15 meaning more length
+// bytes follow, each adding up to 255), the literals, and a 2-byte little
+// endian offset back into the output. The last sequence has literals only.
+// Blocks carry no length; the caller stores the uncompressed size. Any LZ4
+// library can decompress them (LZ4_decompress_safe).
+
+// compress `n` bytes into at most `cap` bytes; returns the compressed size,
+// or 0 if it does not fit
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+// decompress into exactly `len` bytes; false for corrupt input
+bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t len);
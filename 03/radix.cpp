@@ -0,0 +1,258 @@
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include "radix.h"
+
+static size_t common_prefix(const std::string &label, const uint8_t *key, size_t len)
+{
+    size_t n = std::min(label.size(), len);
+    size_t i = 0;
+    while (i < n && (uint8_t)label[i] == key[i])
+    {
+        i++;
+    }
+    return i;
+}
+
+// the slot of the child starting with `c`, or where it should be inserted
+static size_t child_pos(RaxNode *node, uint8_t c)
+{
+    size_t lo = 0, hi = node->children.size();
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if ((uint8_t)node->children[mid]->label[0] < c)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static RaxNode *child_find(RaxNode *node, uint8_t c)
+{
+    size_t pos = child_pos(node, c);
+    if (pos < node->children.size() && (uint8_t)node->children[pos]->label[0] == c)
+    {
+        return node->children[pos];
+    }
+    return NULL;
+}
+
+bool rax_insert(Rax *rax, const uint8_t *key, size_t len, void *val)
+{
+    if (!rax->root)
+    {
+        rax->root = new RaxNode();
+    }
+    RaxNode *node = rax->root;
+    size_t pos = 0;
+    while (pos < len)
+    {
+        size_t slot = child_pos(node, key[pos]);
+        if (slot == node->children.size() || (uint8_t)node->children[slot]->label[0] != key[pos])
+        {
+            // no edge shares the next byte: a new leaf holds the rest
+            RaxNode *leaf = new RaxNode();
+            leaf->label.assign((const char *)key + pos, len - pos);
+            node->children.insert(node->children.begin() + slot, leaf);
+            node = leaf;
+            pos = len;
+            break;
+        }
+        RaxNode *child = node->children[slot];
+        size_t n = common_prefix(child->label, key + pos, len - pos);
+        if (n < child->label.size())
+        {
+            // split the edge at the mismatch
+            RaxNode *mid = new RaxNode();
+            mid->label = child->label.substr(0, n);
+            child->label.erase(0, n);
+            mid->children.push_back(child);
+            node->children[slot] = mid;
+            child = mid;
+        }
+        node = child;
+        pos += n;
+    }
+    bool added = !node->is_key;
+    node->is_key = true;
+    node->val = val;
+    rax->size += added;
+    return added;
+}
+
+void *rax_find(Rax *rax, const uint8_t *key, size_t len)
+{
+    RaxNode *node = rax->root;
+    size_t pos = 0;
+    while (node && pos < len)
+    {
+        node = child_find(node, key[pos]);
+        if (!node || common_prefix(node->label, key + pos, len - pos) != node->label.size())
+        {
+            return NULL;
+        }
+        pos += node->label.size();
+    }
+    return node && node->is_key ? node->val : NULL;
+}
+
+// absorb the only child into a non-key node to keep the path compressed
+static void merge_child(RaxNode *node)
+{
+    assert(!node->is_key && node->children.size() == 1);
+    RaxNode *child = node->children[0];
+    node->label += child->label;
+    node->children.swap(child->children);
+    node->val = child->val;
+    node->is_key = child->is_key;
+    delete child;
+}
+
+bool rax_delete(Rax *rax, const uint8_t *key, size_t len)
+{
+    // find the node and remember the path
+    std::vector<RaxNode *> path;
+    RaxNode *node = rax->root;
+    size_t pos = 0;
+    while (node && pos < len)
+    {
+        path.push_back(node);
+        node = child_find(node, key[pos]);
+        if (!node || common_prefix(node->label, key + pos, len - pos) != node->label.size())
+        {
+            return false;
+        }
+        pos += node->label.size();
+    }
+    if (!node || !node->is_key)
+    {
+        return false;
+    }
+    node->is_key = false;
+    node->val = NULL;
+    rax->size--;
+
+    if (path.empty())
+    {
+        return true; // the empty key lives in the root
+    }
+    RaxNode *parent = path.back();
+    if (node->children.empty())
+    {
+        // drop the leaf, then the parent may become a single-child chain
+        size_t slot = child_pos(parent, (uint8_t)node->label[0]);
+        assert(parent->children[slot] == node);
+        parent->children.erase(parent->children.begin() + slot);
+        delete node;
+        if (parent != rax->root && !parent->is_key && parent->children.size() == 1)
+        {
+            merge_child(parent);
+        }
+    }
+    else if (node->children.size() == 1)
+    {
+        merge_child(node);
+    }
+    return true;
+}
+
+static void node_dispose(RaxNode *node)
+{
+    for (RaxNode *child : node->children)
+    {
+        node_dispose(child);
+    }
+    delete node;
+}
+
+void rax_clear(Rax *rax)
+{
+    if (rax->root)
+    {
+        node_dispose(rax->root);
+    }
+    *rax = Rax{};
+}
+
+struct WalkCtx
+{
+    const uint8_t *start = NULL;
+    size_t slen = 0;
+    bool (*f)(const std::string &, void *, void *) = NULL;
+    void *arg = NULL;
+    std::string path; // the key bytes down to the current node
+};
+
+// in-order visit of the subtree. `bounded` means the path is still a prefix
+// of `start`, so the keys to the left of `start` must be skipped.
+static bool walk(WalkCtx &ctx, RaxNode *node, bool bounded)
+{
+    size_t base = ctx.path.size();
+    ctx.path += node->label;
+    bool ok = true;
+    if (bounded)
+    {
+        size_t n = std::min(ctx.path.size(), ctx.slen);
+        int cmp = memcmp(ctx.path.data(), ctx.start, n);
+        if (cmp < 0)
+        {
+            ctx.path.resize(base);
+            return true; // the whole subtree is below `start`
+        }
+        // still a proper prefix of `start`: this key itself is smaller
+        bounded = cmp == 0 && ctx.path.size() < ctx.slen;
+    }
+    if (!bounded && node->is_key)
+    {
+        ok = ctx.f(ctx.path, node->val, ctx.arg);
+    }
+    for (size_t i = 0; ok && i < node->children.size(); i++)
+    {
+        ok = walk(ctx, node->children[i], bounded);
+    }
+    ctx.path.resize(base);
+    return ok;
+}
+
+void rax_walk(
+    Rax *rax, const uint8_t *prefix, size_t plen,
+    const uint8_t *start, size_t slen,
+    bool (*f)(const std::string &key, void *val, void *arg), void *arg)
+{
+    WalkCtx ctx;
+    ctx.start = start;
+    ctx.slen = slen;
+    ctx.f = f;
+    ctx.arg = arg;
+
+    // descend to the subtree covering the prefix
+    RaxNode *node = rax->root;
+    size_t pos = 0;
+    while (node && pos < plen)
+    {
+        RaxNode *child = child_find(node, prefix[pos]);
+        if (!child)
+        {
+            return;
+        }
+        size_t n = common_prefix(child->label, prefix + pos, plen - pos);
+        if (n < child->label.size() && pos + n < plen)
+        {
+            return; // diverges inside the edge
+        }
+        // the prefix may end inside the child's edge; its subtree matches
+        ctx.path += node->label;
+        pos += child->label.size();
+        node = child;
+    }
+    if (node)
+    {
+        walk(ctx, node, true);
+    }
+}
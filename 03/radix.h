@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// a path-compressed radix tree node. each edge carries a run of bytes, so a
+// chain of single-child nodes is stored as one node.
+struct RaxNode
+{
+    std::string label;               // bytes on the edge from the parent
+    std::vector<RaxNode *> children; // sorted by the first byte of the label
+    void *val = NULL;
+    bool is_key = false; // the path to this node is a key
+};
+
+// an ordered map from byte strings to pointers
+struct Rax
+{
+    RaxNode *root = NULL;
+    size_t size = 0; // number of keys
+};
+
+// insert or replace; returns true if the key is new
+bool rax_insert(Rax *rax, const uint8_t *key, size_t len, void *val);
+// returns true if the key existed
+bool rax_delete(Rax *rax, const uint8_t *key, size_t len);
+void *rax_find(Rax *rax, const uint8_t *key, size_t len);
+void rax_clear(Rax *rax);
+// visit keys starting with `prefix` that are >= `start`, in byte order,
+// until the callback returns false. the cost is O(prefix + start + visited).
+void rax_walk(
+    Rax *rax, const uint8_t *prefix, size_t plen,
+    const uint8_t *start, size_t slen,
+    bool (*f)(const std::string &key, void *val, void *arg), void *arg);
@@ -2,6 +2,7 @@
 #include <cassert>
 #include <vector>
 #include <cstring>
+#include <strings.h>
 #include <cerrno>
 #include <unistd.h>
 #include <fcntl.h>
@@ -10,13 +11,28 @@
 #include <sys/socket.h>
 #include <cstddef>
 #include <map>
+#include <atomic>
+#include <deque>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
 #include <math.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include "hashtable.h"
 #include "common.h"
 #include "zset.h"
 #include "list.h"
 #include "heap.h"
 #include "thread_pool.h"
+#include "radix.h"
+#include "slab.h"
+#include "lz.h"
+#include "snapshot.h"
+#include "aof.h"
 
 using namespace std;
 
@@ -49,6 +65,21 @@ static uint64_t get_monotonic_msec()
     return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
+static uint64_t get_monotonic_usec()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+// unix time, for what outlives the process
+static int64_t get_realtime_msec()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return int64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
 // Set a file descriptor to non-blocking mode
 static void fd_set_nb(int fd)
 {
@@ -93,21 +124,126 @@ struct Conn
     uint64_t last_active_ms = 0;
     DList idle_node;
 
-    HMap db;
+    // parked by BZPOPMIN/BZPOPMAX until a ZADD to one of the keys
+    bool blocked = false;
+    bool block_max = false;
+    std::vector<std::string> block_keys;
+    size_t block_heap_idx = -1; // in `g_data.block_heap`, if it has a timeout
+    // also parked while the thread pool builds a big reply or zset store
+    struct ReplyJob *reply_job = NULL;
+    struct ZStoreOp *zstore_op = NULL;
+    // or with a write to a zset that such replies read, until they finish
+    ZSet *wait_zset = NULL;
+    // the append-only file position its reply waits on, for appendfsync always
+    uint64_t aof_wait = 0;
+};
+
+// a reply built on the thread pool, for KEYS and big zset ranges
+struct ReplyJob
+{
+    Conn *conn = NULL; // NULL once the connection is gone
+    Buffer out; // the whole response, header included
+    // a range of a shared zset, read under its read lock
+    ZSet *zset = NULL;
+    int64_t rank = 0;
+    int64_t n = 0;
+    bool rev = false;
+    bool withscores = false;
+    // or the keys of these entries
+    std::vector<struct Entry *> ents;
+};
+
+// maxmemory policies
+enum
+{
+    EVICT_NOEVICTION = 0,   // refuse the commands that add data
+    EVICT_ALLKEYS_LRU = 1,  // the least recently used key
+    EVICT_ALLKEYS_LFU = 2,  // the least frequently used key
+    EVICT_VOLATILE_TTL = 3, // the key with the nearest expiry
+};
+
+static const char *const k_evict_policies[] = {
+    "noeviction", "allkeys-lru", "allkeys-lfu", "volatile-ttl",
 };
 
+// server settings, from the command line (--name value) or CONFIG SET
+static struct
+{
+    uint32_t port = PORT; // to listen on; from the command line only
+    bool key_index = false; // maintain a radix tree of keys for SCANPREFIX
+    uint32_t zset_backend = ZSET_AVL; // the index of newly created zsets
+    // build replies of more elements than this on the thread pool; 0 = never
+    size_t reply_offload_min = 10000;
+    // evict keys to keep the data under this many bytes; 0 = no limit
+    size_t maxmemory = 0;
+    uint32_t maxmemory_policy = EVICT_NOEVICTION;
+    uint32_t maxmemory_samples = 5; // keys sampled per eviction
+    // active defrag: start a cycle when the fragmentation is over the
+    // threshold (percent) and over the ignored bytes; spend up to cycle_us
+    // per event loop iteration
+    bool activedefrag = false;
+    size_t active_defrag_ignore_bytes = 100 << 20;
+    uint32_t active_defrag_threshold = 10;
+    uint32_t active_defrag_cycle_us = 1000;
+    // compress string values of at least this many bytes, if it saves 1/8
+    bool compression = false;
+    size_t compression_min_size = 4096;
+    // the snapshot file, loaded at startup and written by SAVE and BGSAVE
+    std::string dbfilename = "dump.kvs";
+    // BGSAVE after this many seconds if there were this many changes; 0 = off
+    uint32_t save_seconds = 0;
+    size_t save_changes = 0;
+    // log write commands; replayed at startup instead of loading the snapshot
+    bool appendonly = false;
+    std::string appendfilename = "appendonly.aof";
+    // rewrite the log when it grew this many percent over its size after the
+    // last rewrite, and is at least min_size bytes; 0 = only BGREWRITEAOF
+    uint32_t auto_aof_rewrite_percentage = 100;
+    size_t auto_aof_rewrite_min_size = 64 << 20;
+} g_conf;
+
 // global states
 static struct
 {
     HMap db; // top-level hashtable
+    Rax index; // the keys of `db` in order, when `key-index` is on
     // a map of all client connections, keys by fd
     std::vector<Conn *> fd2conn;
     // timer for idle connections
     DList idle_list;
-    // timers for idle connections
-    std::vector<HeapItem> heap;
+    // TTL timers
+    DHeap heap;
     // the thread pool
     TheadPool thread_pool;
+    // parked connections by key, oldest first
+    std::unordered_map<std::string, std::deque<Conn *>> blocked;
+    // connections parked by writes to zsets being read on the thread pool
+    std::unordered_map<ZSet *, std::vector<Conn *>> zset_waiters;
+    // keys updated since the parked connections were last served
+    std::vector<std::string> ready_keys;
+    // timeouts of parked connections
+    DHeap block_heap;
+    // values queued for freeing on the thread pool
+    std::atomic<size_t> lazyfree_objects{0};
+    std::atomic<size_t> lazyfree_bytes{0};
+    std::atomic<size_t> lazyfreed_objects{0}; // in total
+    // replies and zset stores being built on the thread pool; they read
+    // keys and zsets, so freeing values is put off until there are none
+    size_t reply_jobs = 0;
+    std::vector<std::pair<struct Entry *, bool>> graveyard; // (entry, unlink)
+    std::vector<struct FlushJob *> deferred_flushes;
+    // the sum of entry_mem() over the keyspace, kept by entry_account()
+    size_t used_memory = 0;
+    size_t arena_slack = 0; // the sum of zset_slack(), likewise
+    size_t evicted_keys = 0;
+    // string compression: bytes before and after, for the values stored
+    // compressed; values that did not shrink enough; CPU time spent
+    size_t compress_in = 0;
+    size_t compress_out = 0;
+    size_t compress_skipped = 0;
+    uint64_t compress_us = 0;
+    uint64_t decompress_us = 0;
+    uint64_t rng = 0x9e3779b97f4a7c15ULL; // for eviction sampling
 } g_data;
 
 // Handle new connections
@@ -126,7 +262,7 @@ static Conn *handle_accept(int fd)
     fd_set_nb(connfd);
 
     // Create a new connection object
-    Conn *conn = new Conn();
+    Conn *conn = slab_new<Conn>();
     conn->fd = connfd;
     conn->want_read = true; // Start by reading the first request
     conn->want_write = false;
@@ -138,6 +274,10 @@ static Conn *handle_accept(int fd)
     return conn;
 }
 
+static void conn_unblock(Conn *conn);
+
+static void zstore_detach(struct ZStoreOp *op);
+
 static void conn_destroy(Conn *conn)
 {
     int fd = conn->fd;
@@ -153,8 +293,20 @@ static void conn_destroy(Conn *conn)
     }
 
     conn->fd = -1;
+    if (conn->reply_job)
+    {
+        conn->reply_job->conn = NULL; // the reply is dropped when done
+    }
+    if (conn->zstore_op)
+    {
+        zstore_detach(conn->zstore_op);
+    }
+    if (conn->blocked)
+    {
+        conn_unblock(conn);
+    }
     dlist_detach(&conn->idle_node);
-    delete conn;
+    slab_delete(conn);
 }
 
 // Helper functions for parsing requests
@@ -223,6 +375,10 @@ enum
     ERR_BAD_TYP = 3, // unexpected value type
     ERR_BAD_ARG = 4, // bad arguments
     ERR_BAD_REQ = 5,
+    ERR_DISABLED = 6, // turned off by the config
+    ERR_OOM = 7,      // over maxmemory, and nothing to evict
+    ERR_BUSY = 8,     // a background save is running
+    ERR_IO = 9,       // the append-only file cannot be written
 };
 
 enum
@@ -325,17 +481,74 @@ struct Entry
     // value
     uint32_t type = 0;
     std::string str;
+    size_t raw_len = 0; // if `str` holds LZ4 compressed bytes, their length
     std::string val; // Add this member
     ZSet zset;       // Use Zset instead of ZSet
-
-    Conn *owner_conn = nullptr;
+    // for maxmemory
+    size_t mem = 0; // the bytes counted in `g_data.used_memory`
+    size_t slack = 0; // and in `g_data.arena_slack`
+    uint32_t access = 0; // the LRU clock, or the LFU counter and its minute
 };
 
-static Entry *entry_new(uint32_t type, Conn *conn)
+// the LRU clock: milliseconds, wrapping after 49 days
+static uint32_t lru_clock()
 {
-    Entry *ent = new Entry();
+    return (uint32_t)get_monotonic_msec();
+}
+
+// LFU keeps a logarithmic (Morris) counter in the low 8 bits of `access`,
+// and the minute it was last touched in the high 24 bits
+const uint32_t k_lfu_init = 5; // so that new keys are not evicted first
+const uint32_t k_lfu_log_factor = 10;
+
+static uint32_t lfu_minutes()
+{
+    return (uint32_t)(get_monotonic_msec() / 60000) & 0xffffff;
+}
+
+// the counter, less one for each minute since the last touch
+static uint32_t lfu_counter(uint32_t access)
+{
+    uint32_t elapsed = (lfu_minutes() - (access >> 8)) & 0xffffff;
+    uint32_t counter = access & 0xff;
+    return counter > elapsed ? counter - elapsed : 0;
+}
+
+// xorshift64
+static uint64_t rand64()
+{
+    uint64_t x = g_data.rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return g_data.rng = x;
+}
+
+// record an access for the eviction policy
+static void entry_touch(Entry *ent)
+{
+    if (g_conf.maxmemory_policy != EVICT_ALLKEYS_LFU)
+    {
+        ent->access = lru_clock();
+        return;
+    }
+    // increment with a probability of 1 / ((counter - init) * factor + 1),
+    // so that 255 stands for about a million accesses
+    uint32_t counter = lfu_counter(ent->access);
+    uint32_t base = counter > k_lfu_init ? counter - k_lfu_init : 0;
+    if (counter < 255 && rand64() % (base * k_lfu_log_factor + 1) == 0)
+    {
+        counter++;
+    }
+    ent->access = lfu_minutes() << 8 | counter;
+}
+
+static Entry *entry_new(uint32_t type)
+{
+    Entry *ent = slab_new<Entry>();
     ent->type = type;
-    ent->owner_conn = conn;
+    ent->access = g_conf.maxmemory_policy == EVICT_ALLKEYS_LFU
+        ? lfu_minutes() << 8 | k_lfu_init : lru_clock();
     return ent;
 }
 
@@ -347,24 +560,103 @@ static void entry_del_sync(Entry *ent)
     {
         zset_clear(&ent->zset);
     }
-    ent->owner_conn = nullptr; // <- Clear this
-    delete ent;
+    slab_delete(ent);
+}
+
+// approximate heap bytes of an entry
+static size_t entry_mem(Entry *ent)
+{
+    size_t mem = sizeof(Entry) + ent->key.capacity() + ent->str.capacity();
+    if (ent->type == T_ZSET)
+    {
+        mem += zset_mem(&ent->zset);
+    }
+    return mem;
+}
+
+// update `g_data.used_memory` after the entry in the keyspace changed
+static void entry_account(Entry *ent)
+{
+    size_t mem = entry_mem(ent);
+    g_data.used_memory += mem - ent->mem;
+    ent->mem = mem;
+    size_t slack = ent->type == T_ZSET ? zset_slack(&ent->zset) : 0;
+    g_data.arena_slack += slack - ent->slack;
+    ent->slack = slack;
+}
+
+// the data under maxmemory: the keys and the hashtable slots
+static size_t used_memory()
+{
+    return g_data.used_memory + hm_mem(&g_data.db);
 }
 
 static void entry_del_func(void *arg)
 {
-    entry_del_sync((Entry *)arg);
+    Entry *ent = (Entry *)arg;
+    size_t mem = entry_mem(ent);
+    entry_del_sync(ent);
+    g_data.lazyfree_bytes -= mem;
+    g_data.lazyfree_objects--;
+    g_data.lazyfreed_objects++;
+}
+
+// the work of freeing a value, in units of about one free(): a zset member,
+// or a KiB of string to unmap
+static size_t str_free_effort(const std::string &s)
+{
+    return s.capacity() / 1024;
+}
+
+static size_t entry_free_effort(Entry *ent)
+{
+    if (ent->type == T_ZSET)
+    {
+        return zset_size(&ent->zset);
+    }
+    return str_free_effort(ent->str);
+}
+
+// DEL, overwrites and expiry free values of more effort than this on the
+// thread pool, and UNLINK those of more than k_lazyfree_min
+const size_t k_lazyfree_effort = 1000;
+const size_t k_lazyfree_min = 64;
+
+static void str_del_func(void *arg)
+{
+    std::string *s = (std::string *)arg;
+    size_t mem = s->capacity();
+    delete s;
+    g_data.lazyfree_bytes -= mem;
+    g_data.lazyfree_objects--;
+    g_data.lazyfreed_objects++;
+}
+
+// an overwritten string value; a big one is moved out and freed elsewhere
+static void str_del(std::string &s)
+{
+    if (str_free_effort(s) > k_lazyfree_effort)
+    {
+        g_data.lazyfree_bytes += s.capacity();
+        g_data.lazyfree_objects++;
+        thread_pool_queue(&g_data.thread_pool, &str_del_func, new std::string(std::move(s)));
+    }
 }
 
-static void entry_del(Entry *ent)
+static void entry_del(Entry *ent, bool unlink = false)
 {
     // unlink it from any data structures
     entry_set_ttl(ent, -1); // remove from the heap data structure
-    // run the destructor in a thread pool for large data structures
-    size_t set_size = (ent->type == T_ZSET) ? hm_size(&ent->zset.hmap) : 0;
-    const size_t k_large_container_size = 1000;
-    if (set_size > k_large_container_size)
+    if (g_data.reply_jobs > 0)
+    {
+        g_data.graveyard.emplace_back(ent, unlink); // may be in a reply
+        return;
+    }
+    // run the destructor in a thread pool for large values
+    if (entry_free_effort(ent) > (unlink ? k_lazyfree_min : k_lazyfree_effort))
     {
+        g_data.lazyfree_bytes += entry_mem(ent);
+        g_data.lazyfree_objects++;
         thread_pool_queue(&g_data.thread_pool, &entry_del_func, ent);
     }
     else
@@ -387,14 +679,186 @@ static bool entry_eq(HNode *node, HNode *key)
     return ent->key == keydata->key;
 }
 
-static void do_get(Conn *conn, vector<string> &cmd, Buffer &out)
+static bool hnode_same(HNode *node, HNode *key)
+{
+    return node == key;
+}
+
+static void index_add(Entry *ent)
+{
+    rax_insert(&g_data.index, (const uint8_t *)ent->key.data(), ent->key.size(), ent);
+}
+
+// keyspace updates go through these to keep the key index and the memory
+// accounting in sync
+static void db_insert(Entry *ent)
+{
+    hm_insert(&g_data.db, &ent->node);
+    entry_account(ent);
+    if (g_conf.key_index)
+    {
+        index_add(ent);
+    }
+}
+
+static Entry *db_delete(HNode *key, bool (*eq)(HNode *, HNode *))
+{
+    HNode *node = hm_delete(&g_data.db, key, eq);
+    if (!node)
+    {
+        return NULL;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    g_data.used_memory -= ent->mem;
+    g_data.arena_slack -= ent->slack;
+    ent->mem = ent->slack = 0;
+    if (g_conf.key_index)
+    {
+        rax_delete(&g_data.index, (const uint8_t *)ent->key.data(), ent->key.size());
+    }
+    return ent;
+}
+
+// and lookups, to feed the eviction policy
+static HNode *db_lookup(HNode *key)
+{
+    HNode *node = hm_lookup(&g_data.db, key, &entry_eq);
+    if (node)
+    {
+        entry_touch(container_of(node, Entry, node));
+    }
+    return node;
+}
+
+static void aof_log(Conn *conn, const std::vector<std::string> &cmd,
+                    const uint8_t *req = NULL, uint32_t len = 0);
+
+// the key to evict next, or NULL if there is none
+static Entry *evict_pick()
+{
+    if (g_conf.maxmemory_policy == EVICT_VOLATILE_TTL)
+    {
+        // the root of the TTL heap
+        return g_data.heap.len ? container_of(g_data.heap.items[0].ref, Entry, heap_idx) : NULL;
+    }
+    // the best of a few sampled keys; a higher rank goes first
+    HNode *nodes[64];
+    size_t n = hm_sample(&g_data.db, rand64(), nodes, g_conf.maxmemory_samples);
+    uint32_t now = lru_clock();
+    Entry *victim = NULL;
+    uint32_t best = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        Entry *ent = container_of(nodes[i], Entry, node);
+        uint32_t rank = g_conf.maxmemory_policy == EVICT_ALLKEYS_LFU
+            ? 255 - lfu_counter(ent->access) : now - ent->access;
+        if (!victim || rank > best)
+        {
+            victim = ent;
+            best = rank;
+        }
+    }
+    return victim;
+}
+
+// evict keys until the data fits in maxmemory; false if it cannot
+static bool evict_to_fit()
+{
+    while (g_conf.maxmemory > 0 && used_memory() > g_conf.maxmemory)
+    {
+        Entry *ent = g_conf.maxmemory_policy == EVICT_NOEVICTION ? NULL : evict_pick();
+        if (!ent)
+        {
+            return false;
+        }
+        db_delete(&ent->node, &hnode_same);
+        aof_log(NULL, {"del", ent->key});
+        entry_del(ent);
+        g_data.evicted_keys++;
+    }
+    return true;
+}
+
+static bool cb_index_add(HNode *node, void *)
+{
+    index_add(container_of(node, Entry, node));
+    return true;
+}
+
+// build or drop the key index
+static void index_rebuild()
+{
+    rax_clear(&g_data.index);
+    if (g_conf.key_index)
+    {
+        hm_foreach(&g_data.db, &cb_index_add, NULL);
+    }
+}
+
+// values up to this size are compressed into a buffer kept for reuse
+const size_t k_compress_scratch_max = 1 << 20;
+
+// store a string value, compressed if it is big and shrinks enough; the
+// old value is swapped into `val`
+static void entry_set_str(Entry *ent, std::string &val)
+{
+    ent->raw_len = 0;
+    if (!g_conf.compression || val.size() < g_conf.compression_min_size)
+    {
+        return ent->str.swap(val);
+    }
+    // bigger values get a buffer of their own, freed on return, so that the
+    // kept one stays small; it is not counted in used_memory
+    static std::vector<uint8_t> scratch;
+    std::vector<uint8_t> big;
+    size_t cap = val.size() - val.size() / 8;
+    std::vector<uint8_t> &buf = cap <= k_compress_scratch_max ? scratch : big;
+    buf.resize(std::max(buf.size(), cap));
+    uint64_t start = get_monotonic_usec();
+    size_t n = lz_compress((const uint8_t *)val.data(), val.size(), buf.data(), cap);
+    g_data.compress_us += get_monotonic_usec() - start;
+    if (n == 0)
+    {
+        g_data.compress_skipped++;
+        return ent->str.swap(val);
+    }
+    g_data.compress_in += val.size();
+    g_data.compress_out += n;
+    ent->raw_len = val.size();
+    // the old value goes to `val`, and the uncompressed one is freed here
+    std::string raw;
+    raw.swap(val);
+    val.swap(ent->str);
+    ent->str.assign((const char *)buf.data(), n);
+}
+
+// a string value, decompressed straight into the output
+static void out_value(Buffer &out, Entry *ent)
+{
+    if (!ent->raw_len)
+    {
+        return out_str(out, ent->str.data(), ent->str.size());
+    }
+    buf_append_u8(out, TAG_STR);
+    buf_append_u32(out, (uint32_t)ent->raw_len);
+    size_t pos = out.size();
+    out.resize(pos + ent->raw_len);
+    uint64_t start = get_monotonic_usec();
+    bool ok = lz_decompress((const uint8_t *)ent->str.data(), ent->str.size(),
+                            &out[pos], ent->raw_len);
+    g_data.decompress_us += get_monotonic_usec() - start;
+    assert(ok);
+    (void)ok;
+}
+
+static void do_get(Conn *, vector<string> &cmd, Buffer &out)
 {
     // a dummy `Entry` just for the lookup
     LookupKey key;
     key.key = cmd[1]; // instead of swap(cmd[1])
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
     // hashtable lookup
-    HNode *node = hm_lookup(&conn->db, &key.node, &entry_eq);
+    HNode *node = db_lookup(&key.node);
     if (!node)
     {
         return out_nil(out);
@@ -405,10 +869,41 @@ static void do_get(Conn *conn, vector<string> &cmd, Buffer &out)
     {
         return out_err(out, ERR_BAD_TYP, "not a string value");
     }
-    return out_str(out, ent->str.data(), ent->str.size());
+    return out_value(out, ent);
+}
+
+// getraw: [encoding, length, bytes], the bytes as stored; "lz4" is an LZ4
+// block of the given uncompressed length
+static void do_getraw(Conn *, vector<string> &cmd, Buffer &out)
+{
+    LookupKey key;
+    key.key = cmd[1];
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    if (!node)
+    {
+        return out_nil(out);
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_STR)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a string value");
+    }
+    out_arr(out, 3);
+    if (ent->raw_len)
+    {
+        out_str(out, "lz4", 3);
+        out_int(out, (int64_t)ent->raw_len);
+    }
+    else
+    {
+        out_str(out, "raw", 3);
+        out_int(out, (int64_t)ent->str.size());
+    }
+    out_str(out, ent->str.data(), ent->str.size());
 }
 
-static void do_set(Conn *conn, vector<string> &cmd, Buffer &out)
+static void do_set(Conn *, vector<string> &cmd, Buffer &out)
 {
     // a dummy `Entry` for the lookup
     LookupKey key;
@@ -416,7 +911,7 @@ static void do_set(Conn *conn, vector<string> &cmd, Buffer &out)
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
 
     // hashtable lookup
-    HNode *node = hm_lookup(&conn->db, &key.node, &entry_eq);
+    HNode *node = db_lookup(&key.node);
     if (node)
     {
         // found, update the value
@@ -425,34 +920,36 @@ static void do_set(Conn *conn, vector<string> &cmd, Buffer &out)
         {
             return out_err(out, ERR_BAD_TYP, "a non-string value exists");
         }
-        ent->str.swap(cmd[2]);
+        entry_set_str(ent, cmd[2]);
+        str_del(cmd[2]); // the old value
+        entry_account(ent);
     }
     else
     {
         // not found, allocate & insert a new pair
-        Entry *ent = entry_new(T_STR, conn);
+        Entry *ent = entry_new(T_STR);
         ent->key.swap(key.key);
         ent->node.hcode = key.node.hcode;
         ent->type = T_STR;
-        ent->str.swap(cmd[2]); // you store string value here
-        hm_insert(&conn->db, &ent->node);
+        entry_set_str(ent, cmd[2]); // you store string value here
+        db_insert(ent);
     }
 
     // Return "OK" as a response
     return out_str(out, "1", 1);
 }
 
-static void do_del(Conn *conn, vector<string> &cmd, Buffer &out)
+static void do_del(Conn *, vector<string> &cmd, Buffer &out)
 {
     // a dummy struct just for the lookup
     LookupKey key;
     key.key.swap(cmd[1]);
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
     // hashtable delete
-    HNode *node = hm_delete(&conn->db, &key.node, &entry_eq);
-    if (node)
+    Entry *ent = db_delete(&key.node, &entry_eq);
+    if (ent)
     {
-        entry_del(container_of(node, Entry, node));
+        entry_del(ent);
         return out_str(out, "1", 1); // Success
     }
     else
@@ -461,261 +958,3115 @@ static void do_del(Conn *conn, vector<string> &cmd, Buffer &out)
     }
 }
 
-static void heap_delete(std::vector<HeapItem> &a, size_t pos)
+// unlink key [key ...]: like DEL, but frees most values on the thread pool
+static void do_unlink(Conn *, vector<string> &cmd, Buffer &out)
 {
-    // swap the erased item with the last item
-    a[pos] = a.back();
-    a.pop_back();
-    // update the swapped item
-    if (pos < a.size())
+    int64_t n = 0;
+    for (size_t i = 1; i < cmd.size(); i++)
     {
-        heap_update(a.data(), pos, a.size());
+        LookupKey key;
+        key.key.swap(cmd[i]);
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        if (Entry *ent = db_delete(&key.node, &entry_eq))
+        {
+            entry_del(ent, true);
+            n++;
+        }
     }
+    return out_int(out, n);
+}
+
+// the keyspace detached by FLUSHDB
+struct FlushJob
+{
+    HMap db;
+    Rax index;
+    bool async = false;
+};
+
+static void cb_flush_entry(HNode *node, void *)
+{
+    entry_del_sync(container_of(node, Entry, node));
+}
+
+static bool cb_entry_mem(HNode *node, void *arg)
+{
+    *(size_t *)arg += entry_mem(container_of(node, Entry, node));
+    return true;
 }
 
-static void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t)
+static void cb_lazyfree_entry(HNode *node, void *)
 {
-    if (pos < a.size())
+    entry_del_func(container_of(node, Entry, node));
+}
+
+static void flush_func(void *arg)
+{
+    FlushJob *job = (FlushJob *)arg;
+    // count the bytes first, then release them entry by entry
+    size_t mem = 0;
+    hm_foreach(&job->db, &cb_entry_mem, &mem);
+    g_data.lazyfree_bytes += mem;
+    hm_dispose(&job->db, &cb_lazyfree_entry, NULL);
+    rax_clear(&job->index);
+    delete job;
+}
+
+static void flush_run(FlushJob *job)
+{
+    if (job->async)
     {
-        a[pos] = t; // update an existing item
+        g_data.lazyfree_objects += hm_size(&job->db);
+        thread_pool_queue(&g_data.thread_pool, &flush_func, job);
     }
     else
     {
-        pos = a.size();
-        a.push_back(t); // or add a new item
+        hm_dispose(&job->db, &cb_flush_entry, NULL);
+        rax_clear(&job->index);
+        delete job;
     }
-    heap_update(a.data(), pos, a.size());
 }
 
-// set or remove the TTL
-static void entry_set_ttl(Entry *ent, int64_t ttl_ms)
+// flushdb [async|sync]: drop every key, freeing them on the thread pool if
+// async, or by default if there are many
+static void do_flushdb(Conn *, vector<string> &cmd, Buffer &out)
 {
-    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1)
+    bool async = hm_size(&g_data.db) > k_lazyfree_effort;
+    if (cmd.size() == 2)
     {
-        // setting a negative TTL means removing the TTL
-        heap_delete(g_data.heap, ent->heap_idx);
-        ent->heap_idx = -1;
+        if (strcasecmp(cmd[1].c_str(), "async") == 0)
+        {
+            async = true;
+        }
+        else if (strcasecmp(cmd[1].c_str(), "sync") == 0)
+        {
+            async = false;
+        }
+        else
+        {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
     }
-    else if (ttl_ms >= 0)
+    // the TTL heap refers to nothing but keys
+    dheap_clear(&g_data.heap);
+    g_data.used_memory = g_data.arena_slack = 0;
+    FlushJob *job = new FlushJob{g_data.db, g_data.index, async};
+    g_data.db = HMap{};
+    g_data.index = Rax{};
+    if (g_data.reply_jobs > 0)
     {
-        // add or update the heap data structure
-        uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
-        HeapItem item = {expire_at, &ent->heap_idx};
-        heap_upsert(g_data.heap, ent->heap_idx, item);
+        g_data.deferred_flushes.push_back(job); // may be in a reply
+    }
+    else
+    {
+        flush_run(job);
     }
+    return out_str(out, "OK", 2);
 }
 
-static bool str2int(const std::string &s, int64_t &out)
+// snapshots: a forked child writes the keyspace as of the fork, while the
+// copy-on-write pages keep the parent free to change it
+static struct
 {
-    char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
-}
+    pid_t child = -1; // of the running BGSAVE
+    uint64_t child_start_ms = 0;
+    size_t dirty = 0; // write commands since the last save
+    size_t dirty_at_fork = 0;
+    int64_t last_save_ms = 0; // unix time of the last successful save
+    uint64_t last_try_ms = 0; // of the last BGSAVE
+    bool last_bgsave_ok = true;
+    uint64_t fork_us = 0; // the time fork() took, for the last BGSAVE or rewrite
+} g_save;
 
-// PEXPIRE key ttl_ms
-static void do_expire(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+// rewriting the append-only file, likewise in a forked child
+static struct
 {
-    int64_t ttl_ms = 0;
-    if (!str2int(cmd[2], ttl_ms))
-    {
-        return out_err(out, ERR_BAD_ARG, "expect int64");
-    }
-    LookupKey key;
-    key.key = cmd[1]; // instead of swap(cmd[1])
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    pid_t child = -1;
+    uint64_t start_ms = 0;
+    uint64_t last_try_ms = 0;
+    bool last_ok = true;
+    uint64_t base_size = 0; // of the log after the last rewrite, or at startup
+} g_rewrite;
 
-    HNode *node = hm_lookup(&conn->db, &key.node, &entry_eq);
-    if (node)
-    {
-        Entry *ent = container_of(node, Entry, node);
-        entry_set_ttl(ent, ttl_ms);
-    }
-    return out_int(out, node ? 1 : 0);
+// one child at a time, since both copy pages the parent writes to
+static bool child_running()
+{
+    return g_save.child > 0 || g_rewrite.child > 0;
 }
 
-// PTTL key
-static void do_ttl(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
-{
-    LookupKey key;
-    key.key = cmd[1]; // instead of swap(cmd[1])
+// a failed BGSAVE is retried by the `save` schedule after this long
+const uint64_t k_bgsave_retry_ms = 5000;
 
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+struct SnapCtx
+{
+    SnapWriter w;
+    uint64_t now_ms = 0; // monotonic, for the TTL heap
+    int64_t wall_ms = 0; // the same instant in unix time
+    size_t keys = 0;
+};
 
-    HNode *node = hm_lookup(&conn->db, &key.node, &entry_eq);
-    if (!node)
+// the expiry of a key in unix time, given the monotonic and the unix time
+// of now; -1 for no TTL
+static int64_t entry_expire_at(Entry *ent, uint64_t now_ms, int64_t wall_ms)
+{
+    if (ent->heap_idx == (size_t)-1)
     {
-        return out_int(out, -2); // not found
+        return -1;
     }
+    uint64_t at = g_data.heap.items[ent->heap_idx].val;
+    return wall_ms + (at > now_ms ? (int64_t)(at - now_ms) : 0);
+}
 
+static bool cb_snapshot(HNode *node, void *arg)
+{
+    SnapCtx *ctx = (SnapCtx *)arg;
     Entry *ent = container_of(node, Entry, node);
-    if (ent->heap_idx == (size_t)-1)
+    int64_t expire_at = entry_expire_at(ent, ctx->now_ms, ctx->wall_ms);
+    if (ent->type == T_ZSET)
     {
-        return out_int(out, -1); // no TTL
+        snap_put_zset(&ctx->w, ent->key, expire_at, zset_size(&ent->zset));
+        ZIter iter;
+        for (ziter_init(&iter, &ent->zset, zset_first(&ent->zset)); iter.node; ziter_next(&iter))
+        {
+            snap_put_member(&ctx->w, std::string_view(iter.node->name, iter.node->len),
+                            iter.node->score);
+        }
+    }
+    else
+    {
+        snap_put_str(&ctx->w, ent->key, expire_at, ent->str, ent->raw_len);
+    }
+    ctx->keys++;
+    return !ctx->w.failed;
+}
+
+// write the keyspace to the snapshot file; in the BGSAVE child or blocking
+static bool snapshot_save(const char *who)
+{
+    const char *path = g_conf.dbfilename.c_str();
+    uint64_t start_us = get_monotonic_usec();
+    SnapCtx ctx;
+    ctx.now_ms = get_monotonic_msec();
+    ctx.wall_ms = get_realtime_msec();
+    if (!snap_create(&ctx.w, path))
+    {
+        fprintf(stderr, "%s: cannot create %s.tmp: %s\n", who, path, strerror(errno));
+        return false;
+    }
+    hm_foreach(&g_data.db, &cb_snapshot, &ctx);
+    if (ctx.w.failed)
+    {
+        fprintf(stderr, "%s: write error: %s\n", who, strerror(errno));
+        snap_abort(&ctx.w, path);
+        return false;
+    }
+    if (!snap_finish(&ctx.w, path))
+    {
+        fprintf(stderr, "%s: cannot finish %s: %s\n", who, path, strerror(errno));
+        return false;
+    }
+    uint64_t us = get_monotonic_usec() - start_us + 1;
+    fprintf(stderr, "%s: saved %zu keys, %zu KiB in %zu ms (%.0f MB/s)\n", who, ctx.keys,
+            ctx.w.bytes >> 10, (size_t)(us / 1000), (double)ctx.w.bytes / us);
+    return true;
+}
+
+// start a BGSAVE; false if fork() failed
+static bool bgsave_start()
+{
+    uint64_t start_us = get_monotonic_usec();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        msg_errno("fork() failed");
+        g_save.last_bgsave_ok = false;
+        g_save.last_try_ms = get_monotonic_msec();
+        return false;
     }
+    if (pid == 0)
+    {
+        // the child reads the keyspace and never returns to the loop
+        _exit(snapshot_save("bgsave") ? 0 : 1);
+    }
+    g_save.fork_us = get_monotonic_usec() - start_us;
+    g_save.child = pid;
+    g_save.child_start_ms = g_save.last_try_ms = get_monotonic_msec();
+    g_save.dirty_at_fork = g_save.dirty;
+    return true;
+}
 
-    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+// reap a finished BGSAVE, and start one when the `save` schedule says so
+static void bgsave_poll()
+{
+    if (g_save.child > 0)
+    {
+        int status = 0;
+        pid_t pid = waitpid(g_save.child, &status, WNOHANG);
+        if (pid == 0 || (pid < 0 && errno == EINTR))
+        {
+            return; // still running
+        }
+        bool ok = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        g_save.child = -1;
+        g_save.last_bgsave_ok = ok;
+        if (ok)
+        {
+            g_save.dirty -= g_save.dirty_at_fork;
+            g_save.last_save_ms = get_realtime_msec() -
+                (int64_t)(get_monotonic_msec() - g_save.child_start_ms);
+        }
+        else
+        {
+            fprintf(stderr, "bgsave: failed\n");
+        }
+    }
     uint64_t now_ms = get_monotonic_msec();
-    return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
+    if (g_conf.save_seconds == 0 || g_save.dirty < g_conf.save_changes || child_running() ||
+        get_realtime_msec() - g_save.last_save_ms < (int64_t)g_conf.save_seconds * 1000 ||
+        (!g_save.last_bgsave_ok && now_ms - g_save.last_try_ms < k_bgsave_retry_ms))
+    {
+        return;
+    }
+    fprintf(stderr, "bgsave: %zu changes in %u seconds\n", g_save.dirty, g_conf.save_seconds);
+    bgsave_start();
 }
 
-static bool cb_keys(HNode *node, void *arg)
+static void do_save(Conn *, vector<string> &, Buffer &out)
 {
-    Buffer &out = *(Buffer *)arg;
-    const string &key = container_of(node, Entry, node)->key;
-    out_str(out, key.data(), key.size());
+    if (g_save.child > 0)
+    {
+        return out_err(out, ERR_BUSY, "background save already in progress");
+    }
+    if (!snapshot_save("save"))
+    {
+        return out_err(out, ERR_BAD_REQ, "snapshot failed, see the server log");
+    }
+    g_save.dirty = 0;
+    g_save.last_save_ms = get_realtime_msec();
+    return out_str(out, "1", 1);
+}
+
+static void do_bgsave(Conn *, vector<string> &, Buffer &out)
+{
+    if (child_running())
+    {
+        return out_err(out, ERR_BUSY, "background save or rewrite already in progress");
+    }
+    if (!bgsave_start())
+    {
+        return out_err(out, ERR_BAD_REQ, "fork() failed");
+    }
+    return out_str(out, "1", 1);
+}
+
+// load the snapshot file at startup; keys that expired since are dropped
+static void snapshot_load()
+{
+    const char *path = g_conf.dbfilename.c_str();
+    uint64_t start_us = get_monotonic_usec();
+    SnapReader r;
+    int rv = snap_open(&r, path);
+    if (rv == SNAP_MISSING)
+    {
+        return;
+    }
+    if (rv != SNAP_OK)
+    {
+        fprintf(stderr, "snapshot %s: %s\n", path,
+                rv == SNAP_CORRUPT ? "bad checksum or format" : strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int64_t wall_ms = get_realtime_msec();
+    size_t keys = 0, expired = 0;
+    SnapRecord rec;
+    std::vector<ZAddItem> items;
+    while (snap_next(&r, &rec, &rv))
+    {
+        Entry *ent = entry_new((rec.type & 0x0f) == SNAP_ZSET ? T_ZSET : T_STR);
+        ent->key.assign(rec.key.data(), rec.key.size());
+        ent->node.hcode = str_hash((const uint8_t *)ent->key.data(), ent->key.size());
+        if (ent->type == T_ZSET)
+        {
+            zset_init(&ent->zset, g_conf.zset_backend);
+            items.resize(rec.n);
+            for (ZAddItem &item : items)
+            {
+                std::string_view name;
+                if (!snap_next_member(&r, &name, &item.score))
+                {
+                    rv = SNAP_CORRUPT;
+                    break;
+                }
+                item.name = name.data();
+                item.len = name.size();
+            }
+            if (rv != SNAP_OK)
+            {
+                entry_del_sync(ent);
+                break;
+            }
+            zset_add_bulk(&ent->zset, items.data(), items.size());
+        }
+        else
+        {
+            ent->str.assign(rec.val.data(), rec.val.size());
+            ent->raw_len = rec.raw_len;
+        }
+        if (rec.expire_at_ms >= 0 && rec.expire_at_ms <= wall_ms)
+        {
+            entry_del_sync(ent);
+            expired++;
+            continue;
+        }
+        db_insert(ent);
+        if (rec.expire_at_ms >= 0)
+        {
+            entry_set_ttl(ent, rec.expire_at_ms - wall_ms);
+        }
+        keys++;
+    }
+    size_t bytes = r.size;
+    snap_close(&r);
+    if (rv != SNAP_OK)
+    {
+        fprintf(stderr, "snapshot %s: bad record after %zu keys\n", path, keys);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t us = get_monotonic_usec() - start_us + 1;
+    fprintf(stderr, "snapshot: loaded %zu keys (%zu expired), %zu KiB in %zu ms (%.0f MB/s)\n",
+            keys, expired, bytes >> 10, (size_t)(us / 1000), (double)bytes / us);
+}
+
+// the append-only file: each write command, in the request encoding
+static Aof g_aof;
+
+static const char *const k_aof_fsync[] = {"no", "everysec", "always"};
+
+static bool str2int(const std::string &s, int64_t &out);
+
+// a command in the request encoding, header included
+static void req_encode(Buffer &out, const std::vector<std::string> &cmd)
+{
+    uint32_t len = 4;
+    for (const std::string &s : cmd)
+    {
+        len += 4 + (uint32_t)s.size();
+    }
+    buf_append_u32(out, len);
+    buf_append_u32(out, (uint32_t)cmd.size());
+    for (const std::string &s : cmd)
+    {
+        buf_append_u32(out, (uint32_t)s.size());
+        buf_append(out, (const uint8_t *)s.data(), s.size());
+    }
+}
+
+static void aof_put_req(const std::vector<std::string> &cmd)
+{
+    Buffer req;
+    req_encode(req, cmd);
+    aof_append(&g_aof, req.data(), req.size());
+}
+
+// log a write that took effect, given as the request it came in if any,
+// since handlers consume the strings of `cmd`; under `appendfsync always`,
+// the reply of `conn` is held until the log is synced up to it
+static void aof_log(Conn *conn, const std::vector<std::string> &cmd,
+                    const uint8_t *req, uint32_t len)
+{
+    if (!aof_logging(&g_aof))
+    {
+        return;
+    }
+    int64_t ttl_ms = 0;
+    if (cmd[0] == "pexpire" && str2int(cmd[2], ttl_ms))
+    {
+        // replayed later, so the expiry must be absolute
+        int64_t at = ttl_ms < 0 ? -1 : get_realtime_msec() + ttl_ms;
+        aof_put_req({"pexpireat", cmd[1], std::to_string(at)});
+    }
+    else if (req)
+    {
+        aof_append(&g_aof, (const uint8_t *)&len, 4);
+        aof_append(&g_aof, req, len);
+    }
+    else
+    {
+        aof_put_req(cmd);
+    }
+    if (conn && g_aof.policy == AOF_FSYNC_ALWAYS)
+    {
+        conn->aof_wait = aof_pos(&g_aof);
+    }
+}
+
+// the reply waits for the log to reach the disk
+static bool aof_held(Conn *conn)
+{
+    return conn->aof_wait > g_aof.synced.load(std::memory_order_acquire);
+}
+
+// one write() per event loop iteration, before any reply goes out
+static void aof_write()
+{
+    bool failed = g_aof.write_error;
+    if (!aof_flush(&g_aof) && !failed)
+    {
+        msg_errno("aof: write() failed; refusing writes until it succeeds");
+    }
+    else if (failed && !g_aof.write_error)
+    {
+        msg("aof: write() succeeded again");
+    }
+    // the sync thread's failures, noticed here
+    static bool fsync_failed = false;
+    if (g_aof.fsync_error.load(std::memory_order_acquire) != fsync_failed)
+    {
+        fsync_failed = !fsync_failed;
+        errno = g_aof.fsync_errno.load(std::memory_order_relaxed);
+        if (fsync_failed)
+        {
+            msg_errno("aof: fdatasync() failed; refusing writes until it succeeds");
+        }
+        else
+        {
+            msg("aof: fdatasync() succeeded again");
+        }
+    }
+}
+
+static void do_request(Conn *conn, vector<string> &cmd, Buffer &out);
+
+// replay the log at startup; false if there is none. a partial command at
+// the end, from a crash in the middle of a write(), is cut off.
+static bool aof_load()
+{
+    const char *path = g_conf.appendfilename.c_str();
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT)
+    {
+        return false;
+    }
+    struct stat st = {};
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        die("aof: cannot open the append-only file");
+    }
+    uint64_t start_us = get_monotonic_usec();
+    size_t size = (size_t)st.st_size;
+    const uint8_t *data = NULL;
+    if (size > 0)
+    {
+        data = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            die("aof: mmap() failed");
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    Conn replay; // no client; write commands never park or offload
+    Buffer out;
+    vector<string> cmd;
+    size_t pos = 0, ncmds = 0;
+    while (size - pos >= 4)
+    {
+        uint32_t len = 0;
+        memcpy(&len, data + pos, 4);
+        if (len > size - pos - 4)
+        {
+            break; // the partial tail
+        }
+        cmd.clear();
+        if (parse_req(data + pos + 4, len, cmd) < 0 || cmd.empty())
+        {
+            fprintf(stderr, "aof: bad command at offset %zu of %s\n", pos, path);
+            exit(EXIT_FAILURE);
+        }
+        out.clear();
+        do_request(&replay, cmd, out);
+        pos += 4 + len;
+        ncmds++;
+    }
+    if (data)
+    {
+        munmap((void *)data, size);
+    }
+    if (pos < size)
+    {
+        fprintf(stderr, "aof: cutting off %zu bytes of a partial command at the end\n", size - pos);
+        if (ftruncate(fd, (off_t)pos) != 0)
+        {
+            die("aof: ftruncate() failed");
+        }
+    }
+    close(fd);
+    g_data.ready_keys.clear();
+    g_save.dirty = 0;
+    uint64_t us = get_monotonic_usec() - start_us + 1;
+    fprintf(stderr, "aof: replayed %zu commands, %zu KiB in %zu ms, %zu keys\n", ncmds,
+            pos >> 10, (size_t)(us / 1000), hm_size(&g_data.db));
     return true;
 }
 
-static void do_keys(Conn *conn, vector<string> &, Buffer &out)
+// start logging to `appendfilename`
+static bool aof_start()
 {
-    out_arr(out, (uint32_t)hm_size(&conn->db));
-    hm_foreach(&conn->db, &cb_keys, (void *)&out);
+    if (!aof_open(&g_aof, g_conf.appendfilename.c_str()))
+    {
+        msg_errno("aof: cannot open the append-only file");
+        return false;
+    }
+    return true;
 }
 
-static bool str2dbl(const std::string &s, double &out)
+// members per ZADD in a rewritten log
+const size_t k_rewrite_zadd_batch = 1000;
+
+struct RewriteCtx
 {
-    char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
+    AofWriter w;
+    uint64_t now_ms = 0; // monotonic, for the TTL heap
+    int64_t wall_ms = 0; // the same instant in unix time
+    size_t keys = 0;
+    std::string raw; // a decompressed value
+    std::vector<std::string> scores; // of a ZADD batch
+    std::vector<std::string_view> args;
+};
+
+// a key as the commands that create it
+static bool cb_rewrite(HNode *node, void *arg)
+{
+    RewriteCtx *ctx = (RewriteCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type == T_ZSET)
+    {
+        // an empty zset has no ZADD, and is left out
+        ZIter iter;
+        ziter_init(&iter, &ent->zset, zset_first(&ent->zset));
+        while (iter.node)
+        {
+            ctx->args.assign({"zadd", ent->key});
+            for (size_t i = 0; iter.node && i < k_rewrite_zadd_batch; i++, ziter_next(&iter))
+            {
+                char buf[32];
+                int n = snprintf(buf, sizeof(buf), "%.17g", iter.node->score);
+                ctx->scores[i].assign(buf, (size_t)n);
+                ctx->args.push_back(ctx->scores[i]);
+                ctx->args.push_back(std::string_view(iter.node->name, iter.node->len));
+            }
+            aofw_put(&ctx->w, ctx->args.data(), ctx->args.size());
+        }
+    }
+    else
+    {
+        std::string_view val = ent->str;
+        if (ent->raw_len)
+        {
+            ctx->raw.resize(ent->raw_len);
+            bool ok = lz_decompress((const uint8_t *)ent->str.data(), ent->str.size(),
+                                    (uint8_t *)ctx->raw.data(), ent->raw_len);
+            assert(ok);
+            (void)ok;
+            val = ctx->raw;
+        }
+        std::string_view args[] = {"set", ent->key, val};
+        aofw_put(&ctx->w, args, 3);
+    }
+    int64_t expire_at = entry_expire_at(ent, ctx->now_ms, ctx->wall_ms);
+    if (expire_at >= 0)
+    {
+        std::string at = std::to_string(expire_at);
+        std::string_view args[] = {"pexpireat", ent->key, at};
+        aofw_put(&ctx->w, args, 3);
+    }
+    ctx->keys++;
+    return !ctx->w.failed;
 }
 
-// zadd zset score name
-static void do_zadd(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+// in the rewrite child: write the keyspace to `<appendfilename>.tmp`
+static bool aof_rewrite_write()
 {
-    double score = 0;
-    if (!str2dbl(cmd[2], score))
+    const char *path = g_conf.appendfilename.c_str();
+    uint64_t start_us = get_monotonic_usec();
+    RewriteCtx ctx;
+    ctx.now_ms = get_monotonic_msec();
+    ctx.wall_ms = get_realtime_msec();
+    ctx.scores.resize(k_rewrite_zadd_batch);
+    if (!aofw_create(&ctx.w, path))
+    {
+        fprintf(stderr, "aof rewrite: cannot create %s.tmp: %s\n", path, strerror(errno));
+        return false;
+    }
+    hm_foreach(&g_data.db, &cb_rewrite, &ctx);
+    if (!aofw_finish(&ctx.w, path))
+    {
+        fprintf(stderr, "aof rewrite: write error: %s\n", strerror(errno));
+        return false;
+    }
+    uint64_t us = get_monotonic_usec() - start_us + 1;
+    fprintf(stderr, "aof rewrite: wrote %zu keys, %zu KiB in %zu ms (%.0f MB/s)\n", ctx.keys,
+            ctx.w.bytes >> 10, (size_t)(us / 1000), (double)ctx.w.bytes / us);
+    return true;
+}
+
+// start a rewrite; false if fork() failed
+static bool aof_rewrite_start()
+{
+    uint64_t start_us = get_monotonic_usec();
+    g_rewrite.last_try_ms = get_monotonic_msec();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        msg_errno("fork() failed");
+        g_rewrite.last_ok = false;
+        return false;
+    }
+    if (pid == 0)
+    {
+        // the child reads the keyspace and never returns to the loop
+        _exit(aof_rewrite_write() ? 0 : 1);
+    }
+    g_save.fork_us = get_monotonic_usec() - start_us;
+    g_rewrite.child = pid;
+    g_rewrite.start_ms = g_rewrite.last_try_ms;
+    aof_rewrite_begin(&g_aof);
+    return true;
+}
+
+// drop a running rewrite, when the log is turned off
+static void aof_rewrite_kill()
+{
+    if (g_rewrite.child <= 0)
+    {
+        return;
+    }
+    kill(g_rewrite.child, SIGKILL);
+    waitpid(g_rewrite.child, NULL, 0);
+    g_rewrite.child = -1;
+    aof_rewrite_abort(&g_aof, g_conf.appendfilename.c_str());
+}
+
+// reap a finished rewrite and switch to its file; start one to create the
+// log, or when it grew by auto-aof-rewrite-percentage since the last one
+static void aof_rewrite_poll()
+{
+    const char *path = g_conf.appendfilename.c_str();
+    if (g_rewrite.child > 0)
+    {
+        int status = 0;
+        pid_t pid = waitpid(g_rewrite.child, &status, WNOHANG);
+        if (pid == 0 || (pid < 0 && errno == EINTR))
+        {
+            return; // still running
+        }
+        g_rewrite.child = -1;
+        size_t meanwhile = g_aof.rewrite_buf.size();
+        bool ok = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        if (!ok)
+        {
+            aof_rewrite_abort(&g_aof, path);
+            fprintf(stderr, "aof rewrite: failed\n");
+        }
+        else if (!aof_rewrite_end(&g_aof, path))
+        {
+            ok = false;
+            msg_errno("aof rewrite: cannot switch to the new file");
+        }
+        else
+        {
+            fprintf(stderr, "aof rewrite: done in %zu ms, %zu KiB, of which %zu KiB logged "
+                    "meanwhile\n", (size_t)(get_monotonic_msec() - g_rewrite.start_ms),
+                    (size_t)(g_aof.file_size >> 10), meanwhile >> 10);
+            g_rewrite.base_size = g_aof.file_size;
+        }
+        g_rewrite.last_ok = ok;
+    }
+    if (!g_conf.appendonly || child_running() || (!g_rewrite.last_ok &&
+        get_monotonic_msec() - g_rewrite.last_try_ms < k_bgsave_retry_ms))
+    {
+        return;
+    }
+    uint64_t size = g_aof.file_size, base = g_rewrite.base_size;
+    uint32_t pct = g_conf.auto_aof_rewrite_percentage;
+    if (g_aof.fd < 0)
+    {
+        fprintf(stderr, "aof rewrite: creating the log from %zu keys\n", hm_size(&g_data.db));
+    }
+    else if (pct && size >= g_conf.auto_aof_rewrite_min_size && size >= base + base * pct / 100)
+    {
+        fprintf(stderr, "aof rewrite: the log grew from %zu KiB to %zu KiB\n",
+                (size_t)(base >> 10), (size_t)(size >> 10));
+    }
+    else
+    {
+        return;
+    }
+    aof_rewrite_start();
+}
+
+static void do_bgrewriteaof(Conn *, vector<string> &, Buffer &out)
+{
+    if (!g_conf.appendonly)
+    {
+        return out_err(out, ERR_BAD_REQ, "appendonly is off");
+    }
+    if (child_running())
+    {
+        return out_err(out, ERR_BUSY, "background save or rewrite already in progress");
+    }
+    if (!aof_rewrite_start())
+    {
+        return out_err(out, ERR_BAD_REQ, "fork() failed");
+    }
+    return out_str(out, "1", 1);
+}
+
+// info: server statistics as name, value pairs
+static void do_info(Conn *, vector<string> &, Buffer &out)
+{
+    size_t nclients = 0;
+    for (Conn *conn : g_data.fd2conn)
+    {
+        nclients += conn != NULL;
+    }
+    out_arr(out, 60);
+    out_str(out, "keys", 4);
+    out_int(out, (int64_t)hm_size(&g_data.db));
+    out_str(out, "expires", 7);
+    out_int(out, (int64_t)g_data.heap.len);
+    out_str(out, "connected_clients", 17);
+    out_int(out, (int64_t)nclients);
+    out_str(out, "lazyfree_pending_objects", 24);
+    out_int(out, (int64_t)g_data.lazyfree_objects.load());
+    out_str(out, "lazyfree_pending_bytes", 22);
+    out_int(out, (int64_t)g_data.lazyfree_bytes.load());
+    out_str(out, "lazyfreed_objects", 17);
+    out_int(out, (int64_t)g_data.lazyfreed_objects.load());
+    out_str(out, "used_memory", 11);
+    out_int(out, (int64_t)used_memory());
+    out_str(out, "maxmemory", 9);
+    out_int(out, (int64_t)g_conf.maxmemory);
+    out_str(out, "evicted_keys", 12);
+    out_int(out, (int64_t)g_data.evicted_keys);
+    out_str(out, "compressed_bytes_in", 19);
+    out_int(out, (int64_t)g_data.compress_in);
+    out_str(out, "compressed_bytes_out", 20);
+    out_int(out, (int64_t)g_data.compress_out);
+    out_str(out, "compress_ratio", 14);
+    out_dbl(out, g_data.compress_out ? (double)g_data.compress_in / g_data.compress_out : 1.0);
+    out_str(out, "compress_skipped", 16);
+    out_int(out, (int64_t)g_data.compress_skipped);
+    out_str(out, "compress_usec", 13);
+    out_int(out, (int64_t)g_data.compress_us);
+    out_str(out, "decompress_usec", 15);
+    out_int(out, (int64_t)g_data.decompress_us);
+    out_str(out, "rdb_changes_since_last_save", 27);
+    out_int(out, (int64_t)g_save.dirty);
+    out_str(out, "rdb_bgsave_in_progress", 22);
+    out_int(out, g_save.child > 0);
+    out_str(out, "rdb_last_save_time", 18);
+    out_int(out, g_save.last_save_ms / 1000);
+    out_str(out, "rdb_last_bgsave_ok", 18);
+    out_int(out, g_save.last_bgsave_ok);
+    out_str(out, "latest_fork_usec", 16);
+    out_int(out, (int64_t)g_save.fork_us);
+    out_str(out, "aof_enabled", 11);
+    out_int(out, g_aof.fd >= 0);
+    out_str(out, "aof_current_size", 16);
+    out_int(out, (int64_t)g_aof.file_size);
+    out_str(out, "aof_pending_fsync_bytes", 23);
+    out_int(out, (int64_t)(g_aof.written - g_aof.synced.load()));
+    out_str(out, "aof_fsyncs", 10);
+    out_int(out, (int64_t)g_aof.fsyncs.load());
+    out_str(out, "aof_fsync_max_usec", 18);
+    out_int(out, (int64_t)g_aof.fsync_us_max.load());
+    out_str(out, "aof_last_fsync_ok", 17);
+    out_int(out, !g_aof.fsync_error.load());
+    out_str(out, "aof_fsync_errors", 16);
+    out_int(out, (int64_t)g_aof.fsync_errors.load());
+    out_str(out, "aof_rewrite_in_progress", 23);
+    out_int(out, g_rewrite.child > 0);
+    out_str(out, "aof_last_bgrewrite_ok", 21);
+    out_int(out, g_rewrite.last_ok);
+    out_str(out, "aof_base_size", 13);
+    out_int(out, (int64_t)g_rewrite.base_size);
+}
+
+// active defrag state
+static struct
+{
+    bool running = false;
+    uint64_t cursor = 0; // hm_scan() of the keyspace
+    uint64_t next_check_us = 0;
+    size_t frag_left = 0; // the fragmented bytes the last cycle left
+    // the last or the running cycle
+    double ratio_before = 0;
+    double ratio_after = 0;
+    size_t moved = 0; // entries moved to fuller spans
+    size_t compacted = 0; // zsets moved to fresh arenas
+    uint64_t start_us = 0;
+} g_defrag;
+
+// allocated / live bytes of what defrag can move: the slab spans against the
+// objects in them, and the zset arenas against their members
+static double frag_ratio(size_t *frag_bytes)
+{
+    std::vector<SlabClassStats> stats;
+    slab_stats(stats);
+    size_t slab_free = 0;
+    for (SlabClassStats &st : stats)
+    {
+        slab_free += st.spans * k_slab_span - st.size * st.in_use;
+    }
+    size_t live = g_data.used_memory - g_data.arena_slack;
+    *frag_bytes = slab_free + g_data.arena_slack;
+    return live ? (double)(live + *frag_bytes) / live : 1;
+}
+
+// memory stats: the slab allocator and active defrag, as name, value pairs;
+// `classes` is an array of [size, spans, objects in use] per size class
+static void do_memory_stats(Conn *, vector<string> &, Buffer &out)
+{
+    std::vector<SlabClassStats> stats;
+    slab_stats(stats);
+    size_t used = 0, spans = 0;
+    for (SlabClassStats &st : stats)
+    {
+        used += st.size * st.in_use;
+        spans += st.spans;
+    }
+    size_t frag_bytes = 0;
+    double ratio = frag_ratio(&frag_bytes);
+    out_arr(out, 24);
+    out_str(out, "slab_mapped_bytes", 17);
+    out_int(out, (int64_t)slab_mapped());
+    out_str(out, "slab_span_bytes", 15);
+    out_int(out, (int64_t)(spans * k_slab_span));
+    out_str(out, "slab_used_bytes", 15);
+    out_int(out, (int64_t)used);
+    out_str(out, "slab_purged_bytes", 17);
+    out_int(out, (int64_t)slab_purged());
+    out_str(out, "frag_ratio", 10);
+    out_dbl(out, ratio);
+    out_str(out, "frag_bytes", 10);
+    out_int(out, (int64_t)frag_bytes);
+    out_str(out, "defrag_running", 14);
+    out_int(out, g_defrag.running);
+    out_str(out, "defrag_ratio_before", 19);
+    out_dbl(out, g_defrag.ratio_before);
+    out_str(out, "defrag_ratio_after", 18);
+    out_dbl(out, g_defrag.ratio_after);
+    out_str(out, "defrag_moved", 12);
+    out_int(out, (int64_t)g_defrag.moved);
+    out_str(out, "defrag_compacted", 16);
+    out_int(out, (int64_t)g_defrag.compacted);
+    out_str(out, "classes", 7);
+    out_arr(out, (uint32_t)stats.size());
+    for (SlabClassStats &st : stats)
+    {
+        out_arr(out, 3);
+        out_int(out, (int64_t)st.size);
+        out_int(out, (int64_t)st.spans);
+        out_int(out, (int64_t)st.in_use);
+    }
+}
+
+// park the connection: no reply, no reads, and no idle timeout
+static void conn_block(Conn *conn, std::vector<std::string> &keys, bool max, uint64_t timeout_ms)
+{
+    conn->blocked = true;
+    conn->block_max = max;
+    for (std::string &key : keys)
+    {
+        std::deque<Conn *> &waiters = g_data.blocked[key];
+        if (std::find(waiters.begin(), waiters.end(), conn) == waiters.end())
+        {
+            waiters.push_back(conn);
+            conn->block_keys.push_back(std::move(key));
+        }
+    }
+    if (timeout_ms > 0)
+    {
+        HeapItem item = {get_monotonic_msec() + timeout_ms, &conn->block_heap_idx};
+        dheap_upsert(&g_data.block_heap, conn->block_heap_idx, item);
+    }
+    dlist_detach(&conn->idle_node);
+    dlist_init(&conn->idle_node);
+}
+
+static void conn_unblock(Conn *conn)
+{
+    for (const std::string &key : conn->block_keys)
+    {
+        auto it = g_data.blocked.find(key);
+        std::deque<Conn *> &waiters = it->second;
+        waiters.erase(std::find(waiters.begin(), waiters.end(), conn));
+        if (waiters.empty())
+        {
+            g_data.blocked.erase(it);
+        }
+    }
+    conn->block_keys.clear();
+    if (conn->wait_zset)
+    {
+        auto it = g_data.zset_waiters.find(conn->wait_zset);
+        std::vector<Conn *> &waiters = it->second;
+        waiters.erase(std::find(waiters.begin(), waiters.end(), conn));
+        if (waiters.empty())
+        {
+            g_data.zset_waiters.erase(it);
+        }
+        conn->wait_zset = NULL;
+    }
+    if (conn->block_heap_idx != (size_t)-1)
+    {
+        dheap_delete(&g_data.block_heap, conn->block_heap_idx);
+        conn->block_heap_idx = -1;
+    }
+    conn->blocked = false;
+    conn->last_active_ms = get_monotonic_msec();
+    dlist_detach(&conn->idle_node);
+    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+}
+
+// the key got members; serve its parked connections after this request
+static void key_ready(const std::string &key)
+{
+    if (g_data.blocked.count(key))
+    {
+        g_data.ready_keys.push_back(key);
+    }
+}
+
+// park a write to a zset that offloaded replies are reading; the request
+// stays in `incoming` and runs when the last of them is done
+static void conn_wait_zset(Conn *conn, ZSet *zset)
+{
+    std::vector<std::string> no_keys;
+    conn_block(conn, no_keys, false, 0);
+    conn->wait_zset = zset;
+    g_data.zset_waiters[zset].push_back(conn);
+}
+
+static void conn_resume(Conn *conn);
+static void serve_blocked();
+
+// the zset has no readers left: run the writes parked on it, oldest first
+static void zset_wake_writers(ZSet *zset)
+{
+    auto it = g_data.zset_waiters.find(zset);
+    if (it == g_data.zset_waiters.end())
+    {
+        return;
+    }
+    std::vector<Conn *> waiters = it->second;
+    for (Conn *conn : waiters)
+    {
+        conn_unblock(conn);
+        conn_resume(conn);
+    }
+}
+
+static void response_begin(Buffer &out, size_t *header);
+static void response_end(Buffer &out, size_t header);
+static void out_zrange(Buffer &out, ZSet *zset, int64_t rank, int64_t n, bool rev, bool withscores);
+
+static void reply_func(void *arg)
+{
+    ReplyJob *job = (ReplyJob *)arg;
+    size_t header_pos = 0;
+    response_begin(job->out, &header_pos);
+    if (job->zset)
+    {
+        zset_read_lock(job->zset);
+        out_zrange(job->out, job->zset, job->rank, job->n, job->rev, job->withscores);
+        zset_read_unlock(job->zset);
+    }
+    else
+    {
+        out_arr(job->out, (uint32_t)job->ents.size());
+        for (Entry *ent : job->ents)
+        {
+            out_str(job->out, ent->key.data(), ent->key.size());
+        }
+    }
+    response_end(job->out, header_pos);
+}
+
+// a thread pool job that read the zset is done
+static void zset_release(ZSet *zset)
+{
+    zset_unshare(zset);
+    if (zset->readers == 0)
+    {
+        zset_wake_writers(zset);
+    }
+}
+
+// a thread pool job that read keys is done; once there are none, free
+// what was put off
+static void reader_done()
+{
+    if (--g_data.reply_jobs > 0)
+    {
+        return;
+    }
+    std::vector<std::pair<Entry *, bool>> graveyard;
+    graveyard.swap(g_data.graveyard);
+    for (auto &[ent, unlink] : graveyard)
+    {
+        entry_del(ent, unlink);
+    }
+    std::vector<FlushJob *> flushes;
+    flushes.swap(g_data.deferred_flushes);
+    for (FlushJob *flush : flushes)
+    {
+        flush_run(flush);
+    }
+}
+
+// back on the loop: send the reply, then free what was put off
+static void reply_done(void *arg)
+{
+    ReplyJob *job = (ReplyJob *)arg;
+    if (Conn *conn = job->conn)
+    {
+        conn->reply_job = NULL;
+        conn_unblock(conn);
+        if (conn->outgoing.empty())
+        {
+            conn->outgoing.swap(job->out);
+        }
+        else
+        {
+            buf_append(conn->outgoing, job->out.data(), job->out.size());
+        }
+        conn->want_write = true;
+    }
+    if (job->zset)
+    {
+        zset_release(job->zset);
+    }
+    delete job;
+    reader_done();
+}
+
+// park the connection until the thread pool has built the reply
+static void reply_offload(Conn *conn, ReplyJob *job)
+{
+    std::vector<std::string> no_keys;
+    conn_block(conn, no_keys, false, 0);
+    conn->reply_job = job;
+    job->conn = conn;
+    g_data.reply_jobs++;
+    thread_pool_submit(&g_data.thread_pool, &reply_func, job, &reply_done);
+}
+
+static bool reply_is_big(size_t n)
+{
+    return g_conf.reply_offload_min > 0 && n > g_conf.reply_offload_min;
+}
+
+// set or remove the TTL
+static void entry_set_ttl(Entry *ent, int64_t ttl_ms)
+{
+    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1)
+    {
+        // setting a negative TTL means removing the TTL
+        dheap_delete(&g_data.heap, ent->heap_idx);
+        ent->heap_idx = -1;
+    }
+    else if (ttl_ms >= 0)
+    {
+        // add or update the heap data structure
+        uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
+        HeapItem item = {expire_at, &ent->heap_idx};
+        dheap_upsert(&g_data.heap, ent->heap_idx, item);
+    }
+}
+
+static bool str2int(const std::string &s, int64_t &out)
+{
+    char *endp = NULL;
+    out = strtoll(s.c_str(), &endp, 10);
+    return endp == s.c_str() + s.size();
+}
+
+// PEXPIRE key ttl_ms
+static void do_expire(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t ttl_ms = 0;
+    if (!str2int(cmd[2], ttl_ms))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect int64");
+    }
+    LookupKey key;
+    key.key = cmd[1]; // instead of swap(cmd[1])
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_lookup(&key.node);
+    if (node)
+    {
+        Entry *ent = container_of(node, Entry, node);
+        entry_set_ttl(ent, ttl_ms);
+    }
+    return out_int(out, node ? 1 : 0);
+}
+
+// PEXPIREAT key unix_ms; a time in the past expires the key at once, and a
+// negative one removes the TTL
+static void do_expireat(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t at = 0;
+    if (!str2int(cmd[2], at))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect int64");
+    }
+    int64_t now = get_realtime_msec();
+    if (at >= 0 && at <= now)
+    {
+        LookupKey key;
+        key.key = cmd[1];
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        Entry *ent = db_delete(&key.node, &entry_eq);
+        if (ent)
+        {
+            entry_del(ent);
+        }
+        return out_int(out, ent ? 1 : 0);
+    }
+    cmd[2] = std::to_string(at < 0 ? -1 : at - now);
+    return do_expire(conn, cmd, out);
+}
+
+// PTTL key
+static void do_ttl(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    LookupKey key;
+    key.key = cmd[1]; // instead of swap(cmd[1])
+
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_lookup(&key.node);
+    if (!node)
+    {
+        return out_int(out, -2); // not found
+    }
+
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->heap_idx == (size_t)-1)
+    {
+        return out_int(out, -1); // no TTL
+    }
+
+    uint64_t expire_at = g_data.heap.items[ent->heap_idx].val;
+    uint64_t now_ms = get_monotonic_msec();
+    return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
+}
+
+static bool cb_keys(HNode *node, void *arg)
+{
+    Buffer &out = *(Buffer *)arg;
+    const string &key = container_of(node, Entry, node)->key;
+    out_str(out, key.data(), key.size());
+    return true;
+}
+
+static bool cb_keys_collect(HNode *node, void *arg)
+{
+    ((std::vector<Entry *> *)arg)->push_back(container_of(node, Entry, node));
+    return true;
+}
+
+static void do_keys(Conn *conn, vector<string> &, Buffer &out)
+{
+    size_t n = hm_size(&g_data.db);
+    if (reply_is_big(n))
+    {
+        // only collect the entries here; the keys are copied out there
+        ReplyJob *job = new ReplyJob;
+        job->ents.reserve(n);
+        hm_foreach(&g_data.db, &cb_keys_collect, &job->ents);
+        return reply_offload(conn, job);
+    }
+    out_arr(out, (uint32_t)n);
+    hm_foreach(&g_data.db, &cb_keys, (void *)&out);
+}
+
+// glob-style matching: `*`, `?`, `[abc]`, `[^a-z]` and `\\` escapes
+static bool glob_match(const char *pat, const char *pend, const char *str, const char *send)
+{
+    const char *star_pat = NULL; // resume points for the last `*`
+    const char *star_str = NULL;
+    while (str < send)
+    {
+        bool ok = false;
+        const char *next = pat + 1;
+        if (pat < pend)
+        {
+            if (*pat == '*')
+            {
+                star_pat = ++pat;
+                star_str = str;
+                continue;
+            }
+            else if (*pat == '?')
+            {
+                ok = true;
+            }
+            else if (*pat == '[')
+            {
+                const char *p = pat + 1;
+                bool negate = p < pend && *p == '^';
+                p += negate;
+                bool hit = false;
+                while (p < pend && *p != ']')
+                {
+                    if (*p == '\\' && p + 1 < pend)
+                    {
+                        p++;
+                        hit |= (*p == *str);
+                        p++;
+                    }
+                    else if (p + 2 < pend && p[1] == '-' && p[2] != ']')
+                    {
+                        char lo = p[0], hi = p[2];
+                        if (lo > hi)
+                        {
+                            std::swap(lo, hi);
+                        }
+                        hit |= (lo <= *str && *str <= hi);
+                        p += 3;
+                    }
+                    else
+                    {
+                        hit |= (*p == *str);
+                        p++;
+                    }
+                }
+                ok = hit != negate;
+                next = p < pend ? p + 1 : p; // skip the `]`
+            }
+            else if (*pat == '\\' && pat + 1 < pend)
+            {
+                ok = pat[1] == *str;
+                next = pat + 2;
+            }
+            else
+            {
+                ok = *pat == *str;
+            }
+        }
+        if (ok)
+        {
+            pat = next;
+            str++;
+        }
+        else if (star_pat)
+        {
+            // backtrack: let the last `*` consume one more char
+            pat = star_pat;
+            str = ++star_str;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (pat < pend && *pat == '*')
+    {
+        pat++;
+    }
+    return pat == pend;
+}
+
+static bool glob_match(const std::string &pat, const std::string &s)
+{
+    return glob_match(pat.data(), pat.data() + pat.size(), s.data(), s.data() + s.size());
+}
+
+static const char *entry_type_name(uint32_t type)
+{
+    switch (type)
+    {
+    case T_STR:
+        return "string";
+    case T_ZSET:
+        return "zset";
+    default:
+        return "none";
+    }
+}
+
+static void cb_scan(HNode *node, void *arg)
+{
+    ((std::vector<Entry *> *)arg)->push_back(container_of(node, Entry, node));
+}
+
+// COUNT is a hint, and larger ones are clamped, which also keeps the
+// arithmetic on it from overflowing
+const int64_t k_scan_count_max = 1 << 20;
+
+// SCAN cursor [MATCH pattern] [COUNT n] [TYPE t]
+// replies [next_cursor, [keys...]]; the scan is complete when the cursor is 0.
+static void do_scan(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t cursor = 0;
+    if (!str2int(cmd[1], cursor))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    const std::string *pattern = NULL;
+    const std::string *type = NULL;
+    int64_t count = 10;
+    for (size_t i = 2; i < cmd.size(); i += 2)
+    {
+        if (i + 1 >= cmd.size())
+        {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+        if (strcasecmp(cmd[i].c_str(), "match") == 0)
+        {
+            pattern = &cmd[i + 1];
+        }
+        else if (strcasecmp(cmd[i].c_str(), "count") == 0)
+        {
+            if (!str2int(cmd[i + 1], count) || count <= 0)
+            {
+                return out_err(out, ERR_BAD_ARG, "expect positive int");
+            }
+            count = std::min(count, k_scan_count_max);
+        }
+        else if (strcasecmp(cmd[i].c_str(), "type") == 0)
+        {
+            type = &cmd[i + 1];
+        }
+        else
+        {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+    }
+
+    // visit slots until enough keys are collected; bound the empty slots too
+    std::vector<Entry *> found;
+    uint64_t next = (uint64_t)cursor;
+    int64_t nslots = 0;
+    do
+    {
+        next = hm_scan(&g_data.db, next, &cb_scan, &found);
+        nslots++;
+    } while (next != 0 && (int64_t)found.size() < count && nslots < count * 10);
+
+    out_arr(out, 2);
+    out_int(out, (int64_t)next);
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    for (Entry *ent : found)
+    {
+        if (pattern && !glob_match(*pattern, ent->key))
+        {
+            continue;
+        }
+        if (type && *type != entry_type_name(ent->type))
+        {
+            continue;
+        }
+        out_str(out, ent->key.data(), ent->key.size());
+        n++;
+    }
+    out_end_arr(out, ctx, n);
+}
+
+struct PrefixScan
+{
+    std::vector<const std::string *> keys;
+    size_t limit = 0;
+};
+
+static bool cb_scanprefix(const std::string &, void *val, void *arg)
+{
+    PrefixScan *scan = (PrefixScan *)arg;
+    scan->keys.push_back(&((Entry *)val)->key);
+    return scan->keys.size() < scan->limit;
+}
+
+// SCANPREFIX prefix [AFTER key] [COUNT n]
+// replies [last_key or nil, [keys...]] in key order; pass the last key as
+// AFTER to continue, nil means there is no more.
+static void do_scanprefix(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    if (!g_conf.key_index)
+    {
+        return out_err(out, ERR_DISABLED, "key index is off (config set key-index yes)");
+    }
+    std::string start;
+    int64_t count = 10;
+    for (size_t i = 2; i < cmd.size(); i += 2)
+    {
+        if (i + 1 >= cmd.size())
+        {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+        if (strcasecmp(cmd[i].c_str(), "after") == 0)
+        {
+            // the smallest key that is greater than `key`
+            start = cmd[i + 1];
+            start.push_back('\0');
+        }
+        else if (strcasecmp(cmd[i].c_str(), "count") == 0)
+        {
+            if (!str2int(cmd[i + 1], count) || count <= 0)
+            {
+                return out_err(out, ERR_BAD_ARG, "expect positive int");
+            }
+            count = std::min(count, k_scan_count_max);
+        }
+        else
+        {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+    }
+
+    // one extra key tells if there is more
+    PrefixScan scan;
+    scan.limit = (size_t)count + 1;
+    const std::string &prefix = cmd[1];
+    rax_walk(&g_data.index, (const uint8_t *)prefix.data(), prefix.size(),
+             (const uint8_t *)start.data(), start.size(), &cb_scanprefix, &scan);
+    bool more = scan.keys.size() > (size_t)count;
+    if (more)
+    {
+        scan.keys.pop_back();
+    }
+
+    out_arr(out, 2);
+    if (more)
+    {
+        const std::string &last = *scan.keys.back();
+        out_str(out, last.data(), last.size());
+    }
+    else
+    {
+        out_nil(out);
+    }
+    out_arr(out, (uint32_t)scan.keys.size());
+    for (const std::string *key : scan.keys)
+    {
+        out_str(out, key->data(), key->size());
+    }
+}
+
+static bool str2dbl(const std::string &s, double &out)
+{
+    char *endp = NULL;
+    out = strtod(s.c_str(), &endp);
+    return endp == s.c_str() + s.size() && !isnan(out);
+}
+
+// ZADD flags
+enum
+{
+    ZADD_NX = 1 << 0,   // only add new members
+    ZADD_XX = 1 << 1,   // only update existing members
+    ZADD_GT = 1 << 2,   // only update to a greater score
+    ZADD_LT = 1 << 3,   // only update to a lower score
+    ZADD_CH = 1 << 4,   // reply the number of added + updated members
+    ZADD_INCR = 1 << 5, // add to the score, reply the new score
+};
+
+static uint32_t zadd_flag(const std::string &s)
+{
+    static const struct
+    {
+        const char *name;
+        uint32_t flag;
+    } k_flags[] = {
+        {"nx", ZADD_NX}, {"xx", ZADD_XX}, {"gt", ZADD_GT},
+        {"lt", ZADD_LT}, {"ch", ZADD_CH}, {"incr", ZADD_INCR},
+    };
+    for (auto &f : k_flags)
+    {
+        if (strcasecmp(s.c_str(), f.name) == 0)
+        {
+            return f.flag;
+        }
+    }
+    return 0;
+}
+
+// whether the flags allow setting the score
+static bool zadd_allowed(uint32_t flags, bool exists, double cur, double score)
+{
+    if (!exists)
+    {
+        return !(flags & ZADD_XX);
+    }
+    if (flags & ZADD_NX)
+    {
+        return false;
+    }
+    if ((flags & ZADD_GT) && !(score > cur))
+    {
+        return false;
+    }
+    if ((flags & ZADD_LT) && !(score < cur))
+    {
+        return false;
+    }
+    return true;
+}
+
+// zadd zset [nx|xx] [gt|lt] [ch] [incr] score name [score name ...]
+static void do_zadd(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    uint32_t flags = 0;
+    size_t i = 2;
+    for (uint32_t f; i < cmd.size() && (f = zadd_flag(cmd[i])); i++)
+    {
+        flags |= f;
+    }
+    size_t npairs = (cmd.size() - i) / 2;
+    if (npairs == 0 || (cmd.size() - i) % 2 != 0)
+    {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    if (((flags & ZADD_NX) && (flags & (ZADD_XX | ZADD_GT | ZADD_LT))) ||
+        ((flags & ZADD_GT) && (flags & ZADD_LT)) ||
+        ((flags & ZADD_INCR) && npairs != 1))
+    {
+        return out_err(out, ERR_BAD_ARG, "incompatible flags");
+    }
+    // parse all scores before touching the data
+    std::vector<double> scores(npairs);
+    for (size_t k = 0; k < npairs; k++)
+    {
+        if (!str2dbl(cmd[i + 2 * k], scores[k]))
+        {
+            return out_err(out, ERR_BAD_ARG, "expect float");
+        }
+    }
+
+    // look up or create the zset
+    LookupKey key;
+    key.key = cmd[1]; // instead of swap(cmd[1])
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key.node);
+
+    Entry *ent = NULL;
+    if (!hnode)
+    { // insert a new key
+        if (flags & ZADD_XX)
+        {
+            return (flags & ZADD_INCR) ? out_nil(out) : out_int(out, 0);
+        }
+        ent = entry_new(T_ZSET);
+        zset_init(&ent->zset, g_conf.zset_backend);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        db_insert(ent);
+    }
+    else
+    { // check the existing key
+        ent = container_of(hnode, Entry, node);
+        if (ent->type != T_ZSET)
+        {
+            return out_err(out, ERR_BAD_TYP, "expect zset");
+        }
+    }
+    ZSet *zset = &ent->zset;
+
+    if (flags & ZADD_INCR)
+    {
+        const std::string &name = cmd[i + 1];
+        ZNode *znode = zset_lookup(zset, name.data(), name.size());
+        double score = znode ? znode->score + scores[0] : scores[0];
+        if (isnan(score))
+        {
+            return out_err(out, ERR_BAD_ARG, "resulting score is not a number");
+        }
+        if (!zadd_allowed(flags, znode != NULL, znode ? znode->score : 0, score))
+        {
+            return out_nil(out);
+        }
+        zset_insert(zset, name.data(), name.size(), score);
+        entry_account(ent);
+        key_ready(ent->key);
+        return out_dbl(out, score);
+    }
+
+    // update existing members in place; collect the new ones for a bulk add
+    int64_t added = 0, updated = 0;
+    std::vector<ZAddItem> adds;
+    std::unordered_map<std::string_view, size_t> pending; // name -> adds[idx]
+    for (size_t k = 0; k < npairs; k++)
+    {
+        const std::string &name = cmd[i + 2 * k + 1];
+        double score = scores[k];
+        auto it = pending.find(name);
+        if (it != pending.end())
+        {
+            // repeated in this command: acts on the pending member
+            ZAddItem &item = adds[it->second];
+            if (zadd_allowed(flags, true, item.score, score) && item.score != score)
+            {
+                item.score = score;
+                updated++;
+            }
+            continue;
+        }
+        ZNode *znode = zset_lookup(zset, name.data(), name.size());
+        if (!zadd_allowed(flags, znode != NULL, znode ? znode->score : 0, score))
+        {
+            continue;
+        }
+        if (znode)
+        {
+            if (znode->score != score)
+            {
+                zset_insert(zset, name.data(), name.size(), score);
+                updated++;
+            }
+            continue;
+        }
+        pending[name] = adds.size();
+        adds.push_back(ZAddItem{score, name.data(), name.size()});
+        added++;
+    }
+    zset_add_bulk(zset, adds.data(), adds.size());
+    entry_account(ent);
+    key_ready(ent->key);
+    return out_int(out, (flags & ZADD_CH) ? added + updated : added);
+}
+
+static const ZSet k_empty_zset;
+
+static ZSet *expect_zset(std::string &s)
+{
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key.node);
+    if (!hnode)
+    { // a non-existent key is treated as an empty zset
+        return (ZSet *)&k_empty_zset;
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    return ent->type == T_ZSET ? &ent->zset : NULL;
+}
+
+// update the accounting after changing a zset from expect_zset()
+static void zset_account(ZSet *zset)
+{
+    if (zset != &k_empty_zset)
+    {
+        entry_account(container_of(zset, Entry, zset));
+    }
+}
+
+// zrem zset name
+static void do_zrem(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    const std::string &name = cmd[2];
+    ZNode *znode = zset_lookup(zset, name.data(), name.size());
+    if (znode)
+    {
+        zset_delete(zset, znode);
+        zset_account(zset);
+    }
+    return out_int(out, znode ? 1 : 0);
+}
+
+// zscore zset name
+static void do_zscore(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    const std::string &name = cmd[2];
+    ZNode *znode = zset_lookup(zset, name.data(), name.size());
+    return znode ? out_dbl(out, znode->score) : out_nil(out);
+}
+
+// zquery zset score name offset limit
+static void reply_zrange(Conn *conn, Buffer &out, ZSet *zset, int64_t rank, int64_t n, bool rev, bool withscores);
+
+static void do_zquery(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+{
+    // parse args
+    double score = 0;
+    if (!str2dbl(cmd[2], score))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect fp number");
+    }
+    const std::string &name = cmd[3];
+    int64_t offset = 0, limit = 0;
+    if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+
+    // get the zset
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    // seek to the key
+    if (limit <= 0)
+    {
+        return out_arr(out, 0);
+    }
+    ZNode *znode = zset_seekge(zset, score, name.data(), name.size());
+    znode = znode_offset(zset, znode, offset);
+    if (!znode)
+    {
+        return out_arr(out, 0);
+    }
+
+    // output: name, score pairs, up to `limit` elements in all
+    return reply_zrange(conn, out, zset, zset_rank(zset, znode), (limit + 1) / 2, false, true);
+}
+
+// zcard zset
+static void do_zcard(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    return out_int(out, (int64_t)zset_size(zset));
+}
+
+// zrank zset name | zrevrank zset name
+static void do_zrank(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    bool rev = cmd[0] == "zrevrank";
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    const std::string &name = cmd[2];
+    ZNode *znode = zset_lookup(zset, name.data(), name.size());
+    if (!znode)
+    {
+        return out_nil(out);
+    }
+    int64_t rank = zset_rank(zset, znode);
+    return out_int(out, rev ? (int64_t)zset_size(zset) - 1 - rank : rank);
+}
+
+// output `n` members from `rank` onwards (backwards if `rev`)
+static void out_zrange(Buffer &out, ZSet *zset, int64_t rank, int64_t n, bool rev, bool withscores)
+{
+    ZIter iter;
+    ziter_init(&iter, zset, n > 0 ? zset_at(zset, rank) : NULL);
+    size_t ctx = out_begin_arr(out);
+    uint32_t count = 0;
+    for (int64_t i = 0; iter.node && i < n; i++)
+    {
+        out_str(out, iter.node->name, iter.node->len);
+        count++;
+        if (withscores)
+        {
+            out_dbl(out, iter.node->score);
+            count++;
+        }
+        rev ? ziter_prev(&iter) : ziter_next(&iter);
+    }
+    out_end_arr(out, ctx, count);
+}
+
+// small ranges are written here, big ones on the thread pool
+static void reply_zrange(Conn *conn, Buffer &out, ZSet *zset, int64_t rank, int64_t n, bool rev, bool withscores)
+{
+    if (n <= 0 || !reply_is_big(std::min<size_t>((size_t)n, zset_size(zset))))
+    {
+        return out_zrange(out, zset, rank, n, rev, withscores);
+    }
+    // writes to the zset are parked until the reply is done
+    zset_share(zset);
+    ReplyJob *job = new ReplyJob;
+    job->zset = zset;
+    job->rank = rank;
+    job->n = n;
+    job->rev = rev;
+    job->withscores = withscores;
+    return reply_offload(conn, job);
+}
+
+static bool parse_withscores(std::vector<std::string> &cmd, size_t i, bool &withscores)
+{
+    withscores = false;
+    if (i == cmd.size())
+    {
+        return true;
+    }
+    withscores = strcasecmp(cmd[i].c_str(), "withscores") == 0;
+    return withscores && i + 1 == cmd.size();
+}
+
+// zrange zset start stop [withscores] | zrevrange zset start stop [withscores]
+// negative indexes count from the end
+static void do_zrange(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+{
+    bool rev = cmd[0] == "zrevrange";
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    bool withscores = false;
+    if (!parse_withscores(cmd, 4, withscores))
+    {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    int64_t size = (int64_t)zset_size(zset);
+    start = start < 0 ? std::max<int64_t>(start + size, 0) : start;
+    stop = stop < 0 ? stop + size : std::min(stop, size - 1);
+    int64_t n = stop - start + 1;
+    // ranks of the reverse order map to `size - 1 - rank`
+    return reply_zrange(conn, out, zset, rev ? size - 1 - start : start, n, rev, withscores);
+}
+
+// a score bound: a number, or `(number` for an exclusive bound
+static bool parse_score_bound(const std::string &s, double &score, bool &excl)
+{
+    excl = !s.empty() && s[0] == '(';
+    return str2dbl(s.substr(excl ? 1 : 0), score);
+}
+
+// the rank of the first member whose score is >= score (> if `strict`)
+static int64_t zset_rank_score(ZSet *zset, double score, bool strict)
+{
+    if (strict)
+    {
+        if (score == INFINITY)
+        {
+            return (int64_t)zset_size(zset);
+        }
+        score = nextafter(score, INFINITY);
+    }
+    // the empty name is the smallest name of the score
+    ZNode *znode = zset_seekge(zset, score, "", 0);
+    return znode ? zset_rank(zset, znode) : (int64_t)zset_size(zset);
+}
+
+// the rank range [begin, end) of the scores within [min, max]
+static bool parse_score_range(
+    ZSet *zset, const std::string &min, const std::string &max, int64_t &begin, int64_t &end)
+{
+    double lo = 0, hi = 0;
+    bool lo_excl = false, hi_excl = false;
+    if (!parse_score_bound(min, lo, lo_excl) || !parse_score_bound(max, hi, hi_excl))
+    {
+        return false;
+    }
+    begin = zset_rank_score(zset, lo, lo_excl);
+    end = std::max(begin, zset_rank_score(zset, hi, !hi_excl));
+    return true;
+}
+
+// zcount zset min max, in O(log n) by rank subtraction
+static void do_zcount(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    int64_t begin = 0, end = 0;
+    if (!parse_score_range(zset, cmd[2], cmd[3], begin, end))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect float");
+    }
+    return out_int(out, end - begin);
+}
+
+// zrangebyscore zset min max [withscores] [limit offset count]
+static void do_zrangebyscore(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+{
+    bool withscores = false;
+    int64_t offset = 0, count = -1;
+    for (size_t i = 4; i < cmd.size(); i++)
+    {
+        if (strcasecmp(cmd[i].c_str(), "withscores") == 0)
+        {
+            withscores = true;
+        }
+        else if (strcasecmp(cmd[i].c_str(), "limit") == 0 && i + 2 < cmd.size())
+        {
+            if (!str2int(cmd[i + 1], offset) || !str2int(cmd[i + 2], count) || offset < 0)
+            {
+                return out_err(out, ERR_BAD_ARG, "expect int");
+            }
+            i += 2;
+        }
+        else
+        {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    int64_t begin = 0, end = 0;
+    if (!parse_score_range(zset, cmd[2], cmd[3], begin, end))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect float");
+    }
+    begin = std::min(begin + offset, end);
+    int64_t n = end - begin;
+    if (count >= 0)
+    {
+        n = std::min(n, count);
+    }
+    return reply_zrange(conn, out, zset, begin, n, false, withscores);
+}
+
+// a lex bound: `[name` or `(name` for an exclusive bound; `-` and `+` are
+// the ends. lex ranges assume all members have the same score.
+static bool parse_lex_bound(const std::string &s, int &inf, bool &excl, std::string &name)
+{
+    inf = 0;
+    excl = false;
+    if (s == "-" || s == "+")
+    {
+        inf = s == "-" ? -1 : 1;
+        return true;
+    }
+    if (s.empty() || (s[0] != '[' && s[0] != '('))
+    {
+        return false;
+    }
+    excl = s[0] == '(';
+    name = s.substr(1);
+    return true;
+}
+
+// the rank of the first member whose name is >= name (> if `strict`)
+static int64_t zset_rank_lex(ZSet *zset, int inf, const std::string &name, bool strict)
+{
+    int64_t size = (int64_t)zset_size(zset);
+    if (inf != 0 || size == 0)
+    {
+        return inf < 0 ? 0 : size;
+    }
+    double score = zset_at(zset, 0)->score;
+    ZNode *znode = zset_seekge(zset, score, name.data(), name.size());
+    if (!znode)
+    {
+        return size;
+    }
+    int64_t rank = zset_rank(zset, znode);
+    if (strict && znode->score == score && znode->len == name.size() &&
+        memcmp(znode->name, name.data(), name.size()) == 0)
+    {
+        rank++;
+    }
+    return rank;
+}
+
+// the rank range [begin, end) of the names within [min, max]
+static bool parse_lex_range(
+    ZSet *zset, const std::string &min, const std::string &max, int64_t &begin, int64_t &end)
+{
+    int lo_inf = 0, hi_inf = 0;
+    bool lo_excl = false, hi_excl = false;
+    std::string lo, hi;
+    if (!parse_lex_bound(min, lo_inf, lo_excl, lo) || !parse_lex_bound(max, hi_inf, hi_excl, hi))
+    {
+        return false;
+    }
+    begin = zset_rank_lex(zset, lo_inf, lo, lo_excl);
+    end = std::max(begin, zset_rank_lex(zset, hi_inf, hi, !hi_excl));
+    return true;
+}
+
+// zlexcount zset min max, in O(log n) by rank subtraction
+static void do_zlexcount(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    int64_t begin = 0, end = 0;
+    if (!parse_lex_range(zset, cmd[2], cmd[3], begin, end))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect lex range");
+    }
+    return out_int(out, end - begin);
+}
+
+// zrangebylex zset min max [limit offset count]
+// zrevrangebylex zset max min [limit offset count]
+static void do_zrangebylex(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+{
+    bool rev = cmd[0] == "zrevrangebylex";
+    int64_t offset = 0, count = -1;
+    if (cmd.size() == 7 && strcasecmp(cmd[4].c_str(), "limit") == 0)
+    {
+        if (!str2int(cmd[5], offset) || !str2int(cmd[6], count) || offset < 0)
+        {
+            return out_err(out, ERR_BAD_ARG, "expect int");
+        }
+    }
+    else if (cmd.size() != 4)
+    {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    int64_t begin = 0, end = 0;
+    if (!parse_lex_range(zset, cmd[rev ? 3 : 2], cmd[rev ? 2 : 3], begin, end))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect lex range");
+    }
+    int64_t n = std::max<int64_t>(end - begin - offset, 0);
+    if (count >= 0)
+    {
+        n = std::min(n, count);
+    }
+    int64_t rank = rev ? end - 1 - offset : begin + offset;
+    return reply_zrange(conn, out, zset, rank, n, rev, false);
+}
+
+// zremrangebylex zset min max
+static void do_zremrangebylex(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    int64_t begin = 0, end = 0;
+    if (!parse_lex_range(zset, cmd[2], cmd[3], begin, end))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect lex range");
+    }
+    size_t n = zset_remove_range(zset, begin, end);
+    zset_account(zset);
+    return out_int(out, (int64_t)n);
+}
+
+// zremrangebyscore zset min max
+static void do_zremrangebyscore(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    int64_t begin = 0, end = 0;
+    if (!parse_score_range(zset, cmd[2], cmd[3], begin, end))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect float");
+    }
+    size_t n = zset_remove_range(zset, begin, end);
+    zset_account(zset);
+    return out_int(out, (int64_t)n);
+}
+
+// zremrangebyrank zset start stop; negative indexes count from the end
+static void do_zremrangebyrank(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    int64_t size = (int64_t)zset_size(zset);
+    start = start < 0 ? start + size : start;
+    stop = stop < 0 ? stop + size : stop;
+    size_t n = zset_remove_range(zset, start, stop + 1);
+    zset_account(zset);
+    return out_int(out, (int64_t)n);
+}
+
+// remove the lowest (or highest) member and output it as name, score
+static void out_zpop(Buffer &out, ZSet *zset, bool max)
+{
+    ZNode *znode = max ? zset_last(zset) : zset_first(zset);
+    out_str(out, znode->name, znode->len);
+    out_dbl(out, znode->score);
+    zset_delete(zset, znode);
+    zset_account(zset);
+}
+
+// zpopmin zset [count] | zpopmax zset [count]
+static void do_zpop(Conn *, std::vector<std::string> &cmd, Buffer &out)
+{
+    bool max = cmd[0] == "zpopmax";
+    int64_t count = 1;
+    if (cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    count = std::min(count, (int64_t)zset_size(zset));
+    out_arr(out, (uint32_t)(2 * count));
+    for (int64_t i = 0; i < count; i++)
+    {
+        out_zpop(out, zset, max);
+    }
+}
+
+static void out_bzpop(Buffer &out, const std::string &key, ZSet *zset, bool max)
+{
+    out_arr(out, 3);
+    out_str(out, key.data(), key.size());
+    out_zpop(out, zset, max);
+}
+
+// bzpopmin key [key ...] timeout | bzpopmax key [key ...] timeout
+// pops from the first non-empty zset as key, name, score. otherwise the
+// connection is parked until a ZADD to one of the keys, or replies nil after
+// `timeout` seconds (0: no timeout).
+static void do_bzpop(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+{
+    bool max = cmd[0] == "bzpopmax";
+    double timeout = 0;
+    if (!str2dbl(cmd.back(), timeout) || !(timeout >= 0))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect timeout");
+    }
+    std::vector<std::string> keys(cmd.begin() + 1, cmd.end() - 1);
+    for (const std::string &key : keys)
+    {
+        std::string tmp = key;
+        ZSet *zset = expect_zset(tmp);
+        if (!zset)
+        {
+            return out_err(out, ERR_BAD_TYP, "expect zset");
+        }
+        if (zset_size(zset) > 0)
+        {
+            aof_log(conn, {max ? "zpopmax" : "zpopmin", key});
+            return out_bzpop(out, key, zset, max);
+        }
+    }
+    conn_block(conn, keys, max, (uint64_t)ceil(timeout * 1000));
+}
+
+enum
+{
+    ZSTORE_UNION = 0,
+    ZSTORE_INTER = 1,
+    ZSTORE_DIFF = 2,
+};
+
+enum
+{
+    ZAGG_SUM = 0,
+    ZAGG_MIN = 1,
+    ZAGG_MAX = 2,
+};
+
+struct ZStoreInput
+{
+    ZSet *zset = NULL;
+    double weight = 1;
+};
+
+// one slice of a zunionstore/zinterstore/zdiffstore: iterate a rank range
+// of one input and probe the others. Jobs on the thread pool only read the
+// inputs, which are shared meanwhile, so the hashtables are probed without
+// migration.
+struct ZStoreJob
+{
+    uint32_t op = ZSTORE_UNION;
+    uint32_t agg = ZAGG_SUM;
+    const std::vector<ZStoreInput> *inputs = NULL;
+    struct ZStoreOp *owner = NULL; // if on the thread pool
+    size_t drive = 0;           // the input being iterated
+    int64_t begin = 0, end = 0; // its rank range
+    std::vector<ZAddItem> out;  // the names point into the inputs
+};
+
+static double zstore_weigh(double score, double weight)
+{
+    double r = score * weight;
+    return isnan(r) ? 0 : r; // inf * 0
+}
+
+static double zstore_aggregate(uint32_t agg, double a, double b)
+{
+    switch (agg)
+    {
+    case ZAGG_MIN:
+        return std::min(a, b);
+    case ZAGG_MAX:
+        return std::max(a, b);
+    default:
+        double r = a + b;
+        return isnan(r) ? 0 : r; // inf + -inf
+    }
+}
+
+// take or drop the read locks of the inputs, once per zset
+static void zstore_lock(const std::vector<ZStoreInput> &in, bool lock)
+{
+    for (size_t i = 0; i < in.size(); i++)
+    {
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; j++)
+        {
+            seen = in[j].zset == in[i].zset;
+        }
+        if (!seen && lock)
+        {
+            zset_read_lock(in[i].zset);
+        }
+        else if (!seen)
+        {
+            zset_read_unlock(in[i].zset);
+        }
+    }
+}
+
+static void zstore_work(void *arg)
+{
+    ZStoreJob *job = (ZStoreJob *)arg;
+    const std::vector<ZStoreInput> &in = *job->inputs;
+    zstore_lock(in, true);
+    ZSet *zset = in[job->drive].zset;
+    ZIter iter;
+    ziter_init(&iter, zset, zset_at(zset, job->begin));
+    for (int64_t r = job->begin; r < job->end && iter.node; r++, ziter_next(&iter))
+    {
+        ZNode *node = iter.node;
+        double score = zstore_weigh(node->score, in[job->drive].weight);
+        bool keep = true;
+        for (size_t j = 0; j < in.size() && keep; j++)
+        {
+            if (j == job->drive)
+            {
+                continue;
+            }
+            ZNode *other = zset_find(in[j].zset, node->name, node->len);
+            if (job->op == ZSTORE_DIFF)
+            {
+                keep = !other;
+            }
+            else if (!other)
+            {
+                keep = job->op == ZSTORE_UNION;
+            }
+            else if (job->op == ZSTORE_UNION && j < job->drive)
+            {
+                keep = false; // emitted while iterating the earlier input
+            }
+            else
+            {
+                score = zstore_aggregate(job->agg, score, zstore_weigh(other->score, in[j].weight));
+            }
+        }
+        if (keep)
+        {
+            job->out.push_back(ZAddItem{score, node->name, node->len});
+        }
+    }
+    zstore_lock(in, false);
+}
+
+// split the iteration into jobs; true if the inputs are large enough to
+// spread them over the thread pool
+static bool zstore_split(std::vector<ZStoreJob> &jobs, const ZStoreJob &proto, size_t ndrive)
+{
+    const std::vector<ZStoreInput> &in = *proto.inputs;
+    const int64_t k_chunk = 16384;
+    int64_t total = 0;
+    for (size_t i = 0; i < ndrive; i++)
+    {
+        total += (int64_t)zset_size(in[i].zset);
+    }
+    const int64_t k_parallel_min = 65536;
+    bool parallel = total >= k_parallel_min;
+    for (size_t i = 0; i < ndrive; i++)
+    {
+        int64_t size = (int64_t)zset_size(in[i].zset);
+        int64_t step = parallel ? k_chunk : std::max(size, (int64_t)1);
+        for (int64_t begin = 0; begin < size; begin += step)
+        {
+            ZStoreJob job = proto;
+            job.drive = i;
+            job.begin = begin;
+            job.end = std::min(begin + step, size);
+            jobs.push_back(std::move(job));
+        }
+    }
+    return parallel;
+}
+
+// add the results of the jobs to `ent`; returns its size
+static size_t zstore_build(Entry *ent, std::vector<ZStoreJob> &jobs)
+{
+    std::vector<ZAddItem> items;
+    for (ZStoreJob &job : jobs)
+    {
+        items.insert(items.end(), job.out.begin(), job.out.end());
+    }
+    zset_add_bulk(&ent->zset, items.data(), items.size());
+    return items.size();
+}
+
+// replace the destination with the built result
+static void zstore_put(const std::string &dst, Entry *ent, size_t n)
+{
+    LookupKey key;
+    key.key = dst;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    Entry *old = db_delete(&key.node, &entry_eq);
+    if (old)
+    {
+        entry_del(old);
+    }
+    if (n == 0)
+    {
+        entry_del(ent); // an empty result deletes the destination
+        return;
+    }
+    ent->key.swap(key.key);
+    ent->node.hcode = key.node.hcode;
+    db_insert(ent);
+    key_ready(ent->key);
+}
+
+static Entry *zstore_result()
+{
+    Entry *ent = entry_new(T_ZSET);
+    zset_init(&ent->zset, g_conf.zset_backend);
+    return ent;
+}
+
+// a zset store whose jobs run on the thread pool. The connection is parked
+// and the inputs are shared until the result is built, also on the pool, so
+// writes to them wait; then it is stored, logged and replied to on the loop.
+struct ZStoreOp
+{
+    Conn *conn = NULL; // NULL once the connection is gone
+    std::vector<std::string> cmd; // as received
+    std::vector<ZSet *> zsets; // the inputs as looked up, in argument order
+    std::vector<ZStoreInput> in;
+    std::vector<ZStoreJob> jobs;
+    size_t pending = 0; // jobs not done yet
+    Entry *result = NULL; // not in the db yet
+    size_t size = 0;
+};
+
+static void zstore_detach(ZStoreOp *op)
+{
+    op->conn = NULL; // the result is still stored
+}
+
+// whether each input key still holds the zset the jobs read
+static bool zstore_inputs_same(ZStoreOp *op)
+{
+    for (size_t k = 0; k < op->zsets.size(); k++)
+    {
+        std::string name = op->cmd[3 + k];
+        if (expect_zset(name) != op->zsets[k])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void zstore_build_work(void *arg)
+{
+    ZStoreOp *op = (ZStoreOp *)arg;
+    zstore_lock(op->in, true); // the items point into the inputs
+    op->size = zstore_build(op->result, op->jobs);
+    zstore_lock(op->in, false);
+    std::vector<ZStoreJob>().swap(op->jobs);
+}
+
+static void zstore_built(void *arg)
+{
+    ZStoreOp *op = (ZStoreOp *)arg;
+    Conn *conn = op->conn;
+    if (conn)
+    {
+        conn->zstore_op = NULL;
+        conn_unblock(conn);
+    }
+    // writes to the inputs were parked, but a key may have been deleted or
+    // replaced. the result would then not be what replaying the log makes,
+    // so the command runs again, or is dropped with its connection.
+    bool same = zstore_inputs_same(op);
+    if (same)
+    {
+        zstore_put(op->cmd[1], op->result, op->size);
+        aof_log(conn, op->cmd);
+        if (conn)
+        {
+            size_t header_pos = 0;
+            response_begin(conn->outgoing, &header_pos);
+            out_int(conn->outgoing, (int64_t)op->size);
+            response_end(conn->outgoing, header_pos);
+            conn->want_read = false;
+            conn->want_write = true;
+        }
+    }
+    else
+    {
+        entry_del(op->result);
+        if (conn)
+        {
+            Buffer req;
+            req_encode(req, op->cmd);
+            conn->incoming.insert(conn->incoming.begin(), req.begin(), req.end());
+        }
+    }
+    for (ZSet *zset : op->zsets)
+    {
+        if (zset != &k_empty_zset)
+        {
+            zset_release(zset);
+        }
+    }
+    delete op;
+    if (!same && conn)
+    {
+        conn_resume(conn);
+    }
+    serve_blocked();
+    reader_done();
+}
+
+// the last job builds the result on the pool, off the loop
+static void zstore_job_done(void *arg)
+{
+    ZStoreOp *op = ((ZStoreJob *)arg)->owner;
+    if (--op->pending == 0)
+    {
+        thread_pool_submit(&g_data.thread_pool, &zstore_build_work, op, &zstore_built);
+    }
+}
+
+// park the connection and run the jobs on the thread pool
+static void zstore_offload(
+    Conn *conn, std::vector<std::string> &cmd, std::vector<ZStoreInput> &in,
+    std::vector<ZStoreJob> &jobs)
+{
+    ZStoreOp *op = new ZStoreOp;
+    op->cmd = cmd;
+    for (size_t k = 0; k < in.size(); k++)
+    {
+        std::string name = cmd[3 + k];
+        ZSet *zset = expect_zset(name);
+        op->zsets.push_back(zset);
+        if (zset != &k_empty_zset)
+        {
+            zset_share(zset);
+        }
+    }
+    op->in.swap(in);
+    op->jobs.swap(jobs);
+    op->pending = op->jobs.size();
+    op->result = zstore_result();
+    std::vector<std::string> no_keys;
+    conn_block(conn, no_keys, false, 0);
+    conn->zstore_op = op;
+    op->conn = conn;
+    g_data.reply_jobs++;
+    for (ZStoreJob &job : op->jobs)
+    {
+        job.inputs = &op->in;
+        job.owner = op;
+        thread_pool_submit(&g_data.thread_pool, &zstore_work, &job, &zstore_job_done);
+    }
+}
+
+// zunionstore dst numkeys key [key ...] [weights w [w ...]] [aggregate sum|min|max]
+// zinterstore dst numkeys key [key ...] [weights w [w ...]] [aggregate sum|min|max]
+// zdiffstore dst numkeys key [key ...]
+static void do_zstore(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+{
+    ZStoreJob proto;
+    proto.op = cmd[0] == "zunionstore" ? ZSTORE_UNION
+        : cmd[0] == "zinterstore" ? ZSTORE_INTER : ZSTORE_DIFF;
+    int64_t numkeys = 0;
+    if (!str2int(cmd[2], numkeys))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    if (numkeys < 1 || numkeys > (int64_t)cmd.size() - 3)
+    {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    std::vector<ZStoreInput> in(numkeys);
+    for (size_t i = 3 + numkeys; i < cmd.size(); i++)
+    {
+        if (proto.op == ZSTORE_DIFF)
+        {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+        if (strcasecmp(cmd[i].c_str(), "weights") == 0 && i + numkeys < cmd.size())
+        {
+            for (int64_t k = 0; k < numkeys; k++)
+            {
+                if (!str2dbl(cmd[++i], in[k].weight))
+                {
+                    return out_err(out, ERR_BAD_ARG, "expect float");
+                }
+            }
+        }
+        else if (strcasecmp(cmd[i].c_str(), "aggregate") == 0 && i + 1 < cmd.size())
+        {
+            const char *agg = cmd[++i].c_str();
+            if (strcasecmp(agg, "sum") == 0)
+            {
+                proto.agg = ZAGG_SUM;
+            }
+            else if (strcasecmp(agg, "min") == 0)
+            {
+                proto.agg = ZAGG_MIN;
+            }
+            else if (strcasecmp(agg, "max") == 0)
+            {
+                proto.agg = ZAGG_MAX;
+            }
+            else
+            {
+                return out_err(out, ERR_BAD_ARG, "syntax error");
+            }
+        }
+        else
+        {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+    }
+    for (int64_t k = 0; k < numkeys; k++)
+    {
+        std::string name = cmd[3 + k]; // kept for the log
+        in[k].zset = expect_zset(name);
+        if (!in[k].zset)
+        {
+            return out_err(out, ERR_BAD_TYP, "expect zset");
+        }
+    }
+
+    // iterate the smaller inputs and probe the larger ones
+    size_t ndrive = 1; // the first input for zdiffstore
+    if (proto.op != ZSTORE_DIFF)
+    {
+        std::stable_sort(in.begin(), in.end(), [](const ZStoreInput &a, const ZStoreInput &b) {
+            return zset_size(a.zset) < zset_size(b.zset);
+        });
+        ndrive = proto.op == ZSTORE_UNION ? in.size() : 1;
+    }
+    proto.inputs = &in;
+    std::vector<ZStoreJob> jobs;
+    bool parallel = zstore_split(jobs, proto, ndrive);
+    if (parallel && conn->fd >= 0)
+    {
+        return zstore_offload(conn, cmd, in, jobs);
+    }
+    if (parallel)
+    {
+        // replaying the log: nothing else to serve, so wait for the pool
+        std::vector<void *> args;
+        for (ZStoreJob &job : jobs)
+        {
+            args.push_back(&job);
+        }
+        thread_pool_run(&g_data.thread_pool, &zstore_work, args.data(), args.size());
+    }
+    else
+    {
+        for (ZStoreJob &job : jobs)
+        {
+            zstore_work(&job); // small; avoid context switches
+        }
+    }
+    Entry *ent = zstore_result();
+    size_t n = zstore_build(ent, jobs);
+    zstore_put(cmd[1], ent, n);
+    return out_int(out, (int64_t)n);
+}
+
+static bool str2bool(const std::string &s, bool &out)
+{
+    if (strcasecmp(s.c_str(), "yes") == 0)
+    {
+        out = true;
+        return true;
+    }
+    if (strcasecmp(s.c_str(), "no") == 0)
+    {
+        out = false;
+        return true;
+    }
+    return false;
+}
+
+// bytes, with an optional kb, mb or gb suffix
+static bool str2mem(const std::string &s, size_t &out)
+{
+    static const struct
+    {
+        const char *suffix;
+        size_t unit;
+    } k_units[] = {{"kb", 1 << 10}, {"mb", 1 << 20}, {"gb", 1 << 30}};
+    std::string num = s;
+    size_t unit = 1;
+    for (auto &u : k_units)
+    {
+        if (s.size() > 2 && strcasecmp(s.c_str() + s.size() - 2, u.suffix) == 0)
+        {
+            num = s.substr(0, s.size() - 2);
+            unit = u.unit;
+        }
+    }
+    int64_t n = 0;
+    if (!str2int(num, n) || n < 0)
+    {
+        return false;
+    }
+    out = (size_t)n * unit;
+    return true;
+}
+
+// apply a setting; returns false for unknown names or bad values
+static bool conf_set(const std::string &name, const std::string &val)
+{
+    if (name == "key-index")
+    {
+        bool on = false;
+        if (!str2bool(val, on))
+        {
+            return false;
+        }
+        if (on != g_conf.key_index)
+        {
+            g_conf.key_index = on;
+            index_rebuild();
+        }
+        return true;
+    }
+    if (name == "zset-backend")
+    {
+        if (strcasecmp(val.c_str(), "avl") == 0)
+        {
+            g_conf.zset_backend = ZSET_AVL;
+        }
+        else if (strcasecmp(val.c_str(), "btree") == 0)
+        {
+            g_conf.zset_backend = ZSET_BTREE;
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+    if (name == "reply-offload-min")
+    {
+        int64_t n = 0;
+        if (!str2int(val, n) || n < 0)
+        {
+            return false;
+        }
+        g_conf.reply_offload_min = (size_t)n;
+        return true;
+    }
+    if (name == "maxmemory")
+    {
+        return str2mem(val, g_conf.maxmemory);
+    }
+    if (name == "maxmemory-policy")
+    {
+        for (uint32_t i = 0; i < sizeof(k_evict_policies) / sizeof(k_evict_policies[0]); i++)
+        {
+            if (strcasecmp(val.c_str(), k_evict_policies[i]) == 0)
+            {
+                g_conf.maxmemory_policy = i;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (name == "maxmemory-samples")
+    {
+        int64_t n = 0;
+        if (!str2int(val, n) || n < 1 || n > 64)
+        {
+            return false;
+        }
+        g_conf.maxmemory_samples = (uint32_t)n;
+        return true;
+    }
+    if (name == "activedefrag")
+    {
+        return str2bool(val, g_conf.activedefrag);
+    }
+    if (name == "active-defrag-ignore-bytes")
+    {
+        return str2mem(val, g_conf.active_defrag_ignore_bytes);
+    }
+    if (name == "active-defrag-threshold")
+    {
+        int64_t n = 0;
+        if (!str2int(val, n) || n < 0 || n > 1000)
+        {
+            return false;
+        }
+        g_conf.active_defrag_threshold = (uint32_t)n;
+        return true;
+    }
+    if (name == "active-defrag-cycle-us")
+    {
+        int64_t n = 0;
+        if (!str2int(val, n) || n < 1 || n > 1000000)
+        {
+            return false;
+        }
+        g_conf.active_defrag_cycle_us = (uint32_t)n;
+        return true;
+    }
+    if (name == "compression")
+    {
+        return str2bool(val, g_conf.compression);
+    }
+    if (name == "compression-min-size")
+    {
+        return str2mem(val, g_conf.compression_min_size);
+    }
+    if (name == "port")
+    {
+        int64_t port = 0;
+        if (g_aof.done_fd >= 0 || !str2int(val, port) || port < 1 || port > 65535)
+        {
+            return false; // the socket is bound at startup
+        }
+        g_conf.port = (uint32_t)port;
+        return true;
+    }
+    if (name == "dbfilename")
+    {
+        if (val.empty())
+        {
+            return false;
+        }
+        g_conf.dbfilename = val;
+        return true;
+    }
+    if (name == "save")
+    {
+        // "<seconds> <changes>", or "" to turn it off
+        int64_t seconds = 0, changes = 0;
+        size_t sp = val.find(' ');
+        if (val.empty())
+        {
+            g_conf.save_seconds = 0;
+            return true;
+        }
+        if (sp == std::string::npos || !str2int(val.substr(0, sp), seconds) ||
+            !str2int(val.substr(sp + 1), changes) || seconds < 1 || seconds > 1000000 ||
+            changes < 0)
+        {
+            return false;
+        }
+        g_conf.save_seconds = (uint32_t)seconds;
+        g_conf.save_changes = (size_t)changes;
+        return true;
+    }
+    if (name == "appendonly")
+    {
+        bool on = false;
+        if (!str2bool(val, on))
+        {
+            return false;
+        }
+        // before startup, main() opens the file after replaying it. at run
+        // time the file is created by a rewrite, started by the loop, since
+        // the keyspace so far is not in it.
+        if (!on && g_aof.done_fd >= 0)
+        {
+            aof_rewrite_kill();
+            aof_close(&g_aof);
+        }
+        g_conf.appendonly = on;
+        return true;
+    }
+    if (name == "appendfilename")
+    {
+        if (val.empty() || aof_logging(&g_aof))
+        {
+            return false; // not while it is being written
+        }
+        g_conf.appendfilename = val;
+        return true;
+    }
+    if (name == "appendfsync")
+    {
+        for (uint32_t i = 0; i < 3; i++)
+        {
+            if (strcasecmp(val.c_str(), k_aof_fsync[i]) == 0)
+            {
+                g_aof.policy = i;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (name == "auto-aof-rewrite-percentage")
+    {
+        int64_t n = 0;
+        if (!str2int(val, n) || n < 0 || n > 100000)
+        {
+            return false;
+        }
+        g_conf.auto_aof_rewrite_percentage = (uint32_t)n;
+        return true;
+    }
+    if (name == "auto-aof-rewrite-min-size")
+    {
+        return str2mem(val, g_conf.auto_aof_rewrite_min_size);
+    }
+    return false;
+}
+
+static bool conf_get(const std::string &name, std::string &val)
+{
+    if (name == "key-index")
+    {
+        val = g_conf.key_index ? "yes" : "no";
+        return true;
+    }
+    if (name == "zset-backend")
+    {
+        val = g_conf.zset_backend == ZSET_BTREE ? "btree" : "avl";
+        return true;
+    }
+    if (name == "reply-offload-min")
+    {
+        val = std::to_string(g_conf.reply_offload_min);
+        return true;
+    }
+    if (name == "maxmemory")
+    {
+        val = std::to_string(g_conf.maxmemory);
+        return true;
+    }
+    if (name == "maxmemory-policy")
+    {
+        val = k_evict_policies[g_conf.maxmemory_policy];
+        return true;
+    }
+    if (name == "maxmemory-samples")
+    {
+        val = std::to_string(g_conf.maxmemory_samples);
+        return true;
+    }
+    if (name == "activedefrag")
+    {
+        val = g_conf.activedefrag ? "yes" : "no";
+        return true;
+    }
+    if (name == "active-defrag-ignore-bytes")
+    {
+        val = std::to_string(g_conf.active_defrag_ignore_bytes);
+        return true;
+    }
+    if (name == "active-defrag-threshold")
+    {
+        val = std::to_string(g_conf.active_defrag_threshold);
+        return true;
+    }
+    if (name == "active-defrag-cycle-us")
+    {
+        val = std::to_string(g_conf.active_defrag_cycle_us);
+        return true;
+    }
+    if (name == "compression")
+    {
+        val = g_conf.compression ? "yes" : "no";
+        return true;
+    }
+    if (name == "compression-min-size")
+    {
+        val = std::to_string(g_conf.compression_min_size);
+        return true;
+    }
+    if (name == "port")
+    {
+        val = std::to_string(g_conf.port);
+        return true;
+    }
+    if (name == "dbfilename")
+    {
+        val = g_conf.dbfilename;
+        return true;
+    }
+    if (name == "save")
+    {
+        val = g_conf.save_seconds
+            ? std::to_string(g_conf.save_seconds) + " " + std::to_string(g_conf.save_changes) : "";
+        return true;
+    }
+    if (name == "appendonly")
+    {
+        val = g_conf.appendonly ? "yes" : "no";
+        return true;
+    }
+    if (name == "appendfilename")
     {
-        return out_err(out, ERR_BAD_ARG, "expect float");
+        val = g_conf.appendfilename;
+        return true;
     }
-
-    // look up or create the zset
-    LookupKey key;
-    key.key = cmd[1]; // instead of swap(cmd[1])
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&conn->db, &key.node, &entry_eq);
-
-    Entry *ent = NULL;
-    if (!hnode)
-    { // insert a new key
-        ent = entry_new(T_ZSET, conn);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        hm_insert(&conn->db, &ent->node);
+    if (name == "appendfsync")
+    {
+        val = k_aof_fsync[g_aof.policy];
+        return true;
     }
-    else
-    { // check the existing key
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET)
-        {
-            return out_err(out, ERR_BAD_TYP, "expect zset");
-        }
+    if (name == "auto-aof-rewrite-percentage")
+    {
+        val = std::to_string(g_conf.auto_aof_rewrite_percentage);
+        return true;
     }
-
-    // add or update the tuple
-    const std::string &name = cmd[3];
-    bool added = zset_insert(&ent->zset, name.data(), name.size(), score);
-    return out_int(out, (int64_t)added);
-}
-
-static const ZSet k_empty_zset;
-
-static ZSet *expect_zset(Conn *conn, std::string &s)
-{
-    LookupKey key;
-    key.key.swap(s);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&conn->db, &key.node, &entry_eq);
-    if (!hnode)
-    { // a non-existent key is treated as an empty zset
-        return (ZSet *)&k_empty_zset;
+    if (name == "auto-aof-rewrite-min-size")
+    {
+        val = std::to_string(g_conf.auto_aof_rewrite_min_size);
+        return true;
     }
-    Entry *ent = container_of(hnode, Entry, node);
-    return ent->type == T_ZSET ? &ent->zset : NULL;
+    return false;
 }
 
-// zrem zset name
-static void do_zrem(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+// CONFIG GET name | CONFIG SET name value
+static void do_config(Conn *, std::vector<std::string> &cmd, Buffer &out)
 {
-    ZSet *zset = expect_zset(conn, cmd[1]);
-    if (!zset)
+    if (cmd.size() == 3 && strcasecmp(cmd[1].c_str(), "get") == 0)
     {
-        return out_err(out, ERR_BAD_TYP, "expect zset");
+        std::string val;
+        if (!conf_get(cmd[2], val))
+        {
+            return out_nil(out);
+        }
+        return out_str(out, val.data(), val.size());
     }
-
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(zset, name.data(), name.size());
-    if (znode)
+    if (cmd.size() == 4 && strcasecmp(cmd[1].c_str(), "set") == 0)
     {
-        zset_delete(zset, znode);
+        if (!conf_set(cmd[2], cmd[3]))
+        {
+            return out_err(out, ERR_BAD_ARG, "bad config");
+        }
+        return out_str(out, "1", 1);
     }
-    return out_int(out, znode ? 1 : 0);
+    return out_err(out, ERR_BAD_ARG, "syntax error");
 }
 
-// zscore zset name
-static void do_zscore(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+// the commands that make room under maxmemory before they run
+static bool cmd_adds_data(const std::string &name)
 {
-    ZSet *zset = expect_zset(conn, cmd[1]);
-    if (!zset)
-    {
-        return out_err(out, ERR_BAD_TYP, "expect zset");
-    }
+    return name == "set" || name == "zadd" || name == "zunionstore" ||
+           name == "zinterstore" || name == "zdiffstore";
+}
 
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(zset, name.data(), name.size());
-    return znode ? out_dbl(out, znode->score) : out_nil(out);
+// the commands that may change the keyspace, counted for `save`
+static bool cmd_writes(const std::string &name)
+{
+    return cmd_adds_data(name) || name == "del" || name == "unlink" || name == "flushdb" ||
+           name == "pexpire" || name == "pexpireat" || name == "zrem" || name == "zremrangebylex" ||
+           name == "zremrangebyscore" || name == "zremrangebyrank" || name == "zpopmin" ||
+           name == "zpopmax" || name == "bzpopmin" || name == "bzpopmax";
 }
 
-// zquery zset score name offset limit
-static void do_zquery(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+// a zset the command changes in place while offloaded replies read it
+static ZSet *cmd_busy_zset(const std::vector<std::string> &cmd)
 {
-    // parse args
-    double score = 0;
-    if (!str2dbl(cmd[2], score))
-    {
-        return out_err(out, ERR_BAD_ARG, "expect fp number");
-    }
-    const std::string &name = cmd[3];
-    int64_t offset = 0, limit = 0;
-    if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit))
+    size_t nkeys = 0;
+    if (cmd.size() >= 2 &&
+        (cmd[0] == "zadd" || cmd[0] == "zrem" || cmd[0] == "zremrangebylex" ||
+         cmd[0] == "zremrangebyscore" || cmd[0] == "zremrangebyrank" ||
+         cmd[0] == "zpopmin" || cmd[0] == "zpopmax"))
     {
-        return out_err(out, ERR_BAD_ARG, "expect int");
+        nkeys = 1;
     }
-
-    // get the zset
-    ZSet *zset = expect_zset(conn, cmd[1]);
-    if (!zset)
+    else if (cmd.size() >= 3 && (cmd[0] == "bzpopmin" || cmd[0] == "bzpopmax"))
     {
-        return out_err(out, ERR_BAD_TYP, "expect zset");
+        nkeys = cmd.size() - 2;
     }
-
-    // seek to the key
-    if (limit <= 0)
+    for (size_t i = 1; i <= nkeys; i++)
     {
-        return out_arr(out, 0);
+        std::string key = cmd[i];
+        ZSet *zset = expect_zset(key);
+        if (zset && zset->readers > 0)
+        {
+            return zset;
+        }
     }
-    ZNode *znode = zset_seekge(zset, score, name.data(), name.size());
-    znode = znode_offset(znode, offset);
+    return NULL;
+}
 
-    // output
-    size_t ctx = out_begin_arr(out);
-    int64_t n = 0;
-    while (znode && n < limit)
-    {
-        out_str(out, znode->name, znode->len);
-        out_dbl(out, znode->score);
-        znode = znode_offset(znode, +1);
-        n += 2;
-    }
-    out_end_arr(out, ctx, (uint32_t)n);
+// the writes for the append-only file; a blocking pop is logged as the
+// ZPOPMIN/ZPOPMAX it turned into
+static bool cmd_logged(const std::string &name)
+{
+    return cmd_writes(name) && name != "bzpopmin" && name != "bzpopmax";
 }
 
 // Process a command and generate a response
 static void do_request(Conn *conn, vector<string> &cmd, Buffer &out)
 {
+    if (!cmd.empty() && cmd_adds_data(cmd[0]) && !evict_to_fit())
+    {
+        return out_err(out, ERR_OOM, "command not allowed when used memory > 'maxmemory'");
+    }
+    if (!cmd.empty() && cmd_writes(cmd[0]))
+    {
+        if (g_aof.write_error)
+        {
+            return out_err(out, ERR_IO, "append-only file write error, see the server log");
+        }
+        if (g_aof.fsync_error.load(std::memory_order_relaxed))
+        {
+            return out_err(out, ERR_IO, "append-only file fsync error, see the server log");
+        }
+        g_save.dirty++;
+    }
     if (cmd.size() == 2 && cmd[0] == "get")
     {
         do_get(conn, cmd, out);
     }
+    else if (cmd.size() == 2 && cmd[0] == "getraw")
+    {
+        return do_getraw(conn, cmd, out);
+    }
     else if (cmd.size() == 3 && cmd[0] == "set")
     {
         do_set(conn, cmd, out);
@@ -724,10 +4075,42 @@ static void do_request(Conn *conn, vector<string> &cmd, Buffer &out)
     {
         do_del(conn, cmd, out);
     }
+    else if (cmd.size() >= 2 && cmd[0] == "unlink")
+    {
+        return do_unlink(conn, cmd, out);
+    }
+    else if ((cmd.size() == 1 || cmd.size() == 2) && cmd[0] == "flushdb")
+    {
+        return do_flushdb(conn, cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd[0] == "info")
+    {
+        return do_info(conn, cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd[0] == "save")
+    {
+        return do_save(conn, cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd[0] == "bgsave")
+    {
+        return do_bgsave(conn, cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd[0] == "bgrewriteaof")
+    {
+        return do_bgrewriteaof(conn, cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd[0] == "memory" && strcasecmp(cmd[1].c_str(), "stats") == 0)
+    {
+        return do_memory_stats(conn, cmd, out);
+    }
     else if (cmd.size() == 3 && cmd[0] == "pexpire")
     {
         return do_expire(conn, cmd, out);
     }
+    else if (cmd.size() == 3 && cmd[0] == "pexpireat")
+    {
+        return do_expireat(conn, cmd, out);
+    }
     else if (cmd.size() == 2 && cmd[0] == "pttl")
     {
         return do_ttl(conn, cmd, out);
@@ -736,7 +4119,19 @@ static void do_request(Conn *conn, vector<string> &cmd, Buffer &out)
     {
         do_keys(conn, cmd, out);
     }
-    else if (cmd.size() == 4 && cmd[0] == "zadd")
+    else if (cmd.size() >= 2 && cmd[0] == "scan")
+    {
+        return do_scan(conn, cmd, out);
+    }
+    else if (cmd.size() >= 2 && cmd[0] == "scanprefix")
+    {
+        return do_scanprefix(conn, cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd[0] == "config")
+    {
+        return do_config(conn, cmd, out);
+    }
+    else if (cmd.size() >= 4 && cmd[0] == "zadd")
     {
         return do_zadd(conn, cmd, out);
     }
@@ -752,6 +4147,59 @@ static void do_request(Conn *conn, vector<string> &cmd, Buffer &out)
     {
         return do_zquery(conn, cmd, out);
     }
+    else if (cmd.size() == 2 && cmd[0] == "zcard")
+    {
+        return do_zcard(conn, cmd, out);
+    }
+    else if (cmd.size() == 3 && (cmd[0] == "zrank" || cmd[0] == "zrevrank"))
+    {
+        return do_zrank(conn, cmd, out);
+    }
+    else if (cmd.size() >= 4 && (cmd[0] == "zrange" || cmd[0] == "zrevrange"))
+    {
+        return do_zrange(conn, cmd, out);
+    }
+    else if (cmd.size() == 4 && cmd[0] == "zcount")
+    {
+        return do_zcount(conn, cmd, out);
+    }
+    else if (cmd.size() >= 4 && cmd[0] == "zrangebyscore")
+    {
+        return do_zrangebyscore(conn, cmd, out);
+    }
+    else if (cmd.size() == 4 && cmd[0] == "zlexcount")
+    {
+        return do_zlexcount(conn, cmd, out);
+    }
+    else if (cmd.size() >= 4 && (cmd[0] == "zrangebylex" || cmd[0] == "zrevrangebylex"))
+    {
+        return do_zrangebylex(conn, cmd, out);
+    }
+    else if (cmd.size() == 4 && cmd[0] == "zremrangebylex")
+    {
+        return do_zremrangebylex(conn, cmd, out);
+    }
+    else if (cmd.size() == 4 && cmd[0] == "zremrangebyscore")
+    {
+        return do_zremrangebyscore(conn, cmd, out);
+    }
+    else if (cmd.size() == 4 && cmd[0] == "zremrangebyrank")
+    {
+        return do_zremrangebyrank(conn, cmd, out);
+    }
+    else if ((cmd.size() == 2 || cmd.size() == 3) && (cmd[0] == "zpopmin" || cmd[0] == "zpopmax"))
+    {
+        return do_zpop(conn, cmd, out);
+    }
+    else if (cmd.size() >= 3 && (cmd[0] == "bzpopmin" || cmd[0] == "bzpopmax"))
+    {
+        return do_bzpop(conn, cmd, out);
+    }
+    else if (cmd.size() >= 4 &&
+             (cmd[0] == "zunionstore" || cmd[0] == "zinterstore" || cmd[0] == "zdiffstore"))
+    {
+        return do_zstore(conn, cmd, out);
+    }
     else if (cmd.size() == 1 && cmd[0] == "quit")
     {
         out_str(out, "BYE", 3);
@@ -837,11 +4285,30 @@ static bool try_one_request(Conn *conn)
         return false;
     }
 
+    // don't wait on the zset's write lock, which would stall the loop
+    if (ZSet *zset = cmd_busy_zset(cmd))
+    {
+        conn_wait_zset(conn, zset);
+        return false;
+    }
+
     // Process the command and generate a response
     size_t header_pos = 0;
     conn->outgoing.clear(); // start fresh for new response
     response_begin(conn->outgoing, &header_pos);
+    bool logged = aof_logging(&g_aof) && !cmd.empty() && cmd_logged(cmd[0]);
     do_request(conn, cmd, conn->outgoing);
+    if (conn->blocked)
+    {
+        // parked; the reply comes from serve_blocked() or the timeout
+        conn->outgoing.resize(header_pos);
+        buf_consume(conn->incoming, 4 + len);
+        return false;
+    }
+    if (logged && conn->outgoing[header_pos + 4] != TAG_ERR)
+    {
+        aof_log(conn, cmd, request, len);
+    }
     response_end(conn->outgoing, header_pos);
 
     // Remove the processed message from the incoming buffer
@@ -849,6 +4316,47 @@ static bool try_one_request(Conn *conn)
     return true; // Success
 }
 
+// reply to a parked connection and resume it
+static void conn_wake(Conn *conn, const std::string *key, ZSet *zset)
+{
+    bool max = conn->block_max;
+    conn_unblock(conn);
+    size_t header_pos = 0;
+    response_begin(conn->outgoing, &header_pos);
+    if (key)
+    {
+        aof_log(conn, {max ? "zpopmax" : "zpopmin", *key});
+        out_bzpop(conn->outgoing, *key, zset, max);
+    }
+    else
+    {
+        out_nil(conn->outgoing); // timed out
+    }
+    response_end(conn->outgoing, header_pos);
+    conn->want_write = true;
+}
+
+// pop for the parked connections of the keys that got members, oldest first
+static void serve_blocked()
+{
+    while (!g_data.ready_keys.empty())
+    {
+        std::string key = std::move(g_data.ready_keys.back());
+        g_data.ready_keys.pop_back();
+        for (auto it = g_data.blocked.find(key); it != g_data.blocked.end();
+             it = g_data.blocked.find(key))
+        {
+            std::string tmp = key;
+            ZSet *zset = expect_zset(tmp);
+            if (!zset || zset_size(zset) == 0)
+            {
+                break;
+            }
+            conn_wake(it->second.front(), &key, zset);
+        }
+    }
+}
+
 // Handle read events
 static void handle_read(Conn *conn)
 {
@@ -880,15 +4388,36 @@ static void handle_read(Conn *conn)
     while (try_one_request(conn))
     {
     }
+    serve_blocked();
 
     // Update the connection state
-    if (conn->outgoing.size() > 0)
+    if (conn->blocked)
+    {
+        conn->want_read = false;
+        conn->want_write = false;
+    }
+    else if (conn->outgoing.size() > 0)
     {
         conn->want_read = false;
         conn->want_write = true;
     }
 }
 
+// run the requests a parked connection has buffered
+static void conn_resume(Conn *conn)
+{
+    while (try_one_request(conn))
+    {
+    }
+    serve_blocked();
+    if (conn->blocked)
+    {
+        return;
+    }
+    conn->want_read = conn->outgoing.empty();
+    conn->want_write = !conn->outgoing.empty();
+}
+
 // Handle write events
 static void handle_write(Conn *conn)
 {
@@ -926,6 +4455,99 @@ static void handle_write(Conn *conn)
     conn->want_read = true;
 }
 
+// zsets whose arenas are mostly holes get compacted, up to this size; the
+// copy is not incremental, so bigger ones would blow the budget
+const size_t k_defrag_zset_max = 65536;
+const size_t k_defrag_slack_min = 64 * 1024;
+
+// move an entry out of a sparse slab span and fix what points to it: its
+// hashtable slot or chain, its TTL heap item, and the key index
+static void entry_defrag(Entry *ent)
+{
+    if (Entry *moved = slab_move(ent))
+    {
+        hm_relink(&g_data.db, &ent->node, &moved->node);
+        if (moved->heap_idx != (size_t)-1)
+        {
+            g_data.heap.items[moved->heap_idx].ref = &moved->heap_idx;
+        }
+        if (g_conf.key_index)
+        {
+            index_add(moved);
+        }
+        g_defrag.moved++;
+        ent = moved;
+    }
+    if (ent->type == T_ZSET && ent->slack > k_defrag_slack_min && ent->slack * 2 > ent->mem &&
+        zset_size(&ent->zset) <= k_defrag_zset_max)
+    {
+        zset_compact(&ent->zset);
+        entry_account(ent);
+        g_defrag.compacted++;
+    }
+}
+
+// one slice of an active defrag cycle, within the CPU budget. a cycle walks
+// the keyspace once with a SCAN cursor, then gives the pages of emptied
+// spans and freed arena chunks back to the OS.
+static void defrag_step()
+{
+    // replies built on the thread pool may hold entries and zsets, and
+    // moving entries under a BGSAVE or rewrite child would copy their pages
+    if (!g_conf.activedefrag || g_data.reply_jobs > 0 || child_running())
+    {
+        return;
+    }
+    uint64_t now_us = get_monotonic_usec();
+    if (!g_defrag.running)
+    {
+        if (now_us < g_defrag.next_check_us)
+        {
+            return;
+        }
+        g_defrag.next_check_us = now_us + 100 * 1000;
+        size_t frag_bytes = 0;
+        double ratio = frag_ratio(&frag_bytes);
+        // and not again until there is more than the last cycle left
+        if (ratio * 100 < 100 + g_conf.active_defrag_threshold ||
+            frag_bytes < g_defrag.frag_left + g_conf.active_defrag_ignore_bytes)
+        {
+            return;
+        }
+        g_defrag.running = true;
+        g_defrag.cursor = 0;
+        g_defrag.ratio_before = ratio;
+        g_defrag.ratio_after = 0;
+        g_defrag.moved = g_defrag.compacted = 0;
+        g_defrag.start_us = now_us;
+    }
+
+    uint64_t deadline = now_us + g_conf.active_defrag_cycle_us;
+    std::vector<Entry *> ents;
+    do
+    {
+        ents.clear();
+        g_defrag.cursor = hm_scan(&g_data.db, g_defrag.cursor, &cb_scan, &ents);
+        for (Entry *ent : ents)
+        {
+            entry_defrag(ent);
+        }
+    } while (g_defrag.cursor != 0 && get_monotonic_usec() < deadline);
+    if (g_defrag.cursor != 0)
+    {
+        return;
+    }
+
+    size_t released = slab_purge();
+    malloc_trim(0);
+    g_defrag.running = false;
+    g_defrag.ratio_after = frag_ratio(&g_defrag.frag_left);
+    fprintf(stderr, "defrag: ratio %.3f -> %.3f, moved %zu entries, compacted %zu zsets, "
+            "released %zu KiB of spans in %zu ms\n",
+            g_defrag.ratio_before, g_defrag.ratio_after, g_defrag.moved, g_defrag.compacted,
+            released >> 10, (size_t)(get_monotonic_usec() - g_defrag.start_us) / 1000);
+}
+
 const uint64_t k_idle_timeout_ms = 60 * 1000;
 
 static uint32_t next_timer_ms()
@@ -940,9 +4562,25 @@ static uint32_t next_timer_ms()
     }
 
     // TTL timers using a heap
-    if (!g_data.heap.empty() && g_data.heap[0].val < next_ms)
+    if (g_data.heap.len && g_data.heap.items[0].val < next_ms)
+    {
+        next_ms = g_data.heap.items[0].val;
+    }
+    // timeouts of parked connections
+    if (g_data.block_heap.len && g_data.block_heap.items[0].val < next_ms)
+    {
+        next_ms = g_data.block_heap.items[0].val;
+    }
+    // a running defrag cycle continues even when there is no traffic
+    if (g_defrag.running && now_ms + 1 < next_ms)
+    {
+        next_ms = now_ms + 1;
+    }
+    // a child to reap, or a scheduled BGSAVE or rewrite to start
+    if ((child_running() || (g_conf.save_seconds && g_save.dirty) ||
+         (g_conf.appendonly && g_aof.fd < 0)) && now_ms + 100 < next_ms)
     {
-        next_ms = g_data.heap[0].val;
+        next_ms = now_ms + 100;
     }
     // timeout value
     if (next_ms == (uint64_t)-1)
@@ -956,11 +4594,6 @@ static uint32_t next_timer_ms()
     return (int32_t)(next_ms - now_ms);
 }
 
-static bool hnode_same(HNode *node, HNode *key)
-{
-    return node == key;
-}
-
 static void process_timers()
 {
     uint64_t now_ms = get_monotonic_msec();
@@ -982,42 +4615,64 @@ static void process_timers()
         conn_destroy(conn);
     }
 
+    // parked connections that timed out
+    while (g_data.block_heap.len && g_data.block_heap.items[0].val < now_ms)
+    {
+        conn_wake(container_of(g_data.block_heap.items[0].ref, Conn, block_heap_idx), NULL, NULL);
+    }
+
     // TTL expiration via heap
+    // don't stall the server if too many keys are expiring at once; a mass
+    // expiry still takes 1/16 of the heap per iteration, rebuilt in O(n)
     const size_t k_max_works = 2000;
-    size_t nworks = 0;
-    std::vector<HeapItem> &heap = g_data.heap;
-    while (!heap.empty() && heap[0].val < now_ms)
+    std::vector<HeapItem> expired;
+    dheap_pop_expired(&g_data.heap, now_ms, k_max_works, expired);
+    for (HeapItem &item : expired)
     {
-        if (!heap[0].ref || *(heap[0].ref) == (size_t)-1)
+        if (!item.ref)
         {
-            heap_delete(heap, 0);
             continue; // skip stale entry
         }
-        Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
-        Conn *owner = ent->owner_conn;
-        if (!owner)
-        {
-            heap_delete(heap, 0);
-            continue; // stale or unbound
-        }
-        HNode *node = hm_delete(&owner->db, &ent->node, &hnode_same);
-        assert(node == &ent->node);
+        // popped items have heap_idx = -1 already
+        Entry *ent = container_of(item.ref, Entry, heap_idx);
+        Entry *found = db_delete(&ent->node, &hnode_same);
+        assert(found == ent);
         fprintf(stderr, "key expired: %s\n", ent->key.c_str());
-        // Proper deletion also sets heap_idx = -1
+        // replaying the PEXPIREAT alone would not remove it in time for
+        // the commands logged after this
+        aof_log(NULL, {"del", ent->key});
         entry_del(ent);
-        if (nworks++ >= k_max_works)
-        {
-            // don't stall the server if too many keys are expiring at once
-            break;
-        }
     }
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    // settings: --name value
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (strncmp(argv[i], "--", 2) != 0 || i + 1 >= argc || !conf_set(argv[i] + 2, argv[i + 1]))
+        {
+            fprintf(stderr, "bad option: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
     // initialization
     dlist_init(&g_data.idle_list);
     thread_pool_init(&g_data.thread_pool, 4);
+    g_save.last_save_ms = get_realtime_msec();
+    bool replayed = g_conf.appendonly && aof_load();
+    if (!replayed)
+    {
+        snapshot_load();
+    }
+    aof_init(&g_aof);
+    // with keys from the snapshot, the log is created by a rewrite instead
+    if (g_conf.appendonly && (replayed || hm_size(&g_data.db) == 0) && !aof_start())
+    {
+        return EXIT_FAILURE;
+    }
+    g_rewrite.base_size = g_aof.file_size;
 
     // Create the listening socket
     int fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -1032,7 +4687,7 @@ int main()
     // Bind the socket
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
+    addr.sin_port = htons((uint16_t)g_conf.port);
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
     if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
     {
@@ -1048,7 +4703,7 @@ int main()
         die("listen() failed");
     }
 
-    cout << "Server listening on port " << PORT << endl;
+    cout << "Server listening on port " << g_conf.port << endl;
 
     // the event loop
     vector<pollfd> poll_args;
@@ -1059,6 +4714,11 @@ int main()
         // put the listening sockets in the first position
         struct pollfd pfd = {fd, POLLIN, 0};
         poll_args.push_back(pfd);
+        // then the completions of background tasks, and of AOF syncs
+        poll_args.push_back({thread_pool_done_fd(&g_data.thread_pool), POLLIN, 0});
+        poll_args.push_back({g_aof.done_fd, POLLIN, 0});
+        // log this iteration's writes before their replies go out
+        aof_write();
 
         // the rest are connection sockets
         for (Conn *conn : g_data.fd2conn)
@@ -1070,8 +4730,11 @@ int main()
             // poll() flags from the application's intent
             if (conn->want_read)
                 pfd.events |= POLLIN;
-            if (conn->want_write)
+            if (conn->want_write && !aof_held(conn))
                 pfd.events |= POLLOUT;
+            // a parked connection only watches for the peer going away
+            if (conn->blocked)
+                pfd.events |= POLLRDHUP;
             poll_args.push_back(pfd);
         }
 
@@ -1102,8 +4765,19 @@ int main()
             }
         }
 
+        // hand the results of background tasks back to their connections
+        if (poll_args[1].revents)
+        {
+            thread_pool_poll_done(&g_data.thread_pool);
+        }
+        // held replies may go out now
+        if (poll_args[2].revents)
+        {
+            aof_poll_done(&g_aof);
+        }
+
         // Handle connection sockets
-        for (size_t i = 1; i < poll_args.size(); ++i)
+        for (size_t i = 3; i < poll_args.size(); ++i)
         {
             uint32_t ready = poll_args[i].revents;
             if (ready == 0)
@@ -1121,6 +4795,8 @@ int main()
             conn->last_active_ms = get_monotonic_msec();
             dlist_detach(&conn->idle_node);
             dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+            if (conn->blocked && (ready & (POLLRDHUP | POLLHUP)))
+                conn->want_close = true;
             // handle IO
             if (ready & POLLIN)
                 handle_read(conn);
@@ -1134,6 +4810,9 @@ int main()
         }
         // handle timers
         process_timers();
+        defrag_step();
+        bgsave_poll();
+        aof_rewrite_poll();
     }
 
     return 0;
@@ -0,0 +1,437 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <atomic>
+// proj
+#include "slab.h"
+
+// 16-byte steps up to 256, then 8 classes per doubling up to 1024
+const size_t k_nclasses = 32;
+
+static size_t class_size(size_t cls)
+{
+    if (cls < 16)
+    {
+        return (cls + 1) * 16;
+    }
+    if (cls < 24)
+    {
+        return 256 + (cls - 15) * 32;
+    }
+    return 512 + (cls - 23) * 64;
+}
+
+static size_t class_of(size_t size)
+{
+    if (size <= 256)
+    {
+        return size ? (size + 15) / 16 - 1 : 0;
+    }
+    size_t k = 63 - __builtin_clzll(size - 1); // size is in (2^k, 2^(k+1)]
+    size_t step = (size_t)1 << (k - 3);
+    return 16 + (k - 8) * 8 + (size - 1 - ((size_t)1 << k)) / step;
+}
+
+// a thread cache holds up to this many objects per class, and moves half
+// of them at a time
+const uint32_t k_tcache_max = 64;
+
+// the header at the start of each span
+struct alignas(16) Span
+{
+    Span *prev = NULL; // in a list of the class's spans with room
+    Span *next = NULL;
+    void *free = NULL; // freed objects, linked through the first word
+    uint32_t cls = 0;
+    uint32_t used = 0; // objects out of the span, in use or in a cache
+    uint32_t bump = 0; // offset of the never used tail
+    int32_t bucket = -1; // the list it is in, by occupancy; -1 if full
+    bool purged = false; // empty, and its pages given back by slab_purge()
+};
+
+const size_t k_page = 4096;
+
+static Span *span_of(void *ptr)
+{
+    return (Span *)((uintptr_t)ptr & ~(uintptr_t)(k_slab_span - 1));
+}
+
+static uint32_t span_capacity(size_t cls)
+{
+    return (uint32_t)((k_slab_span - sizeof(Span)) / class_size(cls));
+}
+
+// spans with room are kept in lists by occupancy, and objects are taken
+// from the fullest span first. the emptiest spans then tend to drain, and
+// slab_move_alloc() finds a full target in O(1).
+const int32_t k_buckets = 8;
+
+struct SlabClass
+{
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    Span *partial[k_buckets] = {}; // by used * k_buckets / capacity
+    size_t spans = 0;
+    std::atomic<size_t> in_use{0};
+};
+
+static SlabClass g_classes[k_nclasses];
+
+// spans are cut from chunks; empty spans are shared by all classes
+static struct
+{
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    char *cur = NULL;
+    char *end = NULL;
+    Span *empty = NULL; // singly linked through `next`
+    std::atomic<size_t> mapped{0};
+    size_t purged = 0; // bytes of empty spans given back
+} g_chunks;
+
+static Span *span_new(uint32_t cls)
+{
+    pthread_mutex_lock(&g_chunks.mu);
+    char *mem = NULL;
+    if (g_chunks.empty)
+    {
+        mem = (char *)g_chunks.empty;
+        if (g_chunks.empty->purged)
+        {
+            g_chunks.purged -= k_slab_span - k_page;
+        }
+        g_chunks.empty = g_chunks.empty->next;
+    }
+    else
+    {
+        if (g_chunks.cur == g_chunks.end)
+        {
+            // map twice the size to cut out an aligned chunk for huge pages
+            size_t len = 2 * k_slab_chunk;
+            char *p = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+            {
+                abort();
+            }
+            char *chunk = (char *)(((uintptr_t)p + k_slab_chunk - 1) & ~(k_slab_chunk - 1));
+            if (chunk > p)
+            {
+                munmap(p, chunk - p);
+            }
+            munmap(chunk + k_slab_chunk, p + len - (chunk + k_slab_chunk));
+            madvise(chunk, k_slab_chunk, MADV_HUGEPAGE);
+            g_chunks.cur = chunk;
+            g_chunks.end = chunk + k_slab_chunk;
+            g_chunks.mapped += k_slab_chunk;
+        }
+        mem = g_chunks.cur;
+        g_chunks.cur += k_slab_span;
+    }
+    pthread_mutex_unlock(&g_chunks.mu);
+    Span *span = new (mem) Span();
+    span->cls = cls;
+    span->bump = sizeof(Span);
+    return span;
+}
+
+static void span_release(Span *span)
+{
+    pthread_mutex_lock(&g_chunks.mu);
+    span->next = g_chunks.empty;
+    g_chunks.empty = span;
+    pthread_mutex_unlock(&g_chunks.mu);
+}
+
+size_t slab_purge()
+{
+    size_t released = 0;
+    pthread_mutex_lock(&g_chunks.mu);
+    for (Span *span = g_chunks.empty; span; span = span->next)
+    {
+        if (!span->purged)
+        {
+            // keep the page of the header, which links the empty spans
+            madvise((char *)span + k_page, k_slab_span - k_page, MADV_DONTNEED);
+            span->purged = true;
+            released += k_slab_span - k_page;
+        }
+    }
+    g_chunks.purged += released;
+    pthread_mutex_unlock(&g_chunks.mu);
+    return released;
+}
+
+static void list_remove(SlabClass *sc, Span *span)
+{
+    if (span->prev)
+    {
+        span->prev->next = span->next;
+    }
+    else
+    {
+        sc->partial[span->bucket] = span->next;
+    }
+    if (span->next)
+    {
+        span->next->prev = span->prev;
+    }
+    span->bucket = -1;
+}
+
+static void list_add(SlabClass *sc, Span *span, int32_t bucket)
+{
+    span->bucket = bucket;
+    span->prev = NULL;
+    span->next = sc->partial[bucket];
+    if (span->next)
+    {
+        span->next->prev = span;
+    }
+    sc->partial[bucket] = span;
+}
+
+// move the span to the list of its occupancy after `used` changed
+static void span_update(SlabClass *sc, Span *span)
+{
+    uint32_t cap = span_capacity(span->cls);
+    int32_t bucket = span->used < cap ? (int32_t)(span->used * k_buckets / cap) : -1;
+    if (bucket == span->bucket)
+    {
+        return;
+    }
+    if (span->bucket >= 0)
+    {
+        list_remove(sc, span);
+    }
+    if (bucket >= 0)
+    {
+        list_add(sc, span, bucket);
+    }
+}
+
+// the fullest span with room other than `skip`
+static Span *span_fullest(SlabClass *sc, Span *skip)
+{
+    for (int32_t b = k_buckets - 1; b >= 0; b--)
+    {
+        Span *span = sc->partial[b];
+        if (span && span == skip)
+        {
+            span = span->next;
+        }
+        if (span)
+        {
+            return span;
+        }
+    }
+    return NULL;
+}
+
+// take one object from a span with room
+static void *span_take(Span *span, size_t size)
+{
+    void *obj = span->free;
+    if (obj)
+    {
+        span->free = *(void **)obj;
+    }
+    else
+    {
+        obj = (char *)span + span->bump;
+        span->bump += size;
+    }
+    span->used++;
+    return obj;
+}
+
+// take `n` objects from the spans of the class
+static void central_take(size_t cls, void **list, uint32_t n)
+{
+    SlabClass *sc = &g_classes[cls];
+    size_t size = class_size(cls);
+    uint32_t cap = span_capacity(cls);
+    pthread_mutex_lock(&sc->mu);
+    for (uint32_t got = 0; got < n;)
+    {
+        Span *span = span_fullest(sc, NULL);
+        if (!span)
+        {
+            span = span_new((uint32_t)cls);
+            sc->spans++;
+        }
+        for (; got < n && span->used < cap; got++)
+        {
+            void *obj = span_take(span, size);
+            *(void **)obj = *list;
+            *list = obj;
+        }
+        span_update(sc, span);
+    }
+    pthread_mutex_unlock(&sc->mu);
+}
+
+// return objects to their spans; an empty span goes back to the pool
+static void central_put(size_t cls, void *list)
+{
+    SlabClass *sc = &g_classes[cls];
+    pthread_mutex_lock(&sc->mu);
+    while (list)
+    {
+        void *obj = list;
+        list = *(void **)obj;
+        Span *span = span_of(obj);
+        *(void **)obj = span->free;
+        span->free = obj;
+        span->used--;
+        if (span->used == 0)
+        {
+            if (span->bucket >= 0)
+            {
+                list_remove(sc, span);
+            }
+            sc->spans--;
+            span_release(span);
+        }
+        else
+        {
+            span_update(sc, span);
+        }
+    }
+    pthread_mutex_unlock(&sc->mu);
+}
+
+// objects flow from emptier spans to fuller ones, so that the emptiest
+// spans drain and can be released. a span that is at most half full gives
+// its objects to the fullest span of the same or a higher occupancy bucket.
+void *slab_move_alloc(void *ptr, size_t size)
+{
+    if (size > k_slab_max)
+    {
+        return NULL;
+    }
+    size_t cls = class_of(size);
+    SlabClass *sc = &g_classes[cls];
+    Span *span = span_of(ptr);
+    void *obj = NULL;
+    pthread_mutex_lock(&sc->mu);
+    if (span->used * 2 <= span_capacity(cls))
+    {
+        Span *target = span_fullest(sc, span);
+        // within a bucket the head keeps taking until it moves up
+        if (target && target->bucket >= span->bucket)
+        {
+            obj = span_take(target, class_size(cls));
+            span_update(sc, target);
+        }
+    }
+    pthread_mutex_unlock(&sc->mu);
+    return obj;
+}
+
+void slab_move_free(void *ptr, size_t size)
+{
+    *(void **)ptr = NULL;
+    central_put(class_of(size), ptr);
+}
+
+struct ThreadCache
+{
+    void *free[k_nclasses] = {};
+    uint32_t count[k_nclasses] = {};
+
+    // a thread's leftovers go back to the spans when it exits
+    ~ThreadCache()
+    {
+        for (size_t cls = 0; cls < k_nclasses; cls++)
+        {
+            central_put(cls, free[cls]);
+        }
+    }
+};
+
+static thread_local ThreadCache tl_cache;
+
+void *slab_alloc(size_t size)
+{
+    if (size > k_slab_max)
+    {
+        void *ptr = malloc(size);
+        assert(ptr);
+        return ptr;
+    }
+    size_t cls = class_of(size);
+    ThreadCache &tc = tl_cache;
+    if (tc.count[cls] == 0)
+    {
+        central_take(cls, &tc.free[cls], k_tcache_max / 2);
+        tc.count[cls] = k_tcache_max / 2;
+    }
+    void *obj = tc.free[cls];
+    tc.free[cls] = *(void **)obj;
+    tc.count[cls]--;
+    g_classes[cls].in_use.fetch_add(1, std::memory_order_relaxed);
+    return obj;
+}
+
+void slab_free(void *ptr, size_t size)
+{
+    if (!ptr)
+    {
+        return;
+    }
+    if (size > k_slab_max)
+    {
+        free(ptr);
+        return;
+    }
+    size_t cls = class_of(size);
+    ThreadCache &tc = tl_cache;
+    *(void **)ptr = tc.free[cls];
+    tc.free[cls] = ptr;
+    g_classes[cls].in_use.fetch_sub(1, std::memory_order_relaxed);
+    if (++tc.count[cls] >= k_tcache_max)
+    {
+        // spill the half that was freed first; keep the rest hot
+        void *last = tc.free[cls];
+        for (uint32_t i = 1; i < k_tcache_max / 2; i++)
+        {
+            last = *(void **)last;
+        }
+        void *spill = *(void **)last;
+        *(void **)last = NULL;
+        tc.count[cls] = k_tcache_max / 2;
+        central_put(cls, spill);
+    }
+}
+
+void slab_stats(std::vector<SlabClassStats> &out)
+{
+    for (size_t cls = 0; cls < k_nclasses; cls++)
+    {
+        SlabClass *sc = &g_classes[cls];
+        pthread_mutex_lock(&sc->mu);
+        size_t spans = sc->spans;
+        pthread_mutex_unlock(&sc->mu);
+        if (spans)
+        {
+            SlabClassStats st;
+            st.size = class_size(cls);
+            st.spans = spans;
+            st.in_use = sc->in_use.load(std::memory_order_relaxed);
+            out.push_back(st);
+        }
+    }
+}
+
+size_t slab_mapped()
+{
+    return g_chunks.mapped.load();
+}
+
+size_t slab_purged()
+{
+    pthread_mutex_lock(&g_chunks.mu);
+    size_t purged = g_chunks.purged;
+    pthread_mutex_unlock(&g_chunks.mu);
+    return purged;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <utility>
+#include <vector>
+
+// A size-class allocator for the fixed-size objects of the server (Entry,
+// Conn). Objects of one class are packed into 64 KiB spans, carved from
+// 2 MiB chunks that ask for transparent huge pages. Each thread keeps a
+// small cache of free objects per class, so that alloc and free are a few
+// loads and stores; caches spill to and refill from the spans of the class
+// in batches. A span whose objects are all freed goes back to a pool shared
+// by every class. The address space is never unmapped, but slab_purge()
+// gives the pages of pooled spans back to the OS until they are reused.
+const size_t k_slab_max = 1024; // larger sizes go to malloc
+const size_t k_slab_span = 64 * 1024;
+const size_t k_slab_chunk = 2 * 1024 * 1024;
+
+void *slab_alloc(size_t size);
+// `size` must be the size passed to slab_alloc(); any thread may free
+void slab_free(void *ptr, size_t size);
+
+template <class T, class... Args>
+T *slab_new(Args &&...args)
+{
+    static_assert(alignof(T) <= 16, "slab objects are 16-byte aligned");
+    return new (slab_alloc(sizeof(T))) T(std::forward<Args>(args)...);
+}
+
+template <class T>
+void slab_delete(T *ptr)
+{
+    ptr->~T();
+    slab_free(ptr, sizeof(T));
+}
+
+// for defragmentation: if a fuller span of the class has room, take an
+// object there for the contents of `ptr`; NULL if it is better left alone
+void *slab_move_alloc(void *ptr, size_t size);
+// free the old object straight to its span, bypassing the thread cache
+void slab_move_free(void *ptr, size_t size);
+
+// move the object to a fuller span; returns the new address, or NULL if it
+// stays. only the address changes: pointers to it must be fixed by the caller
+template <class T>
+T *slab_move(T *ptr)
+{
+    void *mem = slab_move_alloc(ptr, sizeof(T));
+    if (!mem)
+    {
+        return NULL;
+    }
+    T *moved = new (mem) T(std::move(*ptr));
+    ptr->~T();
+    slab_move_free(ptr, sizeof(T));
+    return moved;
+}
+
+// give the pages of empty spans back to the OS; returns the bytes released
+size_t slab_purge();
+
+struct SlabClassStats
+{
+    size_t size = 0;     // object size
+    size_t spans = 0;    // spans owned by the class
+    size_t in_use = 0;   // objects handed out
+};
+
+// the classes that own spans
+void slab_stats(std::vector<SlabClassStats> &out);
+// bytes mapped for chunks
+size_t slab_mapped();
+// bytes of empty spans given back by slab_purge() and not reused yet
+size_t slab_purged();
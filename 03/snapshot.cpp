@@ -0,0 +1,366 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+// proj
+#include "snapshot.h"
+
+static const char k_magic[8] = {'K', 'V', 'S', 'N', 'A', 'P', '0', '1'};
+const size_t k_flush_size = 1 << 20;
+
+// CRC-32C (Castagnoli), slicing by 8
+static uint32_t g_crc_table[8][256];
+
+static void crc_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        g_crc_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+        {
+            uint32_t prev = g_crc_table[t - 1][i];
+            g_crc_table[t][i] = (prev >> 8) ^ g_crc_table[0][prev & 0xff];
+        }
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len)
+{
+    static bool init = (crc_init(), true);
+    (void)init;
+    crc = ~crc;
+    for (; len >= 8; data += 8, len -= 8)
+    {
+        uint32_t lo = 0, hi = 0;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+        lo ^= crc; // little-endian
+        crc = g_crc_table[7][lo & 0xff] ^ g_crc_table[6][(lo >> 8) & 0xff] ^
+              g_crc_table[5][(lo >> 16) & 0xff] ^ g_crc_table[4][lo >> 24] ^
+              g_crc_table[3][hi & 0xff] ^ g_crc_table[2][(hi >> 8) & 0xff] ^
+              g_crc_table[1][(hi >> 16) & 0xff] ^ g_crc_table[0][hi >> 24];
+    }
+    for (; len > 0; data++, len--)
+    {
+        crc = (crc >> 8) ^ g_crc_table[0][(crc ^ *data) & 0xff];
+    }
+    return ~crc;
+}
+
+static std::string tmp_path(const char *path)
+{
+    return std::string(path) + ".tmp";
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t rv = write(fd, data, len);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return false;
+        }
+        data += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
+
+static void w_flush(SnapWriter *w)
+{
+    if (!w->failed && !write_all(w->fd, w->buf.data(), w->buf.size()))
+    {
+        w->failed = true;
+    }
+    w->crc = crc32c(w->crc, w->buf.data(), w->buf.size());
+    w->bytes += w->buf.size();
+    w->buf.clear();
+}
+
+static void w_bytes(SnapWriter *w, const void *data, size_t len)
+{
+    if (w->buf.size() + len > k_flush_size)
+    {
+        w_flush(w);
+    }
+    if (len > k_flush_size)
+    {
+        // a big value goes straight to the file
+        w->crc = crc32c(w->crc, (const uint8_t *)data, len);
+        w->failed = w->failed || !write_all(w->fd, (const uint8_t *)data, len);
+        w->bytes += len;
+        return;
+    }
+    w->buf.insert(w->buf.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+}
+
+static void w_varint(SnapWriter *w, uint64_t v)
+{
+    uint8_t tmp[10];
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7)
+    {
+        tmp[n++] = (uint8_t)(v | 0x80);
+    }
+    tmp[n++] = (uint8_t)v;
+    w_bytes(w, tmp, n);
+}
+
+static void w_head(SnapWriter *w, uint8_t type, std::string_view key, int64_t expire_at_ms)
+{
+    if (expire_at_ms >= 0)
+    {
+        type |= SNAP_F_TTL;
+    }
+    w_bytes(w, &type, 1);
+    if (expire_at_ms >= 0)
+    {
+        uint64_t v = (uint64_t)expire_at_ms;
+        w_bytes(w, &v, 8);
+    }
+    w_varint(w, key.size());
+    w_bytes(w, key.data(), key.size());
+}
+
+bool snap_create(SnapWriter *w, const char *path)
+{
+    w->fd = open(tmp_path(path).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0)
+    {
+        return false;
+    }
+    w->buf.reserve(k_flush_size);
+    w_bytes(w, k_magic, sizeof(k_magic));
+    return true;
+}
+
+void snap_put_str(SnapWriter *w, std::string_view key, int64_t expire_at_ms,
+                  std::string_view val, size_t raw_len)
+{
+    w_head(w, SNAP_STR | (raw_len ? SNAP_F_LZ4 : 0), key, expire_at_ms);
+    if (raw_len)
+    {
+        w_varint(w, raw_len);
+    }
+    w_varint(w, val.size());
+    w_bytes(w, val.data(), val.size());
+}
+
+void snap_put_zset(SnapWriter *w, std::string_view key, int64_t expire_at_ms, size_t n)
+{
+    w_head(w, SNAP_ZSET, key, expire_at_ms);
+    w_varint(w, n);
+}
+
+void snap_put_member(SnapWriter *w, std::string_view name, double score)
+{
+    w_varint(w, name.size());
+    w_bytes(w, name.data(), name.size());
+    w_bytes(w, &score, 8);
+}
+
+bool snap_finish(SnapWriter *w, const char *path)
+{
+    uint8_t end = SNAP_END;
+    w_bytes(w, &end, 1);
+    w_flush(w);
+    uint32_t crc = w->crc;
+    bool ok = !w->failed && write_all(w->fd, (const uint8_t *)&crc, 4) && fsync(w->fd) == 0;
+    w->bytes += 4;
+    ok = close(w->fd) == 0 && ok;
+    w->fd = -1;
+    std::string tmp = tmp_path(path);
+    if (!ok || rename(tmp.c_str(), path) != 0)
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    // make the rename durable too
+    std::string dir(path);
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "." : dir.substr(0, slash + 1);
+    int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0)
+    {
+        fsync(dfd);
+        close(dfd);
+    }
+    return true;
+}
+
+void snap_abort(SnapWriter *w, const char *path)
+{
+    if (w->fd >= 0)
+    {
+        close(w->fd);
+        w->fd = -1;
+    }
+    unlink(tmp_path(path).c_str());
+}
+
+int snap_open(SnapReader *r, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return errno == ENOENT ? SNAP_MISSING : SNAP_IOERR;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return SNAP_IOERR;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(k_magic) + 5)
+    {
+        close(fd);
+        return SNAP_CORRUPT;
+    }
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return SNAP_IOERR;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    r->data = (const uint8_t *)data;
+    r->size = size;
+    r->cur = r->data + sizeof(k_magic);
+    r->end = r->data + size - 5;
+    uint32_t crc = 0;
+    memcpy(&crc, r->end + 1, 4);
+    if (memcmp(r->data, k_magic, sizeof(k_magic)) != 0 || *r->end != SNAP_END ||
+        crc32c(0, r->data, size - 4) != crc)
+    {
+        snap_close(r);
+        return SNAP_CORRUPT;
+    }
+    return SNAP_OK;
+}
+
+static bool r_varint(SnapReader *r, uint64_t *out)
+{
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && r->cur < r->end; shift += 7)
+    {
+        uint8_t b = *r->cur++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            *out = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool r_bytes(SnapReader *r, size_t len, const uint8_t **out)
+{
+    if (len > (size_t)(r->end - r->cur))
+    {
+        return false;
+    }
+    *out = r->cur;
+    r->cur += len;
+    return true;
+}
+
+static bool r_str(SnapReader *r, std::string_view *out)
+{
+    uint64_t len = 0;
+    const uint8_t *p = NULL;
+    if (!r_varint(r, &len) || !r_bytes(r, len, &p))
+    {
+        return false;
+    }
+    *out = std::string_view((const char *)p, len);
+    return true;
+}
+
+bool snap_next(SnapReader *r, SnapRecord *rec, int *err)
+{
+    *err = SNAP_OK;
+    if (r->cur == r->end)
+    {
+        return false;
+    }
+    const uint8_t *p = NULL;
+    rec->type = *r->cur++;
+    uint8_t kind = rec->type & 0x0f;
+    rec->expire_at_ms = -1;
+    rec->raw_len = rec->n = 0;
+    uint64_t v = 0;
+    bool ok = kind == SNAP_STR || kind == SNAP_ZSET;
+    if (ok && (rec->type & SNAP_F_TTL))
+    {
+        ok = r_bytes(r, 8, &p);
+        if (ok)
+        {
+            memcpy(&v, p, 8);
+            rec->expire_at_ms = (int64_t)v;
+        }
+    }
+    ok = ok && r_str(r, &rec->key);
+    if (ok && kind == SNAP_STR)
+    {
+        if (rec->type & SNAP_F_LZ4)
+        {
+            ok = r_varint(r, &v) && v > 0;
+            rec->raw_len = v;
+        }
+        ok = ok && r_str(r, &rec->val);
+    }
+    else if (ok)
+    {
+        ok = r_varint(r, &v) && v <= (size_t)(r->end - r->cur); // at least a byte each
+        rec->n = v;
+    }
+    if (!ok)
+    {
+        *err = SNAP_CORRUPT;
+    }
+    return ok;
+}
+
+bool snap_next_member(SnapReader *r, std::string_view *name, double *score)
+{
+    const uint8_t *p = NULL;
+    if (!r_str(r, name) || !r_bytes(r, 8, &p))
+    {
+        return false;
+    }
+    memcpy(score, p, 8);
+    return true;
+}
+
+bool snap_done(SnapReader *r)
+{
+    return r->cur == r->end;
+}
+
+void snap_close(SnapReader *r)
+{
+    if (r->data)
+    {
+        munmap((void *)r->data, r->size);
+    }
+    *r = SnapReader{};
+}
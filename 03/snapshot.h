@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+// A snapshot file is the 8-byte magic "KVSNAP01" and a sequence of
+// records, then an end byte and the CRC-32C of everything before the CRC.
+// A record is a type byte with flags, the expiry as 8 bytes of unix time
+// in ms if it has one, and the key; then for a string its value, prefixed
+// by the uncompressed length if it is LZ4 compressed, and for a zset the
+// member count and each member's name and 8-byte score. Lengths and counts
+// are LEB128 varints.
+enum
+{
+    SNAP_STR = 1,
+    SNAP_ZSET = 2,
+    SNAP_END = 0xff,
+    // flags in the type byte
+    SNAP_F_TTL = 0x10,
+    SNAP_F_LZ4 = 0x20,
+};
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len);
+
+// writes to `<path>.tmp`, renamed over `path` by snap_finish()
+struct SnapWriter
+{
+    int fd = -1;
+    std::vector<uint8_t> buf;
+    uint32_t crc = 0;
+    size_t bytes = 0; // written so far
+    bool failed = false;
+};
+
+bool snap_create(SnapWriter *w, const char *path);
+// expire_at_ms < 0 for no TTL; raw_len > 0 if `val` is LZ4 compressed
+void snap_put_str(SnapWriter *w, std::string_view key, int64_t expire_at_ms,
+                  std::string_view val, size_t raw_len);
+// followed by exactly `n` snap_put_member() calls
+void snap_put_zset(SnapWriter *w, std::string_view key, int64_t expire_at_ms, size_t n);
+void snap_put_member(SnapWriter *w, std::string_view name, double score);
+// write the end and the checksum, fsync, and rename; false on any error,
+// which leaves the old file in place
+bool snap_finish(SnapWriter *w, const char *path);
+// on errors before snap_finish()
+void snap_abort(SnapWriter *w, const char *path);
+
+// a file mapped into memory and checked before any record is read
+struct SnapReader
+{
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    const uint8_t *cur = NULL;
+    const uint8_t *end = NULL; // the end byte
+};
+
+enum
+{
+    SNAP_OK = 0,
+    SNAP_MISSING = 1, // no file
+    SNAP_CORRUPT = 2, // bad magic, checksum, or record
+    SNAP_IOERR = 3,
+};
+
+struct SnapRecord
+{
+    uint8_t type = 0;
+    int64_t expire_at_ms = -1;
+    std::string_view key;
+    std::string_view val; // SNAP_STR
+    size_t raw_len = 0;   // SNAP_STR with SNAP_F_LZ4
+    size_t n = 0;         // SNAP_ZSET members, read by snap_next_member()
+};
+
+int snap_open(SnapReader *r, const char *path);
+// the next record; false at the end, or with `*err` set for bad input
+bool snap_next(SnapReader *r, SnapRecord *rec, int *err);
+bool snap_next_member(SnapReader *r, std::string_view *name, double *score);
+// true if every record was read
+bool snap_done(SnapReader *r);
+void snap_close(SnapReader *r);
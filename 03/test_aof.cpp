@@ -0,0 +1,165 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include "aof.h"
+
+static const char *k_path = "test_aof.aof";
+
+static std::string read_file(const char *path)
+{
+    std::string data;
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    char buf[4096];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+    {
+        data.append(buf, n);
+    }
+    fclose(f);
+    return data;
+}
+
+static void append(Aof *aof, const std::string &s)
+{
+    aof_append(aof, (const uint8_t *)s.data(), s.size());
+}
+
+// wait for the sync thread to make `pos` durable
+static bool wait_synced(Aof *aof, uint64_t pos, int timeout_ms)
+{
+    for (int waited = 0; aof->synced.load() < pos; waited += 10)
+    {
+        if (waited >= timeout_ms)
+        {
+            return false;
+        }
+        struct pollfd pfd = {aof->done_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 10) > 0)
+        {
+            aof_poll_done(aof);
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    unlink(k_path);
+    Aof aof;
+    aof_init(&aof);
+    assert(aof_open(&aof, k_path));
+
+    // records are buffered until the flush, which writes them in order
+    append(&aof, "one;");
+    append(&aof, "two;");
+    assert(aof_pos(&aof) == 8 && aof.written == 0 && read_file(k_path).empty());
+    assert(aof_flush(&aof));
+    assert(aof.written == 8 && aof.file_size == 8 && read_file(k_path) == "one;two;");
+
+    // always: every flush asks for a sync
+    aof.policy = AOF_FSYNC_ALWAYS;
+    append(&aof, "three;");
+    uint64_t pos = aof_pos(&aof);
+    assert(aof_flush(&aof));
+    assert(wait_synced(&aof, pos, 2000));
+
+    // everysec: many flushes share one sync, about a second later
+    aof.policy = AOF_FSYNC_EVERYSEC;
+    size_t fsyncs = aof.fsyncs.load();
+    for (int i = 0; i < 50; i++)
+    {
+        append(&aof, "x");
+        assert(aof_flush(&aof));
+        usleep(5000);
+    }
+    pos = aof_pos(&aof);
+    assert(aof.synced.load() < pos);
+    assert(wait_synced(&aof, pos, 3000));
+    assert(aof.fsyncs.load() - fsyncs <= 2);
+
+    // no: left to the OS
+    aof.policy = AOF_FSYNC_NO;
+    append(&aof, "four;");
+    pos = aof_pos(&aof);
+    assert(aof_flush(&aof));
+    assert(!wait_synced(&aof, pos, 1300));
+
+    // closing syncs; reopening appends, with positions carrying on
+    aof_close(&aof);
+    assert(aof.synced.load() == pos);
+    std::string before = read_file(k_path);
+    assert(aof_open(&aof, k_path) && aof.file_size == before.size());
+    append(&aof, "five;");
+    assert(aof_flush(&aof) && aof_pos(&aof) == pos + 5);
+    assert(read_file(k_path) == before + "five;");
+
+    // a rewrite: the child's file, then what was logged meanwhile
+    std::string tmp = std::string(k_path) + ".tmp";
+    aof_rewrite_begin(&aof);
+    append(&aof, "six;");
+    assert(aof_flush(&aof));
+    AofWriter w;
+    assert(aofw_create(&w, k_path));
+    std::string_view set[] = {"set", "k", "v"};
+    aofw_put(&w, set, 3);
+    assert(aofw_finish(&w, k_path) && w.bytes == 25);
+    append(&aof, "seven;");
+    std::string cmd("\x15\0\0\0\x03\0\0\0\x03\0\0\0set\x01\0\0\0k\x01\0\0\0v", 25);
+    assert(read_file(tmp.c_str()) == cmd);
+    aof.policy = AOF_FSYNC_ALWAYS;
+    pos = aof_pos(&aof);
+    assert(aof_rewrite_end(&aof, k_path));
+    assert(!aof.rewriting && aof.synced.load() == pos && access(tmp.c_str(), F_OK) != 0);
+    assert(read_file(k_path) == cmd + "six;seven;" && aof.file_size == 35);
+    append(&aof, "eight;");
+    pos = aof_pos(&aof);
+    assert(aof_flush(&aof) && wait_synced(&aof, pos, 2000));
+    assert(read_file(k_path) == cmd + "six;seven;eight;" && aof.file_size == 41);
+
+    // an aborted rewrite leaves the log as it was
+    aof_rewrite_begin(&aof);
+    assert(aofw_create(&w, k_path));
+    append(&aof, "nine;");
+    aof_rewrite_abort(&aof, k_path);
+    assert(!aof.rewriting && aof.rewrite_buf.empty() && access(tmp.c_str(), F_OK) != 0);
+    assert(aof_flush(&aof) && read_file(k_path) == cmd + "six;seven;eight;nine;");
+
+    // with no file open, the rewrite creates it
+    aof_close(&aof);
+    unlink(k_path);
+    aof_rewrite_begin(&aof);
+    assert(aof_logging(&aof));
+    append(&aof, "ten;");
+    assert(aofw_create(&w, k_path) && aofw_finish(&w, k_path));
+    assert(aof_rewrite_end(&aof, k_path) && aof.fd >= 0);
+    append(&aof, "eleven;");
+    assert(aof_flush(&aof) && read_file(k_path) == "ten;eleven;" && aof.file_size == 11);
+
+    // a failed sync (/dev/null has none) is reported and leaves `synced`
+    // behind; it is retried a second later
+    aof_close(&aof);
+    assert(aof_open(&aof, "/dev/null"));
+    size_t errors = aof.fsync_errors.load();
+    append(&aof, "twelve;");
+    pos = aof_pos(&aof);
+    assert(aof_flush(&aof));
+    assert(!wait_synced(&aof, pos, 300));
+    assert(aof.fsync_error.load() && aof.fsync_errno.load() == EINVAL);
+    assert(aof.fsync_errors.load() == errors + 1);
+    assert(!wait_synced(&aof, pos, 1500) && aof.fsync_errors.load() == errors + 2);
+    // a good file clears it
+    aof_close(&aof);
+    assert(aof_open(&aof, k_path) && !aof.fsync_error.load());
+    append(&aof, "thirteen;");
+    pos = aof_pos(&aof);
+    assert(aof_flush(&aof) && wait_synced(&aof, pos, 2000) && !aof.fsync_error.load());
+
+    aof_destroy(&aof);
+    unlink(k_path);
+    return 0;
+}
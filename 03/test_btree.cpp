@@ -0,0 +1,169 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "btree.h"
+
+struct Data
+{
+    double score = 0;
+    std::string name;
+};
+
+typedef std::pair<double, std::string> Ref;
+
+static int tie(void *ref, const char *name, size_t len)
+{
+    const std::string &a = ((Data *)ref)->name;
+    int rv = memcmp(a.data(), name, a.size() < len ? a.size() : len);
+    if (rv != 0)
+    {
+        return rv;
+    }
+    return a.size() < len ? -1 : (a.size() > len ? 1 : 0);
+}
+
+static BTTarget target(const Ref &r)
+{
+    return BTTarget{r.first, r.second.data(), r.second.size()};
+}
+
+static Ref ref_at(const BTPos &pos)
+{
+    Data *d = (Data *)bt_ref(pos);
+    return Ref(d->score, d->name);
+}
+
+static void del(void *ref)
+{
+    delete (Data *)ref;
+}
+
+// full in-order walk, forward and backward
+static void verify(BTree &tree, const std::set<Ref> &ref)
+{
+    assert(tree.size == ref.size());
+    BTPos pos;
+    if (!bt_at(&tree, 0, &pos))
+    {
+        assert(ref.empty());
+        return;
+    }
+    size_t n = 0;
+    for (auto it = ref.begin(); it != ref.end(); ++it, ++n)
+    {
+        assert(ref_at(pos) == *it);
+        assert(bt_next(&pos) == (n + 1 < ref.size()));
+    }
+    bt_at(&tree, ref.size() - 1, &pos);
+    for (auto it = ref.rbegin(); it != ref.rend(); ++it)
+    {
+        assert(ref_at(pos) == *it);
+        bt_prev(&pos);
+    }
+}
+
+// bulk load, then keep updating the loaded tree
+static void test_build(size_t n)
+{
+    BTree tree;
+    tree.tie = &tie;
+    std::set<Ref> ref;
+    for (size_t i = 0; i < n; i++)
+    {
+        ref.insert(Ref(rand() % 100, std::to_string(i)));
+    }
+    std::vector<BTKey> keys;
+    for (const Ref &r : ref)
+    {
+        keys.push_back(BTKey{r.first, new Data{r.first, r.second}});
+    }
+    bt_build(&tree, keys.data(), keys.size());
+    verify(tree, ref);
+    for (size_t i = 0; i < n; i++)
+    {
+        Ref r(rand() % 100, std::to_string(rand() % (2 * n)));
+        if (ref.count(r))
+        {
+            BTPos pos;
+            bt_seekge(&tree, target(r), &pos);
+            Data *d = (Data *)bt_ref(pos);
+            assert(bt_delete(&tree, target(r)));
+            delete d;
+            ref.erase(r);
+        }
+        else
+        {
+            Data *d = new Data{r.first, r.second};
+            bt_insert(&tree, BTKey{d->score, d}, target(r));
+            ref.insert(r);
+        }
+    }
+    verify(tree, ref);
+    bt_clear(&tree, &del);
+}
+
+int main()
+{
+    for (size_t n : {0, 1, 31, 32, 33, 1000, 40000})
+    {
+        test_build(n);
+    }
+
+    BTree tree;
+    tree.tie = &tie;
+    std::set<Ref> ref;
+    for (int i = 0; i < 100000; i++)
+    {
+        // few distinct scores so that names break most ties
+        Ref r(rand() % 8, std::to_string(rand() % 3000));
+        if (rand() % 5 < 3)
+        {
+            if (!ref.count(r))
+            {
+                Data *d = new Data{r.first, r.second};
+                bt_insert(&tree, BTKey{d->score, d}, target(r));
+                ref.insert(r);
+            }
+        }
+        else
+        {
+            BTPos pos;
+            bt_seekge(&tree, target(r), &pos);
+            bool found = pos.leaf && ref_at(pos) == r;
+            assert(found == (ref.count(r) == 1));
+            Data *d = found ? (Data *)bt_ref(pos) : NULL;
+            assert(bt_delete(&tree, target(r)) == found);
+            delete d;
+            ref.erase(r);
+        }
+
+        // seek and rank against the reference
+        Ref probe(rand() % 8, std::to_string(rand() % 3000));
+        BTPos pos;
+        size_t rank = bt_seekge(&tree, target(probe), &pos);
+        auto it = ref.lower_bound(probe);
+        if (i % 32 == 0)
+        {
+            assert(rank == (size_t)std::distance(ref.begin(), it));
+        }
+        assert((it == ref.end()) == (pos.leaf == NULL));
+        if (pos.leaf)
+        {
+            assert(ref_at(pos) == *it);
+            BTPos at;
+            assert(bt_at(&tree, rank, &at) && at.leaf == pos.leaf && at.idx == pos.idx);
+        }
+        if (i % 1000 == 0)
+        {
+            verify(tree, ref);
+        }
+    }
+    verify(tree, ref);
+    bt_clear(&tree, &del);
+    assert(!tree.root && tree.size == 0);
+    return 0;
+}
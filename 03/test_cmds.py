@@ -1,8 +1,14 @@
 #!/usr/bin/env python3
 
+import os
 import shlex
+import shutil
+import socket
+import struct
 import subprocess
 import sys
+import tempfile
+import time
 
 CASES = r'''
 $ ./client zscore asdf n1
@@ -42,6 +48,20 @@ $ ./client zquery zset 1 "" 0 10
 (str) n2
 (dbl) 2
 (arr) end
+$ ./client scan 0 match "k*" count 100
+(arr) len=2
+(int) 0
+(arr) len=0
+(arr) end
+(arr) end
+$ ./client scan x
+(err) 4 expect int
+$ ./client scan 0 match "none*" count 9223372036854775807
+(arr) len=2
+(int) 0
+(arr) len=0
+(arr) end
+(arr) end
 # EDGE CASES
 $ ./client zadd z1 not-a-number a
 (err) 4 expect float
@@ -60,6 +80,588 @@ $ ./client get key1
 (nil)
 '''
 
+# Tests that ./client cannot express, such as requests with thousands of
+# arguments or several clients at once, talk to the server over a socket.
+class Client:
+    def __init__(self, port=8080):
+        self.sock = socket.create_connection(('127.0.0.1', port))
+        # a missed wake-up fails the test instead of hanging it
+        self.sock.settimeout(10)
+
+    def __call__(self, *args):
+        self.send(*args)
+        return self.reply()
+
+    def send(self, *args):
+        args = [a if isinstance(a, bytes) else str(a).encode() for a in args]
+        body = struct.pack('<I', len(args))
+        body += b''.join(struct.pack('<I', len(a)) + a for a in args)
+        self.sock.sendall(struct.pack('<I', len(body)) + body)
+
+    def reply(self):
+        n = struct.unpack('<I', self.read(4))[0]
+        val, _ = decode(self.read(n), 0)
+        return val
+
+    def read(self, n):
+        data = b''
+        while len(data) < n:
+            chunk = self.sock.recv(n - len(data))
+            if not chunk:
+                raise EOFError('connection closed')
+            data += chunk
+        return data
+
+    def close(self):
+        self.sock.close()
+
+# a reply as None, ('err', code, msg), str, int, float or list
+def decode(data, i):
+    tag = data[i]
+    i += 1
+    if tag == 0:
+        return None, i
+    if tag == 1:
+        code, n = struct.unpack_from('<II', data, i)
+        i += 8
+        return ('err', code, data[i:i + n].decode()), i + n
+    if tag == 2:
+        n = struct.unpack_from('<I', data, i)[0]
+        i += 4
+        return data[i:i + n].decode(), i + n
+    if tag == 3:
+        return struct.unpack_from('<q', data, i)[0], i + 8
+    if tag == 4:
+        return struct.unpack_from('<d', data, i)[0], i + 8
+    n = struct.unpack_from('<I', data, i)[0]
+    i += 4
+    out = []
+    for _ in range(n):
+        val, i = decode(data, i)
+        out.append(val)
+    return out, i
+
+SOCKET_TESTS = []
+
+def socket_test(f):
+    SOCKET_TESTS.append(f)
+    return f
+
+def expect(got, want):
+    if got != want:
+        raise AssertionError(f'expected {want!r}, got {got!r}')
+
+def zadd_many(c, key, members):
+    # members as {name: score}, in requests of 1000
+    items = list(members.items())
+    for i in range(0, len(items), 1000):
+        args = []
+        for name, score in items[i:i + 1000]:
+            args += [repr(score), name]
+        c('zadd', key, *args)
+
+def zrange_all(c, key):
+    flat = c('zrange', key, 0, -1, 'withscores')
+    return list(zip(flat[::2], flat[1::2]))
+
+def by_score(members):
+    return sorted(members.items(), key=lambda kv: (kv[1], kv[0]))
+
+@socket_test
+def test_zstore():
+    c = Client()
+    c('unlink', 'zs:a', 'zs:b', 'zs:u', 'zs:i', 'zs:d')
+    c('zadd', 'zs:a', 1, 'x', 2, 'y', 3, 'z')
+    c('zadd', 'zs:b', 10, 'y', 20, 'z', 30, 'w')
+    expect(c('zunionstore', 'zs:u', 2, 'zs:a', 'zs:b', 'weights', 2, 1), 4)
+    expect(zrange_all(c, 'zs:u'), [('x', 2.0), ('y', 14.0), ('z', 26.0), ('w', 30.0)])
+    expect(c('zinterstore', 'zs:i', 2, 'zs:a', 'zs:b', 'aggregate', 'max'), 2)
+    expect(zrange_all(c, 'zs:i'), [('y', 10.0), ('z', 20.0)])
+    expect(c('zinterstore', 'zs:i', 2, 'zs:a', 'zs:b', 'weights', 1, 0.5, 'aggregate', 'min'), 2)
+    expect(zrange_all(c, 'zs:i'), [('y', 2.0), ('z', 3.0)])
+    expect(c('zunionstore', 'zs:u', 2, 'zs:a', 'zs:b', 'aggregate', 'min'), 4)
+    expect(zrange_all(c, 'zs:u'), [('x', 1.0), ('y', 2.0), ('z', 3.0), ('w', 30.0)])
+    expect(c('zdiffstore', 'zs:d', 2, 'zs:a', 'zs:b'), 1)
+    expect(zrange_all(c, 'zs:d'), [('x', 1.0)])
+    # an empty result removes the destination
+    expect(c('zinterstore', 'zs:d', 2, 'zs:a', 'zs:missing'), 0)
+    expect(c('zcard', 'zs:d'), 0)
+    expect(c('get', 'zs:d'), None)
+    # the destination may be one of the inputs
+    expect(c('zunionstore', 'zs:a', 2, 'zs:a', 'zs:b'), 4)
+    expect(zrange_all(c, 'zs:a'), [('x', 1.0), ('y', 12.0), ('z', 23.0), ('w', 30.0)])
+    expect(c('zinterstore', 'zs:b', 2, 'zs:b', 'zs:a', 'weights', 1, -1), 3)
+    expect(zrange_all(c, 'zs:b'), [('z', -3.0), ('y', -2.0), ('w', 0.0)])
+    expect(c('zdiffstore', 'zs:a', 2, 'zs:a', 'zs:b'), 1)
+    expect(zrange_all(c, 'zs:a'), [('x', 1.0)])
+    # errors
+    expect(c('zunionstore', 'zs:u', 2, 'zs:a', 'zs:b', 'weights', 1)[:2], ('err', 4))
+    expect(c('zunionstore', 'zs:u', 1, 'zs:a', 'aggregate', 'avg')[:2], ('err', 4))
+    expect(c('zdiffstore', 'zs:u', 1, 'zs:a', 'weights', 2)[:2], ('err', 4))
+    c('set', 'zs:str', 'v')
+    expect(c('zunionstore', 'zs:u', 2, 'zs:a', 'zs:str')[:2], ('err', 3))
+    c('unlink', 'zs:a', 'zs:b', 'zs:u', 'zs:i', 'zs:d', 'zs:str')
+    c.close()
+
+@socket_test
+def test_zstore_parallel():
+    # inputs of 65536 members or more in total are merged on the thread pool
+    c = Client()
+    c('unlink', 'zp:a', 'zp:b', 'zp:u', 'zp:i', 'zp:d')
+    a = {'m%06d' % i: float(i) for i in range(0, 60000)}
+    b = {'m%06d' % i: float(2 * i) for i in range(30000, 90000)}
+    zadd_many(c, 'zp:a', a)
+    zadd_many(c, 'zp:b', b)
+    union = dict(a)
+    for name, score in b.items():
+        union[name] = union.get(name, 0) + 3 * score
+    expect(c('zunionstore', 'zp:u', 2, 'zp:a', 'zp:b', 'weights', 1, 3), len(union))
+    expect(zrange_all(c, 'zp:u'), by_score(union))
+    inter = {name: max(a[name], b[name]) for name in a if name in b}
+    expect(c('zinterstore', 'zp:i', 2, 'zp:b', 'zp:a', 'aggregate', 'max'), len(inter))
+    expect(zrange_all(c, 'zp:i'), by_score(inter))
+    diff = {name: score for name, score in a.items() if name not in b}
+    expect(c('zdiffstore', 'zp:d', 2, 'zp:a', 'zp:b'), len(diff))
+    expect(zrange_all(c, 'zp:d'), by_score(diff))
+    # in place, with the destination among the inputs
+    expect(c('zunionstore', 'zp:a', 2, 'zp:a', 'zp:b', 'weights', 1, 3), len(union))
+    expect(zrange_all(c, 'zp:a'), by_score(union))
+    c('unlink', 'zp:a', 'zp:b', 'zp:u', 'zp:i', 'zp:d')
+    c.close()
+
+@socket_test
+def test_zlex():
+    c = Client()
+    c('unlink', 'zl')
+    c('zadd', 'zl', *[a for name in 'abcdefg' for a in (0, name)])
+    expect(c('zlexcount', 'zl', '-', '+'), 7)
+    expect(c('zlexcount', 'zl', '[b', '[d'), 3)
+    expect(c('zlexcount', 'zl', '(b', '[d'), 2)
+    expect(c('zlexcount', 'zl', '(b', '(d'), 1)
+    expect(c('zlexcount', 'zl', '[d', '[b'), 0)
+    expect(c('zlexcount', 'zl', '(bb', '[cc'), 1)
+    expect(c('zrangebylex', 'zl', '-', '[c'), ['a', 'b', 'c'])
+    expect(c('zrangebylex', 'zl', '-', '(c'), ['a', 'b'])
+    expect(c('zrangebylex', 'zl', '[e', '+'), ['e', 'f', 'g'])
+    expect(c('zrangebylex', 'zl', '(e', '+'), ['f', 'g'])
+    expect(c('zrangebylex', 'zl', '[x', '+'), [])
+    expect(c('zrangebylex', 'zl', '+', '-'), [])
+    expect(c('zrangebylex', 'zl', '-', '+', 'limit', 2, 3), ['c', 'd', 'e'])
+    expect(c('zrangebylex', 'zl', '-', '+', 'limit', 5, 10), ['f', 'g'])
+    expect(c('zrangebylex', 'zl', '-', '+', 'limit', 10, 1), [])
+    expect(c('zrangebylex', 'zl', '(a', '(g', 'limit', 0, -1), ['b', 'c', 'd', 'e', 'f'])
+    expect(c('zrevrangebylex', 'zl', '+', '-'), list('gfedcba'))
+    expect(c('zrevrangebylex', 'zl', '[e', '(b'), ['e', 'd', 'c'])
+    expect(c('zrevrangebylex', 'zl', '+', '-', 'limit', 1, 2), ['f', 'e'])
+    expect(c('zrevrangebylex', 'zl', '(c', '-', 'limit', 1, 5), ['a'])
+    expect(c('zrangebylex', 'zl', 'b', '+')[:2], ('err', 4))
+    expect(c('zrangebylex', 'zl', '-', '+', 'limit', -1, 1)[:2], ('err', 4))
+    expect(c('zlexcount', 'zl', '[a', 'c')[:2], ('err', 4))
+    expect(c('zremrangebylex', 'zl', '(b', '[d'), 2)
+    expect(c('zrangebylex', 'zl', '-', '+'), ['a', 'b', 'e', 'f', 'g'])
+    expect(c('zremrangebylex', 'zl', '(g', '+'), 0)
+    expect(c('zremrangebylex', 'zl', '-', '+'), 5)
+    expect(c('zcard', 'zl'), 0)
+    c.close()
+
+@socket_test
+def test_zstore_concurrent():
+    # a big store is merged on the thread pool while the loop keeps serving;
+    # writes to its inputs wait for it, and an input that is deleted or
+    # replaced meanwhile makes it start over
+    c1, c2, c3 = Client(), Client(), Client()
+    c1('unlink', 'zc:a', 'zc:b', 'zc:u')
+    a = {'m%06d' % i: float(i) for i in range(0, 100000)}
+    b = {'m%06d' % i: float(i) for i in range(50000, 150000)}
+    zadd_many(c1, 'zc:a', a)
+    zadd_many(c1, 'zc:b', b)
+    union = {name: a.get(name, 0) + b.get(name, 0) for name in {**a, **b}}
+    c1.send('zunionstore', 'zc:u', 2, 'zc:a', 'zc:b')
+    c2.send('zadd', 'zc:a', -1, 'extra')
+    expect(c3('get', 'zc:none'), None)
+    n = c1.reply()
+    expect(c2.reply(), 1)
+    if n == len(union):
+        expect(zrange_all(c3, 'zc:u'), by_score(union))
+    else:
+        union['extra'] = -1.0
+        expect(zrange_all(c3, 'zc:u'), by_score(union))
+    a['extra'] = -1.0
+    c1.send('zunionstore', 'zc:u', 2, 'zc:a', 'zc:b')
+    expect(c2('unlink', 'zc:b'), 1)
+    n = c1.reply()
+    if n == len(a):
+        expect(zrange_all(c3, 'zc:u'), by_score(a))
+    else:
+        expect(n, len(union))
+    c3('unlink', 'zc:a', 'zc:u')
+    for c in (c1, c2, c3):
+        c.close()
+
+def zremrange_model(c, backend):
+    expect(c('config', 'set', 'zset-backend', backend), '1')
+    c('unlink', 'zr')
+    # tied scores, so ranges split runs of equal scores by name
+    model = [('m%04d' % i, float(i // 2)) for i in range(2000)]
+    zadd_many(c, 'zr', dict(model))
+
+    def by_rank(start, stop, want):
+        nonlocal model
+        size = len(model)
+        lo = max(start + size if start < 0 else start, 0)
+        hi = (stop + size if stop < 0 else stop) + 1
+        gone = model[lo:hi] if lo < hi else []
+        model = [m for m in model if m not in gone]
+        expect(c('zremrangebyrank', 'zr', start, stop), want)
+        expect(len(gone), want)
+        expect(zrange_all(c, 'zr'), model)
+
+    def by_score(lo, hi, inside, want):
+        nonlocal model
+        gone = [m for m in model if inside(m[1])]
+        model = [m for m in model if not inside(m[1])]
+        expect(c('zremrangebyscore', 'zr', lo, hi), want)
+        expect(len(gone), want)
+        expect(zrange_all(c, 'zr'), model)
+
+    by_rank(-5, -1, 5)
+    by_rank(100, 50, 0)
+    by_rank(5000, 6000, 0)
+    by_rank(-10000, 2, 3)
+    by_rank(0, 0, 1)
+    by_score('(10', '(20', lambda x: 10 < x < 20, 18)
+    by_score('30', '(40', lambda x: 30 <= x < 40, 20)
+    by_score('(50', '50', lambda x: False, 0)
+    by_score('60', '60', lambda x: x == 60, 2)
+    by_score('(990', 'inf', lambda x: x > 990, 13)
+    # more than a quarter of the members: the btree rebuilds its index
+    by_rank(100, -100, len(model) - 199)
+    by_score('-inf', '(5', lambda x: x < 5, 6)
+    expect(c('zrank', 'zr', model[50][0]), 50)
+    expect(c('zscore', 'zr', model[-1][0]), model[-1][1])
+    by_score('(1', 'inf', lambda x: x > 1, len(model))
+    expect(c('zcard', 'zr'), 0)
+    model = [('a', 1.0), ('b', 2.0)]
+    c('zadd', 'zr', 1, 'a', 2, 'b')
+    by_rank(0, -1, 2)
+    expect(c('zremrangebyrank', 'zr', 'a', 1)[:2], ('err', 4))
+    expect(c('zremrangebyscore', 'zr', '(x', 1)[:2], ('err', 4))
+
+@socket_test
+def test_zremrange_avl():
+    c = Client()
+    zremrange_model(c, 'avl')
+    c.close()
+
+@socket_test
+def test_zremrange_btree():
+    c = Client()
+    try:
+        zremrange_model(c, 'btree')
+    finally:
+        c('config', 'set', 'zset-backend', 'avl')
+        c('unlink', 'zr')
+        c.close()
+
+@socket_test
+def test_zpop():
+    c = Client()
+    c('unlink', 'zq')
+    c('zadd', 'zq', 1, 'a', 2, 'b', 3, 'c', 4, 'd')
+    expect(c('zpopmin', 'zq'), ['a', 1.0])
+    expect(c('zpopmax', 'zq', 2), ['d', 4.0, 'c', 3.0])
+    expect(c('zpopmin', 'zq', 0), [])
+    expect(c('zpopmin', 'zq', -1)[:2], ('err', 4))
+    expect(c('zpopmax', 'zq', 10), ['b', 2.0])
+    expect(c('zcard', 'zq'), 0)
+    expect(c('zpopmin', 'zq'), [])
+    c('unlink', 'zq')
+    expect(c('zpopmin', 'zq'), [])
+    c('set', 'zq', 'v')
+    expect(c('zpopmin', 'zq')[:2], ('err', 3))
+    c('unlink', 'zq')
+    c.close()
+
+@socket_test
+def test_bzpop():
+    c1, c2, c3 = Client(), Client(), Client()
+    c1('unlink', 'bz:a', 'bz:b')
+    # a non-empty zset is popped at once
+    c1('zadd', 'bz:b', 1, 'x')
+    expect(c1('bzpopmin', 'bz:a', 'bz:b', 0), ['bz:b', 'x', 1.0])
+    # nothing to pop: nil once the timeout expires
+    start = time.monotonic()
+    expect(c1('bzpopmin', 'bz:a', 'bz:b', 0.2), None)
+    elapsed = time.monotonic() - start
+    if not 0.15 <= elapsed < 2:
+        raise AssertionError(f'timed out after {elapsed:.3f}s')
+    expect(c1('bzpopmin', 'bz:a', -1)[:2], ('err', 4))
+    # a ZADD from another client wakes the blocked one
+    c1.send('bzpopmax', 'bz:a', 'bz:b', 0)
+    time.sleep(0.1)
+    expect(c2('zadd', 'bz:b', 5, 'x', 7, 'y'), 2)
+    expect(c1.reply(), ['bz:b', 'y', 7.0])
+    expect(zrange_all(c2, 'bz:b'), [('x', 5.0)])
+    c2('unlink', 'bz:b')
+    # waiters are served one member each, longest waiting first
+    c1.send('bzpopmin', 'bz:a', 5)
+    time.sleep(0.05)
+    c3.send('bzpopmin', 'bz:a', 5)
+    time.sleep(0.05)
+    expect(c2('zadd', 'bz:a', 1, 'p'), 1)
+    expect(c1.reply(), ['bz:a', 'p', 1.0])
+    expect(c2('zadd', 'bz:a', 2, 'q', 3, 'r'), 2)
+    expect(c3.reply(), ['bz:a', 'q', 2.0])
+    expect(zrange_all(c2, 'bz:a'), [('r', 3.0)])
+    c2('unlink', 'bz:a')
+    for c in (c1, c2, c3):
+        c.close()
+
+@socket_test
+def test_zrange_offload_write():
+    # a big range is serialized on the thread pool; writes to the zset wait
+    # for it without holding up the other clients
+    c1, c2, c3, c4 = Client(), Client(), Client(), Client()
+    c1('unlink', 'zo')
+    zadd_many(c1, 'zo', {'m%06d' % i: float(i) for i in range(200000)})
+    c1.send('zrange', 'zo', 0, -1, 'withscores')
+    c2.send('zadd', 'zo', -1, 'new')
+    c4.send('zrem', 'zo', 'm000001')
+    c4.close()
+    expect(c3('get', 'zo:none'), None)
+    got = c1.reply()
+    if len(got) == 400000:
+        expect(got[:2], ['m000000', 0.0])
+    else:
+        expect(got[:2], ['new', -1.0])
+    expect(c2.reply(), 1)
+    # the ZREM ran, or was dropped with its connection while parked
+    removed = c3('zscore', 'zo', 'm000001') is None
+    expect(c3('zcard', 'zo'), 200001 - removed)
+    expect(c3('zrange', 'zo', 0, 0), ['new'])
+    c3('unlink', 'zo')
+    for c in (c1, c2, c3):
+        c.close()
+
+# Restart tests run their own server, in a scratch directory for its files.
+TEST_PORT = 8090
+
+class Server:
+    def __init__(self, workdir, *args):
+        cmd = [os.path.abspath('./server'), '--port', str(TEST_PORT), *args]
+        self.proc = subprocess.Popen(cmd, cwd=workdir,
+                                     stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        for _ in range(100):
+            try:
+                self.client = Client(TEST_PORT)
+                return
+            except ConnectionRefusedError:
+                time.sleep(0.05)
+        self.proc.kill()
+        raise AssertionError('the server did not start')
+
+    def crash(self):
+        self.client.close()
+        self.proc.kill()
+        self.proc.wait()
+
+def info(c):
+    flat = c('info')
+    return dict(zip(flat[::2], flat[1::2]))
+
+def wait_info(c, name, value, timeout=10):
+    end = time.monotonic() + timeout
+    while info(c)[name] != value:
+        if time.monotonic() > end:
+            raise AssertionError(f'{name} is not {value}')
+        time.sleep(0.02)
+
+def restart_test(f):
+    def run():
+        workdir = tempfile.mkdtemp(prefix='kvs-test-')
+        try:
+            f(workdir)
+        finally:
+            shutil.rmtree(workdir)
+    run.__name__ = f.__name__
+    return socket_test(run)
+
+@restart_test
+def test_snapshot_restart(workdir):
+    srv = Server(workdir)
+    c = srv.client
+    c('set', 's1', 'v1')
+    c('set', 'empty', '')
+    c('zadd', 'z', 1, 'a', 2.5, 'b', -3, 'c')
+    big = {'m%05d' % i: i / 4 for i in range(20000)}
+    zadd_many(c, 'zbig', big)
+    c('set', 't1', 'v')
+    c('pexpire', 't1', 100000)
+    c('zadd', 'zt', 1, 'x')
+    c('pexpire', 'zt', 200000)
+    c('set', 'short', 'v')
+    c('pexpire', 'short', 300)
+    expect(c('save'), '1')
+    srv.crash()
+    # a key whose TTL ran out while the server was down is not loaded
+    time.sleep(0.4)
+    srv = Server(workdir)
+    c = srv.client
+    expect(c('get', 's1'), 'v1')
+    expect(c('get', 'empty'), '')
+    expect(zrange_all(c, 'z'), [('c', -3.0), ('a', 1.0), ('b', 2.5)])
+    expect(zrange_all(c, 'zbig'), by_score(big))
+    if not 90000 < c('pttl', 't1') <= 100000:
+        raise AssertionError(f"pttl t1 is {c('pttl', 't1')}")
+    if not 190000 < c('pttl', 'zt') <= 200000:
+        raise AssertionError(f"pttl zt is {c('pttl', 'zt')}")
+    expect(c('get', 'short'), None)
+    expect(c('pttl', 's1'), -1)
+
+    # BGSAVE: the child writes the keyspace as of the fork
+    c('set', 's2', 'v2')
+    c('zadd', 'z', 4, 'd')
+    c('unlink', 's1')
+    expect(c('bgsave'), '1')
+    c('set', 'after', 'x')
+    wait_info(c, 'rdb_bgsave_in_progress', 0)
+    expect(info(c)['rdb_last_bgsave_ok'], 1)
+    srv.crash()
+    srv = Server(workdir)
+    c = srv.client
+    expect(c('get', 's1'), None)
+    expect(c('get', 's2'), 'v2')
+    expect(c('get', 'after'), None)
+    expect(zrange_all(c, 'z'), [('c', -3.0), ('a', 1.0), ('b', 2.5), ('d', 4.0)])
+    expect(c('zcard', 'zbig'), len(big))
+    if not 80000 < c('pttl', 't1') <= 100000:
+        raise AssertionError(f"pttl t1 is {c('pttl', 't1')}")
+    srv.crash()
+
+@restart_test
+def test_aof_replay(workdir):
+    srv = Server(workdir, '--appendonly', 'yes')
+    c = srv.client
+    c('set', 's1', 'v1')
+    c('set', 's2', 'v2')
+    c('set', 's2', 'v2b')
+    c('del', 's1')
+    c('zadd', 'z', 1, 'a', 2, 'b', 3, 'c', 4, 'd')
+    c('zrem', 'z', 'b')
+    expect(c('zpopmax', 'z'), ['d', 4.0])
+    c('zadd', 'zr', *[a for i in range(100) for a in (i, 'm%d' % i)])
+    c('zremrangebyrank', 'zr', 0, 49)
+    # big enough for the thread pool, here and in the replay
+    zadd_many(c, 'zs:a', {'a%d' % i: i for i in range(40000)})
+    zadd_many(c, 'zs:b', {'b%d' % i: i for i in range(40000)})
+    expect(c('zunionstore', 'zs:u', 2, 'zs:a', 'zs:b'), 80000)
+    c('unlink', 'zs:a')
+    # a blocking pop is logged as the pop it turned into
+    c2 = Client(TEST_PORT)
+    c2.send('bzpopmin', 'zq', 0)
+    time.sleep(0.05)
+    c('zadd', 'zq', 1, 'x', 2, 'y')
+    expect(c2.reply(), ['zq', 'x', 1.0])
+    c2.close()
+    # TTLs are logged as absolute times: one key expires while the server
+    # runs, one while it is down, and one outlives the restart
+    c('set', 'gone', 'v')
+    c('pexpire', 'gone', 100)
+    c('set', 'later', 'v')
+    c('pexpire', 'later', 400)
+    c('set', 'kept', 'v')
+    c('pexpire', 'kept', 100000)
+    c('set', 'reborn', 'v')
+    c('pexpire', 'reborn', 100)
+    # a time in the past deletes the key at once
+    c('set', 'past', 'v')
+    expect(c('pexpireat', 'past', 1), 1)
+    expect(c('get', 'past'), None)
+    c('set', 'past', 'v2')
+    time.sleep(0.2)
+    expect(c('get', 'gone'), None)
+    expect(c('get', 'later'), 'v')
+    # the expired key is overwritten; replay must not expire the new value
+    expect(c('get', 'reborn'), None)
+    c('set', 'reborn', 'v2')
+    srv.crash()
+    time.sleep(0.3)
+
+    srv = Server(workdir, '--appendonly', 'yes')
+    c = srv.client
+    expect(c('get', 's1'), None)
+    expect(c('get', 's2'), 'v2b')
+    expect(zrange_all(c, 'z'), [('a', 1.0), ('c', 3.0)])
+    expect(c('zrange', 'zr', 0, 0), ['m50'])
+    expect(c('zcard', 'zr'), 50)
+    expect(zrange_all(c, 'zq'), [('y', 2.0)])
+    expect(c('zcard', 'zs:u'), 80000)
+    expect(c('zscore', 'zs:u', 'a39999'), 39999.0)
+    expect(c('zcard', 'zs:a'), 0)
+    expect(c('get', 'gone'), None)
+    expect(c('get', 'later'), None)
+    expect(c('pttl', 'gone'), -2)
+    expect(c('get', 'reborn'), 'v2')
+    expect(c('pttl', 'reborn'), -1)
+    expect(c('get', 'past'), 'v2')
+    expect(c('pttl', 'past'), -1)
+    if not 90000 < c('pttl', 'kept') <= 100000:
+        raise AssertionError(f"pttl kept is {c('pttl', 'kept')}")
+    # the replayed log is appended to
+    c('set', 's3', 'v3')
+    srv.crash()
+    srv = Server(workdir, '--appendonly', 'yes')
+    c = srv.client
+    expect(c('get', 's3'), 'v3')
+    expect(c('get', 's2'), 'v2b')
+    expect(c('get', 'gone'), None)
+    expect(info(c)['aof_last_fsync_ok'], 1)
+    srv.crash()
+
+@restart_test
+def test_aof_rewrite(workdir):
+    srv = Server(workdir, '--appendonly', 'yes')
+    c = srv.client
+    for i in range(200):
+        c('set', 'ow', 'old-%d' % i)
+    big = {'m%06d' % i: float(i) for i in range(100000)}
+    zadd_many(c, 'zbig', big)
+    c('set', 'doomed', 'v')
+    c('set', 'ttl', 'v')
+    c('pexpire', 'ttl', 100000)
+    expect(c('bgrewriteaof'), '1')
+    # the child writes the log as of the fork; these go to both files
+    during = 0
+    while info(c)['aof_rewrite_in_progress']:
+        c('set', 'w:%d' % during, during)
+        c('zadd', 'zbig', -1 - during, 'new%d' % during)
+        during += 1
+    if during == 0:
+        raise AssertionError('the rewrite finished before any write')
+    expect(info(c)['aof_last_bgrewrite_ok'], 1)
+    c('set', 'ow', 'final')
+    c('del', 'doomed')
+    c('zrem', 'zbig', 'm000000')
+    with open(os.path.join(workdir, 'appendonly.aof'), 'rb') as f:
+        log = f.read()
+    if b'old-0' in log:
+        raise AssertionError('the log was not rewritten')
+    srv.crash()
+
+    srv = Server(workdir, '--appendonly', 'yes')
+    c = srv.client
+    expect(c('get', 'ow'), 'final')
+    expect(c('get', 'doomed'), None)
+    for i in range(during):
+        expect(c('get', 'w:%d' % i), str(i))
+    del big['m000000']
+    for i in range(during):
+        big['new%d' % i] = float(-1 - i)
+    expect(zrange_all(c, 'zbig'), by_score(big))
+    if not 90000 < c('pttl', 'ttl') <= 100000:
+        raise AssertionError(f"pttl ttl is {c('pttl', 'ttl')}")
+    srv.crash()
+
 def normalize(text):
     return [line.strip() for line in text.strip().splitlines() if line.strip()]
 
@@ -114,7 +716,15 @@ def main():
             print(out)
             print("------")
 
-    print(f"\n🧪 {passed}/{len(cmds)} tests passed.")
+    for f in SOCKET_TESTS:
+        try:
+            f()
+            print(f"✅ {f.__name__}")
+            passed += 1
+        except Exception as e:
+            print(f"❌ {f.__name__} FAILED: {e!r}"[:2000])
+
+    print(f"\n🧪 {passed}/{len(cmds) + len(SOCKET_TESTS)} tests passed.")
 
 if __name__ == '__main__':
     main()
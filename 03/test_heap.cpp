@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include "heap.h"
+
+struct Timer
+{
+    uint64_t val = 0;
+    size_t pos = -1;
+};
+
+// the heap order, the back-pointers, and the cache line alignment
+static void check(DHeap &h, std::vector<Timer> &timers)
+{
+    assert(h.len == 0 || ((uintptr_t)&h.items[1] % 64) == 0);
+    for (size_t i = 0; i < h.len; i++)
+    {
+        assert(*h.items[i].ref == i);
+        assert(i == 0 || h.items[(i - 1) / 4].val <= h.items[i].val);
+    }
+    size_t live = 0;
+    for (Timer &t : timers)
+    {
+        if (t.pos != (size_t)-1)
+        {
+            assert(h.items[t.pos].ref == &t.pos && h.items[t.pos].val == t.val);
+            live++;
+        }
+    }
+    assert(live == h.len);
+}
+
+static void test_case(size_t sz, uint64_t span)
+{
+    std::vector<Timer> timers(sz);
+    DHeap h;
+    for (Timer &t : timers)
+    {
+        t.val = rand() % span;
+        dheap_upsert(&h, t.pos, HeapItem{t.val, &t.pos});
+    }
+    check(h, timers);
+    // reschedule and cancel some
+    for (size_t i = 0; i < sz; i += 3)
+    {
+        timers[i].val = rand() % span;
+        dheap_upsert(&h, timers[i].pos, HeapItem{timers[i].val, &timers[i].pos});
+        if (i % 2)
+        {
+            dheap_delete(&h, timers[i].pos);
+            timers[i].pos = -1;
+        }
+    }
+    check(h, timers);
+    // expire in steps, some small, some taking most of the heap
+    uint64_t now = 0;
+    while (h.len)
+    {
+        now += 1 + rand() % (span / 4 + 1);
+        std::vector<HeapItem> out;
+        size_t max = rand() % 2 ? (size_t)-1 : 1 + rand() % (sz + 1);
+        size_t before = h.len;
+        dheap_pop_expired(&h, now, max, out);
+        assert(out.size() <= std::max(max, before / 16) && before == h.len + out.size());
+        for (HeapItem &item : out)
+        {
+            assert(item.val < now && *item.ref == (size_t)-1);
+        }
+        if (out.size() < max)
+        {
+            assert(h.len == 0 || h.items[0].val >= now);
+        }
+        check(h, timers);
+    }
+    dheap_free(&h);
+}
+
+// a mass expiry in a heap over 16 x `max` is still rebuilt at once
+static void test_mass_expiry(size_t sz, size_t max)
+{
+    std::vector<Timer> timers(sz);
+    DHeap h;
+    for (size_t i = 0; i < sz; i++)
+    {
+        timers[i].val = i % 2 ? 10 : 20;
+        dheap_upsert(&h, timers[i].pos, HeapItem{timers[i].val, &timers[i].pos});
+    }
+    std::vector<HeapItem> out;
+    dheap_pop_expired(&h, 15, max, out);
+    assert(out.size() == sz / 16 && h.len == sz - sz / 16);
+    check(h, timers);
+    while (h.len && h.items[0].val < 15)
+    {
+        out.clear();
+        dheap_pop_expired(&h, 15, max, out);
+        assert(!out.empty());
+        check(h, timers);
+    }
+    assert(h.len == sz / 2);
+    dheap_free(&h);
+}
+
+int main()
+{
+    for (size_t sz = 0; sz < 300; sz++)
+    {
+        test_case(sz, 1000);
+        test_case(sz, 10);
+    }
+    test_case(100000, 1000000);
+    test_mass_expiry(100000, 2000);
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "lz.h"
+
+static void round_trip(const std::string &s)
+{
+    std::vector<uint8_t> packed(s.size() + s.size() / 255 + 16);
+    size_t n = lz_compress((const uint8_t *)s.data(), s.size(), packed.data(), packed.size());
+    assert(n > 0);
+    std::string out(s.size(), '\0');
+    assert(lz_decompress(packed.data(), n, (uint8_t *)out.data(), out.size()));
+    assert(out == s);
+    // the wrong length, and every truncation, are rejected
+    std::string longer(s.size() + 1, '\0');
+    assert(!lz_decompress(packed.data(), n, (uint8_t *)longer.data(), longer.size()));
+    for (size_t cut = 0; cut < n && cut < 64; cut++)
+    {
+        lz_decompress(packed.data(), cut, (uint8_t *)out.data(), out.size());
+    }
+    // too little room to compress into
+    if (n > 1)
+    {
+        assert(lz_compress((const uint8_t *)s.data(), s.size(), packed.data(), n - 1) == 0);
+    }
+}
+
+static std::string random_bytes(size_t n, int alphabet)
+{
+    std::string s(n, '\0');
+    for (char &c : s)
+    {
+        c = (char)('a' + rand() % alphabet);
+    }
+    return s;
+}
+
+// JSON-like records with repeated keys and varied values
+static std::string json(size_t n)
+{
+    std::string s = "[";
+    for (size_t i = 0; s.size() < n; i++)
+    {
+        s += "{\"id\":" + std::to_string(i) + ",\"name\":\"user" + std::to_string(rand() % 1000) +
+             "\",\"active\":" + (rand() % 2 ? "true" : "false") + ",\"tags\":[\"a\",\"b\"]},";
+    }
+    s.resize(n);
+    return s;
+}
+
+int main()
+{
+    for (size_t n = 0; n < 100; n++)
+    {
+        round_trip(random_bytes(n, 2));
+        round_trip(random_bytes(n, 256));
+        round_trip(std::string(n, 'x'));
+    }
+    round_trip(json(500 * 1000));
+    round_trip(random_bytes(300 * 1000, 256));
+    round_trip(random_bytes(300 * 1000, 4));
+    round_trip(std::string(1 << 20, '\0')); // long match lengths
+    std::string far = random_bytes(70000, 256);
+    round_trip(far + far); // repeats beyond the offset limit
+
+    // compressible input shrinks
+    std::string doc = json(100 * 1000);
+    std::vector<uint8_t> packed(doc.size());
+    size_t n = lz_compress((const uint8_t *)doc.data(), doc.size(), packed.data(), packed.size());
+    assert(n > 0 && n < doc.size() / 2);
+
+    // corrupt input fails cleanly
+    for (int i = 0; i < 1000; i++)
+    {
+        std::vector<uint8_t> bad(packed.begin(), packed.begin() + n);
+        bad[rand() % n] ^= (uint8_t)(1 + rand() % 255);
+        std::string out(doc.size(), '\0');
+        lz_decompress(bad.data(), bad.size(), (uint8_t *)out.data(), out.size());
+    }
+    return 0;
+}
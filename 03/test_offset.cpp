@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <vector>
 #include "avl.h"
 
 #define container_of(ptr, type, member) \
@@ -86,11 +87,140 @@ static void test_case(uint32_t sz)
     dispose(c.root);
 }
 
+static AVLNode *find(Container &c, uint32_t val)
+{
+    AVLNode *cur = c.root;
+    while (cur && container_of(cur, Data, node)->val != val)
+    {
+        cur = val < container_of(cur, Data, node)->val ? cur->left : cur->right;
+    }
+    return cur;
+}
+
+// delete every other node, then check the ranks of the rest
+static void test_delete(uint32_t sz)
+{
+    Container c;
+    for (uint32_t i = 0; i < sz; ++i)
+    {
+        add(c, i);
+    }
+    for (uint32_t i = 0; i < sz; i += 2)
+    {
+        AVLNode *node = find(c, i);
+        c.root = avl_del(node);
+        delete container_of(node, Data, node);
+    }
+    for (uint32_t i = 1; i < sz; i += 2)
+    {
+        AVLNode *node = find(c, i);
+        assert(avl_rank(node) == i / 2);
+        assert(avl_offset(node, -(int64_t)(i / 2)) == find(c, 1));
+    }
+    assert(avl_cnt(c.root) == sz / 2);
+    dispose(c.root);
+}
+
+// bulk build from sorted nodes, then check the balance and the ranks
+static uint32_t check_balanced(AVLNode *node)
+{
+    if (!node)
+    {
+        return 0;
+    }
+    uint32_t l = check_balanced(node->left);
+    uint32_t r = check_balanced(node->right);
+    assert(l <= r + 1 && r <= l + 1);
+    assert(node->height == 1 + (l > r ? l : r));
+    assert(node->cnt == 1 + avl_cnt(node->left) + avl_cnt(node->right));
+    assert(!node->left || node->left->parent == node);
+    assert(!node->right || node->right->parent == node);
+    return node->height;
+}
+
+static void test_build(uint32_t sz)
+{
+    std::vector<AVLNode *> nodes;
+    for (uint32_t i = 0; i < sz; ++i)
+    {
+        Data *data = new Data();
+        avl_init(&data->node);
+        data->val = i;
+        nodes.push_back(&data->node);
+    }
+    Container c;
+    c.root = avl_build(nodes.data(), nodes.size());
+    check_balanced(c.root);
+    for (uint32_t i = 0; i < sz; ++i)
+    {
+        assert(avl_rank(nodes[i]) == i);
+        assert(!i || avl_prev(nodes[i]) == nodes[i - 1]);
+    }
+    add(c, sz); // still a valid AVL tree
+    check_balanced(c.root);
+    dispose(c.root);
+}
+
+static void check_range(AVLNode *root, uint32_t lo, uint32_t hi)
+{
+    assert(!root || !root->parent);
+    check_balanced(root);
+    assert(avl_cnt(root) == hi - lo);
+    AVLNode *node = root;
+    while (node && node->left)
+    {
+        node = node->left;
+    }
+    for (uint32_t i = lo; i < hi; ++i, node = avl_next(node))
+    {
+        assert(container_of(node, Data, node)->val == i);
+    }
+    assert(!node);
+}
+
+// cut out [lo, hi), then join the rest back
+static void test_split_join(uint32_t sz)
+{
+    for (uint32_t lo = 0; lo <= sz; lo += 1 + sz / 8)
+    {
+        for (uint32_t hi = lo; hi <= sz; hi += 1 + sz / 8)
+        {
+            Container c;
+            for (uint32_t i = 0; i < sz; ++i)
+            {
+                add(c, i);
+            }
+            AVLNode *a = NULL, *b = NULL, *mid = NULL, *rest = NULL;
+            avl_split(c.root, lo, &a, &b);
+            check_range(a, 0, lo);
+            check_range(b, lo, sz);
+            avl_split(b, hi - lo, &mid, &rest);
+            check_range(mid, lo, hi);
+            check_range(rest, hi, sz);
+            c.root = avl_join2(a, rest);
+            for (uint32_t i = 0; i < lo; ++i)
+            {
+                assert(avl_rank(find(c, i)) == i);
+            }
+            for (uint32_t i = hi; i < sz; ++i)
+            {
+                assert(avl_rank(find(c, i)) == i - (hi - lo));
+            }
+            check_balanced(c.root);
+            dispose(c.root);
+            dispose(mid);
+        }
+    }
+}
+
 int main()
 {
     for (uint32_t i = 1; i < 500; ++i)
     {
         test_case(i);
+        test_delete(i);
+        test_build(i);
+        test_split_join(i);
     }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,98 @@
+#include <assert.h>
+#include <poll.h>
+#include <atomic>
+#include <vector>
+#include "thread_pool.h"
+
+static TheadPool g_tp;
+static std::atomic<size_t> g_ran{0};
+
+static void work(void *arg)
+{
+    ((std::atomic<size_t> *)arg)->fetch_add(1);
+}
+
+// each task spawns two from its worker, which the others steal
+static void spawn(void *arg)
+{
+    size_t depth = (size_t)arg;
+    g_ran++;
+    if (depth > 0)
+    {
+        thread_pool_queue(&g_tp, &spawn, (void *)(depth - 1));
+        thread_pool_queue(&g_tp, &spawn, (void *)(depth - 1));
+    }
+}
+
+struct Job
+{
+    size_t id = 0;
+    bool ran = false;
+};
+
+static std::vector<size_t> g_done;
+
+static void job_work(void *arg)
+{
+    ((Job *)arg)->ran = true;
+}
+
+static void job_done(void *arg)
+{
+    Job *job = (Job *)arg;
+    assert(job->ran);
+    g_done.push_back(job->id);
+}
+
+static void test_case(size_t nthreads)
+{
+    thread_pool_init(&g_tp, nthreads);
+
+    // more than the injection queue holds
+    std::atomic<size_t> cnt{0};
+    for (size_t i = 0; i < 100000; i++)
+    {
+        thread_pool_queue(&g_tp, &work, &cnt);
+    }
+    std::vector<void *> args(64, &cnt);
+    thread_pool_run(&g_tp, &work, args.data(), args.size());
+
+    g_ran = 0;
+    thread_pool_queue(&g_tp, &spawn, (void *)14);
+
+    // completions come back through the eventfd, each exactly once
+    std::vector<Job> jobs(10000);
+    g_done.clear();
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        jobs[i].id = i;
+        thread_pool_submit(&g_tp, &job_work, &jobs[i], &job_done);
+    }
+    while (g_done.size() < jobs.size())
+    {
+        struct pollfd pfd = {thread_pool_done_fd(&g_tp), POLLIN, 0};
+        int rv = poll(&pfd, 1, 10000);
+        assert(rv == 1);
+        thread_pool_poll_done(&g_tp);
+    }
+    std::vector<bool> seen(jobs.size());
+    for (size_t id : g_done)
+    {
+        assert(!seen[id]);
+        seen[id] = true;
+    }
+
+    // shutting down finishes the queued work
+    thread_pool_destroy(&g_tp);
+    assert(cnt == 100000 + 64);
+    assert(g_ran == (1u << 15) - 1);
+}
+
+int main()
+{
+    for (size_t n = 1; n <= 4; n++)
+    {
+        test_case(n);
+    }
+    return 0;
+}
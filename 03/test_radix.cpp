@@ -0,0 +1,86 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "radix.h"
+
+struct Collect
+{
+    std::vector<std::string> keys;
+    size_t limit = (size_t)-1;
+};
+
+static bool cb_collect(const std::string &key, void *, void *arg)
+{
+    Collect *c = (Collect *)arg;
+    c->keys.push_back(key);
+    return c->keys.size() < c->limit;
+}
+
+static std::string rand_key()
+{
+    // short keys over a tiny alphabet to force shared prefixes and splits
+    std::string key;
+    size_t len = rand() % 6;
+    for (size_t i = 0; i < len; i++)
+    {
+        key.push_back("ab:"[rand() % 3]);
+    }
+    return key;
+}
+
+static void verify_walk(Rax &rax, std::map<std::string, void *> &ref,
+                        const std::string &prefix, const std::string &start, size_t limit)
+{
+    Collect c;
+    c.limit = limit;
+    rax_walk(&rax, (const uint8_t *)prefix.data(), prefix.size(),
+             (const uint8_t *)start.data(), start.size(), &cb_collect, &c);
+
+    std::vector<std::string> expect;
+    for (auto it = ref.lower_bound(start); it != ref.end() && expect.size() < limit; ++it)
+    {
+        if (it->first.compare(0, prefix.size(), prefix) == 0)
+        {
+            expect.push_back(it->first);
+        }
+    }
+    assert(c.keys == expect);
+}
+
+int main()
+{
+    Rax rax;
+    std::map<std::string, void *> ref;
+    for (int i = 0; i < 20000; i++)
+    {
+        std::string key = rand_key();
+        void *val = (void *)(uintptr_t)(i + 1);
+        if (rand() % 3)
+        {
+            bool added = rax_insert(&rax, (const uint8_t *)key.data(), key.size(), val);
+            assert(added == !ref.count(key));
+            ref[key] = val;
+        }
+        else
+        {
+            bool deleted = rax_delete(&rax, (const uint8_t *)key.data(), key.size());
+            assert(deleted == (ref.erase(key) == 1));
+        }
+        assert(rax.size == ref.size());
+
+        std::string probe = rand_key();
+        void *found = rax_find(&rax, (const uint8_t *)probe.data(), probe.size());
+        assert(found == (ref.count(probe) ? ref[probe] : NULL));
+
+        if (i % 16 == 0)
+        {
+            verify_walk(rax, ref, rand_key().substr(0, 2), rand_key(), 1 + rand() % 8);
+            verify_walk(rax, ref, "", "", (size_t)-1);
+        }
+    }
+    rax_clear(&rax);
+    assert(!rax.root && rax.size == 0);
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "snapshot.h"
+
+static const char *k_path = "test_snapshot.kvs";
+
+static std::string read_file(const char *path)
+{
+    std::string data;
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    char buf[4096];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+    {
+        data.append(buf, n);
+    }
+    fclose(f);
+    return data;
+}
+
+static void write_file(const char *path, const std::string &data)
+{
+    FILE *f = fopen(path, "wb");
+    assert(f && fwrite(data.data(), 1, data.size(), f) == data.size());
+    fclose(f);
+}
+
+// reads the file written by main(); false if it is rejected
+static bool verify(size_t nkeys, const std::string &big)
+{
+    SnapReader r;
+    if (snap_open(&r, k_path) != SNAP_OK)
+    {
+        return false;
+    }
+    SnapRecord rec;
+    int err = 0;
+    size_t i = 0;
+    for (; snap_next(&r, &rec, &err); i++)
+    {
+        std::string key = "key" + std::to_string(i);
+        assert(rec.key == key);
+        if (i % 3 == 2)
+        {
+            assert((rec.type & 0x0f) == SNAP_ZSET && rec.n == i % 50);
+            for (size_t k = 0; k < rec.n; k++)
+            {
+                std::string_view name;
+                double score = 0;
+                assert(snap_next_member(&r, &name, &score));
+                assert(name == "m" + std::to_string(k) && score == k * 0.5);
+            }
+            continue;
+        }
+        assert((rec.type & 0x0f) == SNAP_STR);
+        assert(rec.expire_at_ms == (i % 3 == 1 ? (int64_t)(1700000000000 + i) : -1));
+        if (i == 0)
+        {
+            assert(rec.val == big && rec.raw_len == 0);
+        }
+        else if (i % 10 == 1)
+        {
+            assert(rec.val == "packed" && rec.raw_len == 1000);
+        }
+        else
+        {
+            assert(rec.val == std::string(i % 20, 'v'));
+        }
+    }
+    assert(err == SNAP_OK && i == nkeys && snap_done(&r));
+    snap_close(&r);
+    return true;
+}
+
+int main()
+{
+    // the CRC-32C check value
+    assert(crc32c(0, (const uint8_t *)"123456789", 9) == 0xe3069283);
+    uint32_t split = crc32c(crc32c(0, (const uint8_t *)"1234", 4), (const uint8_t *)"56789", 5);
+    assert(split == 0xe3069283);
+
+    SnapReader r;
+    unlink(k_path);
+    assert(snap_open(&r, k_path) == SNAP_MISSING);
+
+    // strings with and without TTLs, compressed ones, zsets, and a value
+    // bigger than the write buffer
+    const size_t nkeys = 10000;
+    std::string big(3 << 20, 'b');
+    SnapWriter w;
+    assert(snap_create(&w, k_path));
+    for (size_t i = 0; i < nkeys; i++)
+    {
+        std::string key = "key" + std::to_string(i);
+        int64_t expire = i % 3 == 1 ? (int64_t)(1700000000000 + i) : -1;
+        if (i % 3 == 2)
+        {
+            snap_put_zset(&w, key, expire, i % 50);
+            for (size_t k = 0; k < i % 50; k++)
+            {
+                snap_put_member(&w, "m" + std::to_string(k), k * 0.5);
+            }
+        }
+        else if (i == 0)
+        {
+            snap_put_str(&w, key, expire, big, 0);
+        }
+        else if (i % 10 == 1)
+        {
+            snap_put_str(&w, key, expire, "packed", 1000);
+        }
+        else
+        {
+            snap_put_str(&w, key, expire, std::string(i % 20, 'v'), 0);
+        }
+    }
+    assert(snap_finish(&w, k_path));
+    assert(access((std::string(k_path) + ".tmp").c_str(), F_OK) != 0);
+    assert(verify(nkeys, big));
+
+    // any flipped byte or truncation is caught by the checksum
+    std::string good = read_file(k_path);
+    assert(good.size() == w.bytes);
+    for (int i = 0; i < 200; i++)
+    {
+        std::string bad = good;
+        bad[rand() % bad.size()] ^= (char)(1 + rand() % 255);
+        write_file(k_path, bad);
+        assert(snap_open(&r, k_path) == SNAP_CORRUPT);
+    }
+    for (size_t cut : {(size_t)0, (size_t)7, good.size() / 2, good.size() - 1})
+    {
+        write_file(k_path, good.substr(0, cut));
+        assert(snap_open(&r, k_path) == SNAP_CORRUPT);
+    }
+
+    // an aborted write keeps the old file
+    write_file(k_path, good);
+    assert(snap_create(&w, k_path));
+    snap_put_str(&w, "x", -1, "y", 0);
+    snap_abort(&w, k_path);
+    assert(read_file(k_path) == good);
+
+    // an empty keyspace
+    SnapWriter empty;
+    assert(snap_create(&empty, k_path) && snap_finish(&empty, k_path));
+    assert(verify(0, big));
+    unlink(k_path);
+    return 0;
+}
@@ -1,25 +1,252 @@
 #include <assert.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "thread_pool.h"
 
 
+static const size_t k_inject_cap = 4096; // a power of 2
+static const int64_t k_deque_cap = 256;  // initial, a power of 2
+static const size_t k_idle_spins = 16;
+
+// the worker running on this thread, if any
+static thread_local Worker *tl_worker = NULL;
+
+static TaskArray *array_new(int64_t cap) {
+    TaskArray *a = new TaskArray;
+    a->cap = cap;
+    a->buf = new std::atomic<Task *>[cap];
+    return a;
+}
+
+static void array_free(TaskArray *a) {
+    delete[] a->buf;
+    delete a;
+}
+
+static void deque_init(TaskDeque *d) {
+    d->array.store(array_new(k_deque_cap), std::memory_order_relaxed);
+}
+
+static void deque_free(TaskDeque *d) {
+    for (TaskArray *a : d->retired) {
+        array_free(a);
+    }
+    d->retired.clear();
+    array_free(d->array.load(std::memory_order_relaxed));
+}
+
+// owner only
+static void deque_push(TaskDeque *d, Task *t) {
+    int64_t b = d->bottom.load(std::memory_order_relaxed);
+    int64_t top = d->top.load(std::memory_order_acquire);
+    TaskArray *a = d->array.load(std::memory_order_relaxed);
+    if (b - top > a->cap - 1) {
+        // full: copy the live range into a bigger array
+        TaskArray *bigger = array_new(a->cap * 2);
+        for (int64_t i = top; i < b; i++) {
+            Task *x = a->buf[i & (a->cap - 1)].load(std::memory_order_relaxed);
+            bigger->buf[i & (bigger->cap - 1)].store(x, std::memory_order_relaxed);
+        }
+        d->retired.push_back(a);
+        d->array.store(bigger, std::memory_order_release);
+        a = bigger;
+    }
+    a->buf[b & (a->cap - 1)].store(t, std::memory_order_relaxed);
+    d->bottom.store(b + 1, std::memory_order_release); // publish to thieves
+}
+
+// owner only, LIFO
+static Task *deque_take(TaskDeque *d) {
+    int64_t b = d->bottom.load(std::memory_order_relaxed) - 1;
+    TaskArray *a = d->array.load(std::memory_order_relaxed);
+    d->bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = d->top.load(std::memory_order_relaxed);
+    if (top > b) {
+        d->bottom.store(b + 1, std::memory_order_relaxed);
+        return NULL; // empty
+    }
+    Task *x = a->buf[b & (a->cap - 1)].load(std::memory_order_relaxed);
+    if (top == b) {
+        // the last one: race the thieves for it
+        if (!d->top.compare_exchange_strong(top, top + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            x = NULL;
+        }
+        d->bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return x;
+}
+
+// any thread, FIFO; NULL if empty or lost a race
+static Task *deque_steal(TaskDeque *d) {
+    int64_t top = d->top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = d->bottom.load(std::memory_order_acquire);
+    if (top >= b) {
+        return NULL;
+    }
+    TaskArray *a = d->array.load(std::memory_order_acquire);
+    Task *x = a->buf[top & (a->cap - 1)].load(std::memory_order_relaxed);
+    if (!d->top.compare_exchange_strong(top, top + 1,
+            std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        return NULL;
+    }
+    return x;
+}
+
+static void queue_init(TaskQueue *q, size_t cap) {
+    q->cells = new TaskCell[cap];
+    q->mask = cap - 1;
+    q->head.store(0, std::memory_order_relaxed);
+    q->tail.store(0, std::memory_order_relaxed);
+    for (size_t i = 0; i < cap; i++) {
+        q->cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+// false if full
+static bool queue_push(TaskQueue *q, Task *t) {
+    size_t pos = q->tail.load(std::memory_order_relaxed);
+    TaskCell *cell = NULL;
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (q->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = q->tail.load(std::memory_order_relaxed);
+        }
+    }
+    cell->task = t;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+// NULL if empty
+static Task *queue_pop(TaskQueue *q) {
+    size_t pos = q->head.load(std::memory_order_relaxed);
+    TaskCell *cell = NULL;
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (q->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = q->head.load(std::memory_order_relaxed);
+        }
+    }
+    Task *t = cell->task;
+    cell->seq.store(pos + q->mask + 1, std::memory_order_release);
+    return t;
+}
+
+// own deque first, then the injection queue, then the other workers
+static Task *find_task(Worker *w) {
+    TheadPool *tp = w->tp;
+    if (Task *t = deque_take(&w->deque)) {
+        return t;
+    }
+    if (Task *t = queue_pop(&tp->inject)) {
+        return t;
+    }
+    size_t n = tp->workers.size();
+    for (size_t i = 1; i < n; i++) {
+        if (Task *t = deque_steal(&tp->workers[(w->id + i) % n]->deque)) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void run_task(TheadPool *tp, Task *t) {
+    t->f(t->arg);
+    if (!t->done) {
+        delete t;
+        return;
+    }
+    // push to the completion list; wake the loop if it was empty
+    Task *head = tp->completed.load(std::memory_order_relaxed);
+    do {
+        t->next = head;
+    } while (!tp->completed.compare_exchange_weak(head, t,
+                std::memory_order_release, std::memory_order_relaxed));
+    if (!head) {
+        uint64_t one = 1;
+        ssize_t rv = write(tp->done_fd, &one, sizeof(one));
+        assert(rv == sizeof(one));
+        (void)rv;
+    }
+}
+
 static void *worker(void *arg) {
-    TheadPool *tp = (TheadPool *)arg;
+    Worker *w = (Worker *)arg;
+    TheadPool *tp = w->tp;
+    tl_worker = w;
+    size_t idle = 0;
     while (true) {
+        if (Task *t = find_task(w)) {
+            run_task(tp, t);
+            idle = 0;
+            continue;
+        }
+        if (idle++ < k_idle_spins) {
+            sched_yield(); // more may be coming; sleeping costs 2 syscalls
+            continue;
+        }
+        idle = 0;
+        // nothing found: sleep, unless a task arrived after announcing it
         pthread_mutex_lock(&tp->mu);
-        // wait for the condition: a non-empty queue
-        while (tp->queue.empty()) {
-            pthread_cond_wait(&tp->not_empty, &tp->mu);
+        tp->sleepers.fetch_add(1);
+        Task *t = find_task(w);
+        bool stop = tp->stop.load();
+        if (!t && !stop) {
+            pthread_cond_wait(&tp->wake, &tp->mu);
+        }
+        tp->sleepers.fetch_sub(1);
+        pthread_mutex_unlock(&tp->mu);
+        if (t) {
+            run_task(tp, t);
+        } else if (stop) {
+            break; // drained
         }
+    }
+    return NULL;
+}
 
-        // got the job
-        Work w = tp->queue.front();
-        tp->queue.pop_front();
+static void wake_one(TheadPool *tp) {
+    if (tp->sleepers.load() > 0) {
+        pthread_mutex_lock(&tp->mu);
+        pthread_cond_signal(&tp->wake);
         pthread_mutex_unlock(&tp->mu);
+    }
+}
 
-        // do the work
-        w.f(w.arg);
+static void submit(TheadPool *tp, Task *t) {
+    Worker *w = tl_worker;
+    if (w && w->tp == tp) {
+        deque_push(&w->deque, t); // spawned by a task
+    } else {
+        while (!queue_push(&tp->inject, t)) {
+            // full: help the workers rather than wait for them
+            if (Task *x = queue_pop(&tp->inject)) {
+                run_task(tp, x);
+            }
+        }
     }
-    return NULL;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    wake_one(tp);
 }
 
 void thread_pool_init(TheadPool *tp, size_t num_threads) {
@@ -27,19 +254,124 @@ void thread_pool_init(TheadPool *tp, size_t num_threads) {
 
     int rv = pthread_mutex_init(&tp->mu, NULL);
     assert(rv == 0);
-    rv = pthread_cond_init(&tp->not_empty, NULL);
+    rv = pthread_cond_init(&tp->wake, NULL);
     assert(rv == 0);
+    tp->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(tp->done_fd >= 0);
+    queue_init(&tp->inject, k_inject_cap);
+    tp->stop = false;
 
-    tp->threads.resize(num_threads);
+    tp->workers.resize(num_threads);
     for (size_t i = 0; i < num_threads; ++i) {
-        int rv = pthread_create(&tp->threads[i], NULL, &worker, tp);
+        tp->workers[i] = new Worker;
+        tp->workers[i]->tp = tp;
+        tp->workers[i]->id = i;
+        deque_init(&tp->workers[i]->deque);
+    }
+    for (size_t i = 0; i < num_threads; ++i) {
+        int rv = pthread_create(&tp->workers[i]->thread, NULL, &worker, tp->workers[i]);
         assert(rv == 0);
     }
 }
 
-void thread_pool_queue(TheadPool *tp, void (*f)(void *), void *arg) {
+void thread_pool_destroy(TheadPool *tp) {
     pthread_mutex_lock(&tp->mu);
-    tp->queue.push_back(Work {f, arg});
-    pthread_cond_signal(&tp->not_empty);
+    tp->stop = true;
+    pthread_cond_broadcast(&tp->wake);
     pthread_mutex_unlock(&tp->mu);
-}
\ No newline at end of file
+    for (Worker *w : tp->workers) {
+        pthread_join(w->thread, NULL);
+    }
+    thread_pool_poll_done(tp);
+    for (Worker *w : tp->workers) {
+        deque_free(&w->deque);
+        delete w;
+    }
+    tp->workers.clear();
+    delete[] tp->inject.cells;
+    tp->inject.cells = NULL;
+    close(tp->done_fd);
+    tp->done_fd = -1;
+    pthread_cond_destroy(&tp->wake);
+    pthread_mutex_destroy(&tp->mu);
+}
+
+void thread_pool_queue(TheadPool *tp, void (*f)(void *), void *arg) {
+    submit(tp, new Task{f, arg, NULL, NULL});
+}
+
+void thread_pool_submit(TheadPool *tp, void (*f)(void *), void *arg, void (*done)(void *)) {
+    submit(tp, new Task{f, arg, done, NULL});
+}
+
+int thread_pool_done_fd(TheadPool *tp) {
+    return tp->done_fd;
+}
+
+size_t thread_pool_poll_done(TheadPool *tp) {
+    // clear the eventfd before taking the list, so a later push re-arms it
+    uint64_t cnt = 0;
+    ssize_t rv = read(tp->done_fd, &cnt, sizeof(cnt));
+    (void)rv;
+    Task *list = tp->completed.exchange(NULL, std::memory_order_acquire);
+    // reverse to the completion order
+    Task *fifo = NULL;
+    while (list) {
+        Task *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+    size_t n = 0;
+    while (fifo) {
+        Task *t = fifo;
+        fifo = t->next;
+        t->done(t->arg);
+        delete t;
+        n++;
+    }
+    return n;
+}
+
+// counts down the unfinished work of thread_pool_run()
+struct Latch {
+    pthread_mutex_t mu;
+    pthread_cond_t done;
+    size_t pending = 0;
+};
+
+struct LatchWork {
+    void (*f)(void *) = NULL;
+    void *arg = NULL;
+    Latch *latch = NULL;
+};
+
+static void latch_work(void *arg) {
+    LatchWork *w = (LatchWork *)arg;
+    w->f(w->arg);
+    Latch *latch = w->latch;
+    pthread_mutex_lock(&latch->mu);
+    if (--latch->pending == 0) {
+        pthread_cond_signal(&latch->done);
+    }
+    pthread_mutex_unlock(&latch->mu);
+}
+
+void thread_pool_run(TheadPool *tp, void (*f)(void *), void **args, size_t n) {
+    Latch latch;
+    pthread_mutex_init(&latch.mu, NULL);
+    pthread_cond_init(&latch.done, NULL);
+    latch.pending = n;
+    std::vector<LatchWork> works(n);
+    for (size_t i = 0; i < n; ++i) {
+        works[i] = LatchWork {f, args[i], &latch};
+        thread_pool_queue(tp, &latch_work, &works[i]);
+    }
+    pthread_mutex_lock(&latch.mu);
+    while (latch.pending > 0) {
+        pthread_cond_wait(&latch.done, &latch.mu);
+    }
+    pthread_mutex_unlock(&latch.mu);
+    pthread_cond_destroy(&latch.done);
+    pthread_mutex_destroy(&latch.mu);
+}
@@ -1,22 +1,79 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <atomic>
 #include <vector>
-#include <deque>
 
 
-struct Work {
+// a unit of work; `done` runs on the thread that polls the completions
+struct Task {
     void (*f)(void *) = NULL;
     void *arg = NULL;
+    void (*done)(void *) = NULL;
+    Task *next = NULL; // in the completion list
+};
+
+// Chase-Lev deque: the owner pushes and takes at the bottom, thieves steal
+// from the top. outgrown arrays are kept until the pool is destroyed, since
+// a thief may still be reading one.
+struct TaskArray {
+    int64_t cap = 0;
+    std::atomic<Task *> *buf = NULL;
+};
+
+struct TaskDeque {
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::atomic<TaskArray *> array{NULL};
+    std::vector<TaskArray *> retired;
+};
+
+// Vyukov's bounded MPMC queue, for tasks submitted from outside the pool
+struct TaskCell {
+    std::atomic<size_t> seq{0};
+    Task *task = NULL;
+};
+
+struct TaskQueue {
+    TaskCell *cells = NULL;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+struct TheadPool;
+
+struct Worker {
+    TheadPool *tp = NULL;
+    size_t id = 0;
+    pthread_t thread;
+    TaskDeque deque;
 };
 
 struct TheadPool {
-    std::vector<pthread_t> threads;
-    std::deque<Work> queue;
+    std::vector<Worker *> workers;
+    TaskQueue inject;
+    // idle workers sleep on `wake`; submitters signal only if someone sleeps
     pthread_mutex_t mu;
-    pthread_cond_t not_empty;
+    pthread_cond_t wake;
+    std::atomic<size_t> sleepers{0};
+    std::atomic<bool> stop{false};
+    // finished tasks with a `done` callback, newest first
+    std::atomic<Task *> completed{NULL};
+    int done_fd = -1; // eventfd, readable when `completed` may be non-empty
 };
 
 void thread_pool_init(TheadPool *tp, size_t num_threads);
-void thread_pool_queue(TheadPool *tp, void (*f)(void *), void *arg);
\ No newline at end of file
+// run the queued tasks, stop the workers and run the pending callbacks
+void thread_pool_destroy(TheadPool *tp);
+void thread_pool_queue(TheadPool *tp, void (*f)(void *), void *arg);
+// run f(arg) on a worker, then done(arg) from thread_pool_poll_done()
+void thread_pool_submit(TheadPool *tp, void (*f)(void *), void *arg, void (*done)(void *));
+// poll this fd for POLLIN, then call thread_pool_poll_done()
+int thread_pool_done_fd(TheadPool *tp);
+// run the callbacks of the finished tasks, oldest first; returns the count
+size_t thread_pool_poll_done(TheadPool *tp);
+// run f(args[i]) for each i on the pool and wait for all of them
+void thread_pool_run(TheadPool *tp, void (*f)(void *), void **args, size_t n);
@@ -1,30 +1,34 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
-#include <mutex>
-std::mutex zset_mutex;
+#include <algorithm>
+#include <vector>
 // proj
 #include "zset.h"
 #include "common.h"
 
-static ZNode *znode_new(const char *name, size_t len, double score)
+static size_t znode_size(size_t len)
 {
-    size_t total_size = offsetof(ZNode, name) + len + 1; // Ensure null-terminated
-    ZNode *node = (ZNode *)malloc(total_size);
-    assert(node);
+    return offsetof(ZNode, name) + len + 1; // Ensure null-terminated
+}
+
+static ZNode *znode_new(ZSet *zset, const char *name, size_t len, double score)
+{
+    ZNode *node = (ZNode *)arena_alloc(&zset->arena, znode_size(len));
     avl_init(&node->tree);
     node->hmap.next = NULL;
     node->hmap.hcode = str_hash((uint8_t *)name, len);
     node->score = score;
+    node->prefix = zname_prefix(name, len);
     node->len = len;
     memcpy(&node->name[0], name, len);
     node->name[len] = '\0'; // Ensure null termination
     return node;
 }
 
-static void znode_del(ZNode *node)
+static void znode_del(ZSet *zset, ZNode *node)
 {
-    free(node);
+    arena_free(&zset->arena, node, znode_size(node->len));
 }
 
 static size_t min(size_t lhs, size_t rhs)
@@ -32,19 +36,27 @@ static size_t min(size_t lhs, size_t rhs)
     return lhs < rhs ? lhs : rhs;
 }
 
-// compare by the (score, name) tuple
+// compare by the (score, name) tuple; `prefix` is zname_prefix() of the name
 static bool zless(
-    AVLNode *lhs, double score, const char *name, size_t len)
+    AVLNode *lhs, double score, uint64_t prefix, const char *name, size_t len)
 {
     ZNode *zl = container_of(lhs, ZNode, tree);
     if (zl->score != score)
     {
         return zl->score < score;
     }
-    int rv = memcmp(zl->name, name, min(zl->len, len));
-    if (rv != 0)
+    // most score ties are settled by the prefix, without touching the name
+    if (zl->prefix != prefix)
     {
-        return rv < 0;
+        return zl->prefix < prefix;
+    }
+    if (zl->len > 8 && len > 8)
+    {
+        int rv = memcmp(zl->name + 8, name + 8, min(zl->len, len) - 8);
+        if (rv != 0)
+        {
+            return rv < 0;
+        }
     }
     return zl->len < len;
 }
@@ -52,12 +64,70 @@ static bool zless(
 static bool zless(AVLNode *lhs, AVLNode *rhs)
 {
     ZNode *zr = container_of(rhs, ZNode, tree);
-    return zless(lhs, zr->score, zr->name, zr->len);
+    return zless(lhs, zr->score, zr->prefix, zr->name, zr->len);
 }
 
-// insert into the AVL tree
+// B+tree keys compare by score, then by the name prefix, then by name
+static int ztie(void *ref, const char *name, size_t len)
+{
+    ZNode *node = (ZNode *)ref;
+    int rv = memcmp(node->name, name, min(node->len, len));
+    if (rv != 0)
+    {
+        return rv;
+    }
+    return node->len < len ? -1 : (node->len > len ? 1 : 0);
+}
+
+static BTTarget ztarget(ZNode *node)
+{
+    return BTTarget{node->score, node->name, node->len, node->prefix};
+}
+
+void zset_init(ZSet *zset, uint32_t kind)
+{
+    assert(hm_size(&zset->hmap) == 0);
+    zset->kind = kind;
+    zset->btree.tie = &ztie;
+}
+
+// hold the write lock of a shared zset for the scope
+struct ZWriteGuard
+{
+    ZSet *zset;
+    explicit ZWriteGuard(ZSet *zset) : zset(zset)
+    {
+        if (zset->lock)
+        {
+            pthread_rwlock_wrlock(zset->lock);
+        }
+    }
+    ~ZWriteGuard()
+    {
+        if (zset->lock)
+        {
+            pthread_rwlock_unlock(zset->lock);
+        }
+    }
+};
+
+static bool znode_less(ZNode *lhs, ZNode *rhs);
+
+// insert into the AVL tree or the B+tree
 static void tree_insert(ZSet *zset, ZNode *node)
 {
+    if (!zset->first || znode_less(node, zset->first))
+    {
+        zset->first = node;
+    }
+    if (!zset->last || znode_less(zset->last, node))
+    {
+        zset->last = node;
+    }
+    if (zset->kind == ZSET_BTREE)
+    {
+        return bt_insert(&zset->btree, BTKey{node->score, node, node->prefix}, ztarget(node));
+    }
     AVLNode *parent = NULL;       // inset unde this node
     AVLNode **from = &zset->root; // the incoming pointer to the next node
     while (*from)
@@ -71,11 +141,38 @@ static void tree_insert(ZSet *zset, ZNode *node)
 }
 
 // upadte the score of an existing node
+static void tree_delete(ZSet *zset, ZNode *node)
+{
+    // move the cached ends to the neighbors
+    if (node == zset->first)
+    {
+        ZIter iter;
+        ziter_init(&iter, zset, node);
+        ziter_next(&iter);
+        zset->first = iter.node;
+    }
+    if (node == zset->last)
+    {
+        ZIter iter;
+        ziter_init(&iter, zset, node);
+        ziter_prev(&iter);
+        zset->last = iter.node;
+    }
+    if (zset->kind == ZSET_BTREE)
+    {
+        bool found = bt_delete(&zset->btree, ztarget(node));
+        assert(found);
+        (void)found;
+        return;
+    }
+    zset->root = avl_del(&node->tree);
+}
+
 static void zset_update(ZSet *zset, ZNode *node, double score)
 {
     if (node->score == score)
         return;
-    zset->root = avl_del(&node->tree);
+    tree_delete(zset, node);
     node->score = score;
     avl_init(&node->tree);
     tree_insert(zset, node);
@@ -85,25 +182,95 @@ static void zset_update(ZSet *zset, ZNode *node, double score)
 
 bool zset_insert(ZSet *zset, const char *name, size_t len, double score)
 {
+    ZWriteGuard guard(zset);
     ZNode *node = zset_lookup(zset, name, len);
     if (node)
     {
-        std::lock_guard<std::mutex> lock(zset_mutex);
         zset_update(zset, node, score);
         return false;
     }
 
-    node = znode_new(name, len, score);
-    if (!node)
-        return false;
+    node = znode_new(zset, name, len, score);
+    hm_insert(&zset->hmap, &node->hmap);
+    tree_insert(zset, node);
+    return true;
+}
 
+static bool znode_less(ZNode *lhs, ZNode *rhs)
+{
+    return zless(&lhs->tree, rhs->score, rhs->prefix, rhs->name, rhs->len);
+}
+
+// replace the index with one built from the nodes in order
+static void tree_rebuild(ZSet *zset, std::vector<ZNode *> &nodes)
+{
+    zset->first = nodes.empty() ? NULL : nodes.front();
+    zset->last = nodes.empty() ? NULL : nodes.back();
+    if (zset->kind == ZSET_BTREE)
     {
-        std::lock_guard<std::mutex> lock(zset_mutex);
-        hm_insert(&zset->hmap, &node->hmap);
-        tree_insert(zset, node);
+        std::vector<BTKey> keys(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            keys[i] = BTKey{nodes[i]->score, nodes[i], nodes[i]->prefix};
+        }
+        bt_clear(&zset->btree, NULL);
+        bt_build(&zset->btree, keys.data(), keys.size());
+        return;
     }
+    std::vector<AVLNode *> tnodes(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        tnodes[i] = &nodes[i]->tree;
+    }
+    zset->root = avl_build(tnodes.data(), tnodes.size());
+}
 
-    return true;
+// below this, or when smaller than the zset, insert one by one
+const size_t k_bulk_min = 64;
+
+void zset_add_bulk(ZSet *zset, const ZAddItem *items, size_t n)
+{
+    ZWriteGuard guard(zset);
+    size_t old_size = zset_size(zset);
+    ZNode *first = zset->first;
+    std::vector<ZNode *> nodes(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        nodes[i] = znode_new(zset, items[i].name, items[i].len, items[i].score);
+        hm_insert(&zset->hmap, &nodes[i]->hmap);
+    }
+    if (n < k_bulk_min || n < old_size)
+    {
+        for (ZNode *node : nodes)
+        {
+            tree_insert(zset, node);
+        }
+        return;
+    }
+
+    // sort the batch, merge with the existing order, and build in O(n)
+    std::sort(nodes.begin(), nodes.end(), &znode_less);
+    if (old_size > 0)
+    {
+        std::vector<ZNode *> merged;
+        merged.reserve(old_size + n);
+        ZIter iter;
+        ziter_init(&iter, zset, first);
+        for (size_t i = 0; iter.node || i < n;)
+        {
+            if (iter.node && (i == n || znode_less(iter.node, nodes[i])))
+            {
+                merged.push_back(iter.node);
+                ziter_next(&iter);
+            }
+            else
+            {
+                merged.push_back(nodes[i++]);
+            }
+        }
+        nodes.swap(merged);
+    }
+    tree_rebuild(zset, nodes);
 }
 
 // a helper structure for the hashtable lookup
@@ -126,10 +293,9 @@ static bool hcmp(HNode *node, HNode *key)
     return memcmp(znode->name, hkey->name, znode->len) == 0;
 }
 
-// lookup by name
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len)
+static ZNode *zset_lookup_impl(ZSet *zset, const char *name, size_t len, bool migrate)
 {
-    if (!zset->root)
+    if (hm_size(&zset->hmap) == 0)
     {
         return NULL;
     }
@@ -138,16 +304,31 @@ ZNode *zset_lookup(ZSet *zset, const char *name, size_t len)
     key.node.hcode = str_hash((uint8_t *)name, len);
     key.name = name;
     key.len = len;
-    HNode *found = hm_lookup(&zset->hmap, &key.node, &hcmp);
+    HNode *found = migrate
+        ? hm_lookup(&zset->hmap, &key.node, &hcmp)
+        : hm_find(&zset->hmap, &key.node, &hcmp);
     return found ? container_of(found, ZNode, hmap) : NULL;
 }
 
+// lookup by name
+ZNode *zset_lookup(ZSet *zset, const char *name, size_t len)
+{
+    // a shared zset may have concurrent readers, so don't migrate keys
+    return zset_lookup_impl(zset, name, len, !zset->lock);
+}
+
+ZNode *zset_find(ZSet *zset, const char *name, size_t len)
+{
+    return zset_lookup_impl(zset, name, len, false);
+}
+
 // delete a node
 void zset_delete(ZSet *zset, ZNode *node)
 {
     if (!node || !zset)
         return; // Safety check
 
+    ZWriteGuard guard(zset);
     HKey key;
     key.node.hcode = node->hmap.hcode;
     key.name = node->name;
@@ -157,24 +338,95 @@ void zset_delete(ZSet *zset, ZNode *node)
     if (!found)
         return; // Prevent crash
 
-    AVLNode *newRoot = avl_del(&node->tree);
-    if (newRoot)
+    tree_delete(zset, node);
+    znode_del(zset, node);
+} 
+
+// cut the range out of the index; the victims are returned in order
+static void tree_remove_range(
+    ZSet *zset, int64_t begin, int64_t end, std::vector<ZNode *> &victims)
+{
+    int64_t size = (int64_t)zset_size(zset);
+    if (zset->kind == ZSET_BTREE)
+    {
+        // few victims: delete them one by one; otherwise rebuild in O(n)
+        bool few = (end - begin) * 4 < size;
+        ZIter iter;
+        ziter_init(&iter, zset, zset_at(zset, few ? begin : 0));
+        std::vector<ZNode *> rest;
+        for (int64_t i = few ? begin : 0; iter.node && i < (few ? end : size); i++)
+        {
+            (begin <= i && i < end ? victims : rest).push_back(iter.node);
+            ziter_next(&iter);
+        }
+        if (few)
+        {
+            for (ZNode *node : victims)
+            {
+                tree_delete(zset, node);
+            }
+            return;
+        }
+        return tree_rebuild(zset, rest);
+    }
+    // O(log n) to detach the subtree, then O(k) to list it
+    AVLNode *left = NULL, *mid = NULL, *right = NULL;
+    avl_split(zset->root, (uint64_t)begin, &left, &mid);
+    avl_split(mid, (uint64_t)(end - begin), &mid, &right);
+    zset->root = avl_join2(left, right);
+    zset->first = begin == 0 ? (right ? zset_at(zset, 0) : NULL) : zset->first;
+    zset->last = end == size ? (left ? zset_at(zset, begin - 1) : NULL) : zset->last;
+    while (mid && mid->left)
     {
-        zset->root = newRoot;
+        mid = mid->left;
     }
+    for (AVLNode *node = mid; node; node = avl_next(node))
+    {
+        victims.push_back(container_of(node, ZNode, tree));
+    }
+}
 
-    znode_del(node);
-} 
+size_t zset_remove_range(ZSet *zset, int64_t begin, int64_t end)
+{
+    begin = std::max<int64_t>(begin, 0);
+    end = std::min<int64_t>(end, (int64_t)zset_size(zset));
+    if (begin >= end)
+    {
+        return 0;
+    }
+    ZWriteGuard guard(zset);
+    std::vector<ZNode *> victims;
+    victims.reserve(end - begin);
+    tree_remove_range(zset, begin, end, victims);
+    for (ZNode *node : victims)
+    {
+        HKey key;
+        key.node.hcode = node->hmap.hcode;
+        key.name = node->name;
+        key.len = node->len;
+        HNode *found = hm_delete(&zset->hmap, &key.node, &hcmp);
+        assert(found == &node->hmap);
+        znode_del(zset, node);
+    }
+    return victims.size();
+}
 
 // find the first (score, name) tuple that is >= key.
 ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len)
 {
+    if (zset->kind == ZSET_BTREE)
+    {
+        BTPos pos;
+        bt_seekge(&zset->btree, BTTarget{score, name, len, zname_prefix(name, len)}, &pos);
+        return pos.leaf ? (ZNode *)bt_ref(pos) : NULL;
+    }
     AVLNode *found = NULL;
     AVLNode *node = zset->root;
+    uint64_t prefix = zname_prefix(name, len);
 
     while (node)
     {
-        if (!zless(node, score, name, len))
+        if (!zless(node, score, prefix, name, len))
         {
             found = node; // Possible match
             node = node->left;
@@ -188,11 +440,23 @@ ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len)
 }
 
 // offset into the succeeding or preceding node.
-ZNode *znode_offset(ZNode *node, int64_t offset)
+ZNode *znode_offset(ZSet *zset, ZNode *node, int64_t offset)
 {
     if (!node)
         return NULL; // Ensure valid node
 
+    if (zset->kind == ZSET_BTREE)
+    {
+        // rank arithmetic: find the node's rank, then select by rank
+        BTPos pos;
+        int64_t rank = (int64_t)bt_seekge(&zset->btree, ztarget(node), &pos) + offset;
+        if (rank < 0 || !bt_at(&zset->btree, (size_t)rank, &pos))
+        {
+            return NULL;
+        }
+        return (ZNode *)bt_ref(pos);
+    }
+
     AVLNode *tnode = avl_offset(&node->tree, offset);
     if (!tnode)
         return NULL; // Prevent accessing invalid memory
@@ -200,20 +464,190 @@ ZNode *znode_offset(ZNode *node, int64_t offset)
     return container_of(tnode, ZNode, tree);
 }
 
-static void tree_dispose(AVLNode *node)
+int64_t zset_rank(ZSet *zset, ZNode *node)
 {
-    if (!node)
+    if (zset->kind == ZSET_BTREE)
+    {
+        BTPos pos;
+        return (int64_t)bt_seekge(&zset->btree, ztarget(node), &pos);
+    }
+    return (int64_t)avl_rank(&node->tree);
+}
+
+ZNode *zset_at(ZSet *zset, int64_t rank)
+{
+    if (rank < 0 || rank >= (int64_t)zset_size(zset))
+    {
+        return NULL;
+    }
+    if (zset->kind == ZSET_BTREE)
+    {
+        BTPos pos;
+        bt_at(&zset->btree, (size_t)rank, &pos);
+        return (ZNode *)bt_ref(pos);
+    }
+    // the root's rank is the size of its left subtree
+    AVLNode *root = zset->root;
+    return container_of(avl_offset(root, rank - avl_cnt(root->left)), ZNode, tree);
+}
+
+size_t zset_size(ZSet *zset)
+{
+    return hm_size(&zset->hmap);
+}
+
+ZNode *zset_first(ZSet *zset)
+{
+    return zset->first;
+}
+
+ZNode *zset_last(ZSet *zset)
+{
+    return zset->last;
+}
+
+void ziter_init(ZIter *iter, ZSet *zset, ZNode *node)
+{
+    iter->zset = zset;
+    iter->node = node;
+    if (node && zset->kind == ZSET_BTREE)
+    {
+        bt_seekge(&zset->btree, ztarget(node), &iter->pos);
+    }
+}
+
+void ziter_next(ZIter *iter)
+{
+    if (!iter->node)
+    {
+        return;
+    }
+    if (iter->zset->kind == ZSET_BTREE)
+    {
+        iter->node = bt_next(&iter->pos) ? (ZNode *)bt_ref(iter->pos) : NULL;
+        return;
+    }
+    AVLNode *next = avl_next(&iter->node->tree);
+    iter->node = next ? container_of(next, ZNode, tree) : NULL;
+}
+
+void ziter_prev(ZIter *iter)
+{
+    if (!iter->node)
     {
         return;
     }
-    tree_dispose(node->left);
-    tree_dispose(node->right);
-    znode_del(container_of(node, ZNode, tree));
+    if (iter->zset->kind == ZSET_BTREE)
+    {
+        iter->node = bt_prev(&iter->pos) ? (ZNode *)bt_ref(iter->pos) : NULL;
+        return;
+    }
+    AVLNode *prev = avl_prev(&iter->node->tree);
+    iter->node = prev ? container_of(prev, ZNode, tree) : NULL;
 }
 
 // destroy the zset
 void zset_clear(ZSet *zset) {
+    if (zset->lock)
+    {
+        pthread_rwlock_destroy(zset->lock);
+        delete zset->lock;
+        zset->lock = NULL;
+        zset->readers = 0;
+    }
     hm_clear(&zset->hmap);
-    tree_dispose(zset->root);
+    if (zset->kind == ZSET_BTREE)
+    {
+        bt_clear(&zset->btree, NULL);
+    }
+    // the nodes are freed with the arena; no need to walk the tree
+    arena_clear(&zset->arena);
     zset->root = NULL;
-}
\ No newline at end of file
+    zset->first = zset->last = NULL;
+}
+
+size_t zset_mem(ZSet *zset)
+{
+    size_t mem = zset->arena.mem + hm_mem(&zset->hmap);
+    if (zset->kind == ZSET_BTREE)
+    {
+        // leaves are between half and completely full; assume 3/4
+        mem += (zset->btree.size / (k_bt_max * 3 / 4) + 1) * sizeof(BTLeaf);
+    }
+    return mem;
+}
+
+size_t zset_slack(ZSet *zset)
+{
+    return zset->arena.mem - zset->arena.used;
+}
+
+void zset_compact(ZSet *zset)
+{
+    Arena arena;
+    HMap hmap;
+    std::vector<ZNode *> nodes;
+    nodes.reserve(zset_size(zset));
+    ZIter iter;
+    for (ziter_init(&iter, zset, zset->first); iter.node; ziter_next(&iter))
+    {
+        size_t size = znode_size(iter.node->len);
+        ZNode *node = (ZNode *)arena_alloc(&arena, size);
+        memcpy((void *)node, iter.node, size);
+        avl_init(&node->tree);
+        node->hmap.next = NULL;
+        hm_insert(&hmap, &node->hmap);
+        nodes.push_back(node);
+    }
+    hm_clear(&zset->hmap);
+    zset->hmap = hmap;
+    tree_rebuild(zset, nodes);
+    arena_clear(&zset->arena);
+    zset->arena = arena;
+}
+
+void zset_share(ZSet *zset)
+{
+    if (zset->readers++ > 0)
+    {
+        return;
+    }
+    // prefer the writer so that a stream of readers cannot starve the loop
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_t *lock = new pthread_rwlock_t;
+    int rv = pthread_rwlock_init(lock, &attr);
+    assert(rv == 0);
+    (void)rv;
+    pthread_rwlockattr_destroy(&attr);
+    zset->lock = lock;
+}
+
+void zset_unshare(ZSet *zset)
+{
+    assert(zset->readers > 0);
+    if (--zset->readers > 0)
+    {
+        return;
+    }
+    pthread_rwlock_destroy(zset->lock);
+    delete zset->lock;
+    zset->lock = NULL;
+}
+
+void zset_read_lock(ZSet *zset)
+{
+    if (zset->lock)
+    {
+        pthread_rwlock_rdlock(zset->lock);
+    }
+}
+
+void zset_read_unlock(ZSet *zset)
+{
+    if (zset->lock)
+    {
+        pthread_rwlock_unlock(zset->lock);
+    }
+}
@@ -1,26 +1,113 @@
 #ifndef ZSET_H
 #define ZSET_H
 
+#include <endian.h>
+#include <pthread.h>
+#include <string.h>
 #include "hashtable.h"
 #include "avl.h"
+#include "btree.h"
+#include "arena.h"
 
 struct ZNode {
     struct HNode hmap; // hashtable node
     struct AVLNode tree; // AVL tree node
     double score = 0; // score for sorting
-    size_t len = 0; // length of the name
+    uint64_t prefix = 0; // zname_prefix(), compared before the name
+    uint32_t len = 0; // length of the name
     char name[0]; // variable-length name
 };
 
+// the first 8 bytes of a name, zero-padded and big-endian, so that comparing
+// prefixes as integers agrees with memcmp() on the names
+inline uint64_t zname_prefix(const char *name, size_t len)
+{
+    uint8_t buf[8] = {};
+    memcpy(buf, name, len < 8 ? len : 8);
+    uint64_t v = 0;
+    memcpy(&v, buf, 8);
+    return be64toh(v);
+}
+
+// the ordered index of a zset
+enum {
+    ZSET_AVL = 0,   // an AVL tree node in each ZNode
+    ZSET_BTREE = 1, // a B+tree of (score, ZNode *) keys
+};
+
+// Concurrency: a zset belongs to the event loop thread, which is the only
+// writer, and needs no locking by default. To let another thread read it,
+// the loop calls zset_share() first and zset_unshare() once that reader is
+// done; while shared, the mutations below take the zset's write lock, and the
+// other threads wrap their reads in zset_read_lock()/zset_read_unlock().
+// Shared readers may use the ordered API (seek, rank, iterate) and
+// zset_lookup(), which then skips the hashtable migration.
 struct ZSet {
     struct AVLNode *root = NULL; // root of the AVL tree
+    BTree btree; // for ZSET_BTREE
     struct HMap hmap; // hashtable
+    uint32_t kind = ZSET_AVL;
+    pthread_rwlock_t *lock = NULL; // set while shared
+    uint32_t readers = 0; // zset_share() calls not yet undone
+    Arena arena; // owns the ZNodes
+    // the ends of the order, kept up to date by every mutation
+    ZNode *first = NULL;
+    ZNode *last = NULL;
 };
 
+// pick the index type of an empty zset
+void zset_init(ZSet *zset, uint32_t kind);
+
 bool zset_insert(ZSet *zset, const char *name, size_t len, double score);
+
+// a member to add with zset_add_bulk()
+struct ZAddItem {
+    double score = 0;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+// add new members; the names must be distinct and not in the zset
+void zset_add_bulk(ZSet *zset, const ZAddItem *items, size_t n);
 ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
+// lookup without migrating hashtable keys, for concurrent readers
+ZNode *zset_find(ZSet *zset, const char *name, size_t len);
 void zset_delete(ZSet *zset, ZNode *node);
+// remove the members ranked [begin, end); returns the number removed
+size_t zset_remove_range(ZSet *zset, int64_t begin, int64_t end);
 ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len);
 void zset_clear(ZSet *zset);
-ZNode *znode_offset(ZNode *node, int64_t offset);
+// approximate heap bytes, for accounting
+size_t zset_mem(ZSet *zset);
+// bytes of the arena not holding members: holes and the unused tail
+size_t zset_slack(ZSet *zset);
+// copy the members into a fresh arena, so the holes left by deletions are
+// released; O(n). the loop thread only, with no concurrent readers
+void zset_compact(ZSet *zset);
+// enable the reader/writer lock for one more reader; call from the loop
+// thread. the lock is dropped when the last reader calls zset_unshare()
+void zset_share(ZSet *zset);
+void zset_unshare(ZSet *zset);
+void zset_read_lock(ZSet *zset);
+void zset_read_unlock(ZSet *zset);
+ZNode *znode_offset(ZSet *zset, ZNode *node, int64_t offset);
+// 0-based position in the (score, name) order
+int64_t zset_rank(ZSet *zset, ZNode *node);
+// the node at the rank, or NULL if out of range
+ZNode *zset_at(ZSet *zset, int64_t rank);
+size_t zset_size(ZSet *zset);
+// the lowest and the highest member, O(1)
+ZNode *zset_first(ZSet *zset);
+ZNode *zset_last(ZSet *zset);
+
+// an ordered cursor; stepping costs amortized O(1)
+struct ZIter {
+    ZSet *zset = NULL;
+    ZNode *node = NULL; // NULL once past either end
+    BTPos pos; // the position of `node` for ZSET_BTREE
+};
+
+void ziter_init(ZIter *iter, ZSet *zset, ZNode *node);
+void ziter_next(ZIter *iter);
+void ziter_prev(ZIter *iter);
 #endif // ZSET_H
\ No newline at end of file